@@ -0,0 +1,81 @@
+#include "antialias.hpp"
+#include <stdexcept>
+using namespace std;
+using namespace glm;
+
+// Relative depth difference between hits on different triangles of neighbouring pixels
+// above which they are taken to lie on different surfaces
+const float AA_DEPTH_EDGE = 0.05f;
+
+AdaptiveSampler::AdaptiveSampler(int samples, float budget) : budget(budget), rays(0), refined(0) {
+	setSamples(samples);
+}
+
+void AdaptiveSampler::setSamples(int samples) {
+	if (samples != 1 && samples != 4 && samples != MAX_SAMPLES)
+		throw runtime_error("Anti-aliasing takes 1, 4 or 16 samples per pixel");
+	this->samples = samples;
+}
+
+void AdaptiveSampler::allocate(int rows, int cols, bool uniform) {
+	int count = rows * cols;
+	perPixel.assign(count, 1);
+	if (samples == 1) return;
+	if (uniform) {
+		perPixel.assign(count, samples);
+		return;
+	}
+
+	// Mark both pixels of every edge between horizontal and vertical neighbours
+	priority.assign(count, 0);
+	for (int y = 0; y < rows; y++) {
+		for (int x = 0; x < cols; x++) {
+			int i = y * cols + x;
+			if (x + 1 < cols) {
+				int e = edge(i, i + 1);
+				priority[i] = glm::max(priority[i], e);
+				priority[i + 1] = glm::max(priority[i + 1], e);
+			}
+			if (y + 1 < rows) {
+				int e = edge(i, i + cols);
+				priority[i] = glm::max(priority[i], e);
+				priority[i + cols] = glm::max(priority[i + cols], e);
+			}
+		}
+	}
+
+	// Shade edges first, then depth edges, while the budget lasts
+	long long left = (long long)(budget * count);
+	for (int p = 2; p >= 1; p--) {
+		long long marked = 0;
+		for (int i = 0; i < count; i++)
+			if (priority[i] == p) marked++;
+		int per = samples;
+		if (per > 4 && marked * (per - 1) > left) per = 4;
+		for (int i = 0; i < count && left >= per - 1; i++) {
+			if (priority[i] != p) continue;
+			perPixel[i] = per;
+			left -= per - 1;
+		}
+	}
+}
+
+int AdaptiveSampler::edge(int a, int b) const {
+	const Hit& ha = hits[a];
+	const Hit& hb = hits[b];
+	if (ha.tri == hb.tri && ha.instance == hb.instance) return 0;
+	if (colors[a] != colors[b]) return 2;
+	// A miss is infinitely far, so hit next to miss is always a depth edge
+	return glm::abs(ha.t - hb.t) > AA_DEPTH_EDGE * glm::min(ha.t, hb.t) ? 1 : 0;
+}
+
+vec2 AdaptiveSampler::sampleOffset(int pixel, int s, int count) {
+	int k = count == MAX_SAMPLES ? 4 : 2;
+	// Hash the pixel and sample into a jitter that stays the same from frame to frame
+	unsigned int h = ((unsigned int)pixel * MAX_SAMPLES + s) * 2654435761u;
+	h ^= h >> 15;
+	h *= 2246822519u;
+	h ^= h >> 13;
+	vec2 jitter((h & 0xffff) / 65536.0f, (h >> 16) / 65536.0f);
+	return (vec2(s % k, s / k) + jitter) / (float)k;
+}
@@ -0,0 +1,112 @@
+#ifndef ANTIALIAS_HPP
+#define ANTIALIAS_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "bvh.hpp"
+#include "glc.hpp"
+#include "render.hpp"
+
+// Pixel colors as floats while samples are averaged
+inline glm::vec4 sampleColor(const glm::u8vec3& c) { return glm::vec4(c.r, c.g, c.b, 255.0f); }
+inline glm::vec4 sampleColor(const glm::u8vec4& c) { return glm::vec4(c.r, c.g, c.b, c.a); }
+inline void storeColor(const glm::vec4& c, glm::u8vec3& pixel) {
+	pixel = glm::u8vec3(c.r + 0.5f, c.g + 0.5f, c.b + 0.5f);
+}
+inline void storeColor(const glm::vec4& c, glm::u8vec4& pixel) {
+	pixel = glm::u8vec4(c.r + 0.5f, c.g + 0.5f, c.b + 0.5f, c.a + 0.5f);
+}
+
+// Adaptive anti-aliasing. Every pixel is ray cast once through its corner as by renderFrame;
+// pixels whose hit differs from a neighbour's in triangle, and either in shade or in depth, get
+// extra rays on a jittered grid of strata over the pixel, the corner ray covering the first
+// stratum. The extra rays of a frame are capped by a budget: pixels whose shade differs from a
+// neighbour's are served first, then depth edges, and when a group does not fit at the full
+// sample count its pixels drop to 2x2 samples, then to as many as still fit in scan order.
+class AdaptiveSampler {
+public:
+	static const int MAX_SAMPLES = 16;
+
+	// samples: rays per edge pixel, 4 or 16 (1 turns anti-aliasing off); budget: extra rays
+	// per frame as a multiple of the pixel count
+	AdaptiveSampler(int samples = 4, float budget = 1.0f);
+
+	void setSamples(int samples);
+	int getSamples() const { return samples; }
+	void setBudget(float budget) { this->budget = budget; }
+	float getBudget() const { return budget; }
+
+	// Render a rows x cols image into pixels (row-major), anti-aliasing edges
+	template <class Shade, class Pixel, class Accel>
+	void render(const Accel& accel, const GeneralLinearCamera& cam, CameraKind kind, int rows, int cols,
+		int packetSize, Shade shade, Pixel* pixels) {
+		trace(accel, cam, kind, rows, cols, packetSize, shade, pixels, false);
+	}
+	// Reference for comparisons: samples rays in every pixel, no budget
+	template <class Shade, class Pixel, class Accel>
+	void renderUniform(const Accel& accel, const GeneralLinearCamera& cam, CameraKind kind, int rows, int cols,
+		int packetSize, Shade shade, Pixel* pixels) {
+		trace(accel, cam, kind, rows, cols, packetSize, shade, pixels, true);
+	}
+
+	// Rays cast for the last frame, one per pixel plus the extra ones
+	long long getRays() const { return rays; }
+	// Pixels of the last frame that got extra rays
+	int getRefinedPixels() const { return refined; }
+
+protected:
+	template <class Shade, class Pixel, class Accel>
+	void trace(const Accel& accel, const GeneralLinearCamera& cam, CameraKind kind, int rows, int cols,
+		int packetSize, Shade shade, Pixel* pixels, bool uniform) {
+		hits.resize(rows * cols);
+		NoInstrumentation instr;
+		renderFrame(accel, cam, kind, rows, cols, packetSize, [](const Hit& hit) { return hit; }, &hits[0], instr);
+		colors.resize(rows * cols);
+		for (int i = 0; i < rows * cols; i++)
+			colors[i] = sampleColor(shade(hits[i]));
+		allocate(rows, cols, uniform);
+
+		rays = rows * cols;
+		refined = 0;
+		for (int y = 0; y < rows; y++) {
+			for (int x = 0; x < cols; x++) {
+				int i = y * cols + x;
+				if (perPixel[i] <= 1) {
+					storeColor(colors[i], pixels[i]);
+					continue;
+				}
+				// The corner ray is the first sample, the others go through the remaining strata
+				RayPacket packet;
+				for (int s = 1; s < perPixel[i]; s++) {
+					glm::vec2 offset = sampleOffset(i, s, perPixel[i]);
+					packet.add(cam.ray(x + offset.x, y + offset.y));
+				}
+				Hit sampleHits[RayPacket::MAX_RAYS];
+				accel.intersect(packet, sampleHits);
+				glm::vec4 sum = colors[i];
+				for (int s = 0; s < packet.count; s++)
+					sum += sampleColor(shade(sampleHits[s]));
+				storeColor(sum / (float)perPixel[i], pixels[i]);
+				rays += packet.count;
+				refined++;
+			}
+		}
+	}
+
+	void allocate(int rows, int cols, bool uniform);
+	// Whether the hits of pixels a and b differ enough to alias, 2 for a shade edge, 1 for a depth edge
+	int edge(int a, int b) const;
+	// Position of sample s of count within pixel i, in pixels from its corner
+	static glm::vec2 sampleOffset(int pixel, int s, int count);
+
+	int samples;
+	float budget;
+	std::vector<Hit> hits;			// Corner hit of every pixel
+	std::vector<glm::vec4> colors;	// Its shade
+	std::vector<int> priority;		// Strongest edge a pixel lies on, 0 for none
+	std::vector<int> perPixel;		// Rays each pixel gets, 1 unless refined
+	long long rays;
+	int refined;
+};
+
+#endif
@@ -0,0 +1,976 @@
+#include "bvh.hpp"
+#include "raystats.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <stdexcept>
+using namespace std;
+using namespace glm;
+
+// Build constants
+const int BVH_BINS = 16;			// Number of SAH bins per axis
+const int BVH_MAX_DEPTH = 60;		// Traversal stacks hold 64 entries
+const unsigned int BVH_LEAF_SIZE = 2;
+const unsigned int BVH_TASK_SIZE = 4096;			// Smallest subtree handed to another thread
+const unsigned int BVH_PARALLEL_SIZE = 1 << 16;		// Smallest node whose binning is split across threads
+const int BVH_REFIT_FORK_DEPTH = 8;		// Deeper subtrees are refit by the thread that reached them
+const float BVH_SLAB_WIDEN = 1.0f + 3.0f * numeric_limits<float>::epsilon();	// 1 + 2 gamma(3), bound on the slab test's rounding
+const float BVH_BOX_PAD = 4.0f * numeric_limits<float>::epsilon();	// Leaf boxes grow by this much of their largest coordinate
+
+// Helper functions
+float surfaceArea(const vec3& bbMin, const vec3& bbMax);
+float slabTest(const BVH::Node& node, const vec3& orig, const vec3& invDir, float tMax);
+int packetMisses(const BVH::Node& node, const RayPacket& packet, const Hit* hits);
+bool boxOnPlane(const vec3& bbMin, const vec3& bbMax, const vec4& plane);
+
+// Run a and b, on two threads if fork is set
+template <class A, class B>
+static void forkJoin(bool fork, A a, B b) {
+	if (!fork) {
+		a();
+		b();
+		return;
+	}
+	thread task(a);
+	b();
+	task.join();
+}
+
+// Run f(0) .. f(count - 1) on count threads
+template <class F>
+static void parallelFor(int count, F f) {
+	vector<thread> tasks;
+	for (int i = 1; i < count; i++)
+		tasks.push_back(thread(f, i));
+	f(0);
+	for (size_t i = 0; i < tasks.size(); i++)
+		tasks[i].join();
+}
+
+// Centroid bins of the SAH sweep, one row of BVH_BINS per axis
+struct SAHBins {
+	vec3 bbMin[3][BVH_BINS];
+	vec3 bbMax[3][BVH_BINS];
+	unsigned int count[3][BVH_BINS];
+
+	SAHBins() {
+		for (int a = 0; a < 3; a++) {
+			for (int b = 0; b < BVH_BINS; b++) {
+				bbMin[a][b] = vec3(numeric_limits<float>::max());
+				bbMax[a][b] = vec3(numeric_limits<float>::lowest());
+				count[a][b] = 0;
+			}
+		}
+	}
+
+	void merge(const SAHBins& other) {
+		for (int a = 0; a < 3; a++) {
+			for (int b = 0; b < BVH_BINS; b++) {
+				bbMin[a][b] = glm::min(bbMin[a][b], other.bbMin[a][b]);
+				bbMax[a][b] = glm::max(bbMax[a][b], other.bbMax[a][b]);
+				count[a][b] += other.count[a][b];
+			}
+		}
+	}
+};
+
+// Spread the 10 low bits of v out to every third bit
+static unsigned int expandBits(unsigned int v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// Number of leading bits a and b share
+static int commonPrefix(unsigned int a, unsigned int b) {
+	if (a == b) return 32;
+	int n = 0;
+	for (unsigned int x = a ^ b; !(x & 0x80000000u); x <<= 1)
+		n++;
+	return n;
+}
+
+// Append a ray to the packet
+void RayPacket::add(const Ray& ray) {
+	origins[count] = ray.getOrigin();
+	dirs[count] = ray.getDir();
+	invDirs[count] = 1.0f / dirs[count];
+	count++;
+}
+
+// Constructor - build the hierarchy over the triangle list
+BVH::BVH(const vector<vec3>& vertices, const vector<unsigned int>& elements, BVHBuilder builder, int threads) :
+	nodeData(NULL), triData(NULL), numNodes(0), numTris(0) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	buildThreads = threads > 0 ? threads : glm::max(1, (int)thread::hardware_concurrency());
+
+	tris.resize(elements.size() / 3);
+	centroids.resize(tris.size());
+	for (int i = 0; i < tris.size(); i++) {
+		vec3 a = vertices[elements[3 * i + 0]];
+		vec3 b = vertices[elements[3 * i + 1]];
+		vec3 c = vertices[elements[3 * i + 2]];
+		tris[i].v0 = a;
+		tris[i].e1 = b - a;
+		tris[i].e2 = c - a;
+		tris[i].id = 3 * i;
+		centroids[i] = (a + b + c) / 3.0f;
+	}
+	build(builder);
+
+	stats.cached = false;
+	stats.builder = builder;
+	stats.threads = buildThreads;
+	stats.buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	computeStats();
+}
+
+void BVH::build(BVHBuilder builder) {
+	nodes.clear();
+	if (tris.empty()) return;
+
+	// A binary tree over n leaves has at most 2n - 1 nodes, so every task takes its
+	// children from a shared counter and the array never moves under them
+	nodes.resize(2 * tris.size());
+	nodeCount = 1;
+	spareThreads = buildThreads - 1;
+
+	nodes[0].leftFirst = 0;
+	nodes[0].count = tris.size();
+	if (builder == BUILD_LBVH) {
+		sortMorton();
+		emitLBVH(0, 0);
+	} else {
+		updateBounds(0);
+		subdivide(0, 0);
+	}
+	nodes.resize(nodeCount);
+	nodes.shrink_to_fit();
+	nodeData = nodes.data();
+	numNodes = nodes.size();
+	triData = tris.data();
+	numTris = tris.size();
+
+	centroids.clear();
+	centroids.shrink_to_fit();
+	mortonCodes.clear();
+	mortonCodes.shrink_to_fit();
+}
+
+// Take one of the free threads for a subtree task, release it with spareThreads++
+bool BVH::claimThread() {
+	int n = spareThreads;
+	while (n > 0) {
+		if (spareThreads.compare_exchange_weak(n, n - 1))
+			return true;
+	}
+	return false;
+}
+
+// Fit the node's bounds around its triangles
+void BVH::updateBounds(unsigned int nodeIdx) {
+	Node& node = nodes[nodeIdx];
+	node.bbMin = vec3(numeric_limits<float>::max());
+	node.bbMax = vec3(numeric_limits<float>::lowest());
+	for (unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+		const Tri& tri = tris[i];
+		node.bbMin = glm::min(node.bbMin, glm::min(tri.v0, glm::min(tri.v0 + tri.e1, tri.v0 + tri.e2)));
+		node.bbMax = glm::max(node.bbMax, glm::max(tri.v0, glm::max(tri.v0 + tri.e1, tri.v0 + tri.e2)));
+	}
+	// A ray grazing a triangle's edge or vertex can pass the triangle test a few ulps outside the
+	// exact box, ulps of the triangle's largest coordinate rather than of the axis it leaves by
+	if (node.count == 0) return;
+	vec3 extent = glm::max(glm::abs(node.bbMin), glm::abs(node.bbMax));
+	vec3 pad(glm::max(glm::max(extent.x, extent.y), extent.z) * BVH_BOX_PAD);
+	node.bbMin -= pad;
+	node.bbMax += pad;
+}
+
+// Recursively split a node where the binned SAH says it pays off
+void BVH::subdivide(unsigned int nodeIdx, int depth) {
+	if (nodes[nodeIdx].count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH) return;
+
+	int axis;
+	float splitPos;
+	float splitCost = findSplit(nodes[nodeIdx], axis, splitPos);
+	Node& node = nodes[nodeIdx];
+	float leafCost = node.count * surfaceArea(node.bbMin, node.bbMax);
+	if (splitCost >= leafCost) return;
+
+	// Partition triangles (and their centroids) around the split plane
+	int i = node.leftFirst;
+	int j = i + node.count - 1;
+	while (i <= j) {
+		if (centroids[i][axis] < splitPos) {
+			i++;
+		} else {
+			swap(tris[i], tris[j]);
+			swap(centroids[i], centroids[j]);
+			j--;
+		}
+	}
+	unsigned int leftCount = i - node.leftFirst;
+	if (leftCount == 0 || leftCount == node.count) return;
+
+	// Create child nodes
+	unsigned int leftIdx = nodeCount.fetch_add(2);
+	Node& left = nodes[leftIdx];
+	Node& right = nodes[leftIdx + 1];
+	left.leftFirst = node.leftFirst;
+	left.count = leftCount;
+	right.leftFirst = i;
+	right.count = node.count - leftCount;
+	node.leftFirst = leftIdx;
+	node.count = 0;
+
+	updateBounds(leftIdx);
+	updateBounds(leftIdx + 1);
+
+	// The children own disjoint triangle ranges, so large ones are built concurrently
+	bool fork = left.count >= BVH_TASK_SIZE && right.count >= BVH_TASK_SIZE && claimThread();
+	forkJoin(fork, [=]() { subdivide(leftIdx, depth + 1); }, [=]() { subdivide(leftIdx + 1, depth + 1); });
+	if (fork) spareThreads++;
+}
+
+// Evaluate the SAH over BVH_BINS centroid bins on every axis, return the best cost
+float BVH::findSplit(const Node& node, int& axis, float& splitPos) const {
+	float bestCost = numeric_limits<float>::max();
+	axis = 0;
+	splitPos = 0.0f;
+
+	// Near the root a node holds most of the mesh; its triangles are binned in chunks
+	// on every thread and the partial bins merged
+	int chunks = node.count >= BVH_PARALLEL_SIZE ? buildThreads : 1;
+	unsigned int chunkSize = (node.count + chunks - 1) / chunks;
+
+	vector<vec3> chunkMin(chunks, vec3(numeric_limits<float>::max()));
+	vector<vec3> chunkMax(chunks, vec3(numeric_limits<float>::lowest()));
+	parallelFor(chunks, [&](int c) {
+		unsigned int first = node.leftFirst + c * chunkSize;
+		unsigned int last = std::min(first + chunkSize, node.leftFirst + node.count);
+		for (unsigned int i = first; i < last; i++) {
+			chunkMin[c] = glm::min(chunkMin[c], centroids[i]);
+			chunkMax[c] = glm::max(chunkMax[c], centroids[i]);
+		}
+	});
+	vec3 cMin = chunkMin[0], cMax = chunkMax[0];
+	for (int c = 1; c < chunks; c++) {
+		cMin = glm::min(cMin, chunkMin[c]);
+		cMax = glm::max(cMax, chunkMax[c]);
+	}
+
+	vec3 scale;
+	for (int a = 0; a < 3; a++)
+		scale[a] = cMax[a] > cMin[a] ? BVH_BINS / (cMax[a] - cMin[a]) : 0.0f;
+
+	vector<SAHBins> bins(chunks);
+	parallelFor(chunks, [&](int c) {
+		unsigned int first = node.leftFirst + c * chunkSize;
+		unsigned int last = std::min(first + chunkSize, node.leftFirst + node.count);
+		for (unsigned int i = first; i < last; i++) {
+			const Tri& tri = tris[i];
+			vec3 triMin = glm::min(tri.v0, glm::min(tri.v0 + tri.e1, tri.v0 + tri.e2));
+			vec3 triMax = glm::max(tri.v0, glm::max(tri.v0 + tri.e1, tri.v0 + tri.e2));
+			for (int a = 0; a < 3; a++) {
+				int b = glm::min(BVH_BINS - 1, (int)((centroids[i][a] - cMin[a]) * scale[a]));
+				bins[c].count[a][b]++;
+				bins[c].bbMin[a][b] = glm::min(bins[c].bbMin[a][b], triMin);
+				bins[c].bbMax[a][b] = glm::max(bins[c].bbMax[a][b], triMax);
+			}
+		}
+	});
+	for (int c = 1; c < chunks; c++)
+		bins[0].merge(bins[c]);
+
+	for (int a = 0; a < 3; a++) {
+		if (cMax[a] == cMin[a]) continue;
+
+		// Sweep from both sides to get the cost of every plane between bins
+		float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+		unsigned int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+		vec3 lMin(numeric_limits<float>::max()), lMax(numeric_limits<float>::lowest());
+		vec3 rMin(numeric_limits<float>::max()), rMax(numeric_limits<float>::lowest());
+		unsigned int lSum = 0, rSum = 0;
+		for (int b = 0; b < BVH_BINS - 1; b++) {
+			lSum += bins[0].count[a][b];
+			lMin = glm::min(lMin, bins[0].bbMin[a][b]);
+			lMax = glm::max(lMax, bins[0].bbMax[a][b]);
+			leftCount[b] = lSum;
+			leftArea[b] = lSum ? surfaceArea(lMin, lMax) : 0.0f;
+
+			int rb = BVH_BINS - 1 - b;
+			rSum += bins[0].count[a][rb];
+			rMin = glm::min(rMin, bins[0].bbMin[a][rb]);
+			rMax = glm::max(rMax, bins[0].bbMax[a][rb]);
+			rightCount[rb - 1] = rSum;
+			rightArea[rb - 1] = rSum ? surfaceArea(rMin, rMax) : 0.0f;
+		}
+		for (int b = 0; b < BVH_BINS - 1; b++) {
+			float cost = leftCount[b] * leftArea[b] + rightCount[b] * rightArea[b];
+			if (cost < bestCost) {
+				bestCost = cost;
+				axis = a;
+				splitPos = cMin[a] + (b + 1) / scale[a];
+			}
+		}
+	}
+	return bestCost;
+}
+
+// Sort the triangles along a Z-order curve through the centroid bounds
+void BVH::sortMorton() {
+	unsigned int n = tris.size();
+	int chunks = n >= BVH_PARALLEL_SIZE ? buildThreads : 1;
+	unsigned int chunkSize = (n + chunks - 1) / chunks;
+
+	vec3 cMin(numeric_limits<float>::max()), cMax(numeric_limits<float>::lowest());
+	for (unsigned int i = 0; i < n; i++) {
+		cMin = glm::min(cMin, centroids[i]);
+		cMax = glm::max(cMax, centroids[i]);
+	}
+	vec3 extent = glm::max(cMax - cMin, vec3(numeric_limits<float>::min()));
+
+	// 10 bits per axis, sorted by (code, index) so the order is the same for any thread count
+	vector<pair<unsigned int, unsigned int> > keys(n);
+	parallelFor(chunks, [&](int c) {
+		unsigned int first = c * chunkSize, last = std::min(first + chunkSize, n);
+		for (unsigned int i = first; i < last; i++) {
+			vec3 p = glm::clamp((centroids[i] - cMin) / extent * 1024.0f, vec3(0.0f), vec3(1023.0f));
+			unsigned int code = (expandBits((unsigned int)p.x) << 2) | (expandBits((unsigned int)p.y) << 1) |
+				expandBits((unsigned int)p.z);
+			keys[i] = make_pair(code, i);
+		}
+		sort(keys.begin() + first, keys.begin() + last);
+	});
+	for (unsigned int width = chunkSize; width < n; width *= 2) {
+		for (unsigned int first = 0; first + width < n; first += 2 * width)
+			inplace_merge(keys.begin() + first, keys.begin() + first + width,
+				keys.begin() + std::min(first + 2 * width, n));
+	}
+
+	vector<Tri> sortedTris(n);
+	vector<vec3> sortedCentroids(n);
+	mortonCodes.resize(n);
+	for (unsigned int i = 0; i < n; i++) {
+		sortedTris[i] = tris[keys[i].second];
+		sortedCentroids[i] = centroids[keys[i].second];
+		mortonCodes[i] = keys[i].first;
+	}
+	tris.swap(sortedTris);
+	centroids.swap(sortedCentroids);
+}
+
+// Split the sorted range where its highest differing Morton bit flips, bounds are fitted bottom-up
+void BVH::emitLBVH(unsigned int nodeIdx, int depth) {
+	Node& node = nodes[nodeIdx];
+	if (node.count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH) {
+		updateBounds(nodeIdx);
+		return;
+	}
+
+	unsigned int first = node.leftFirst, last = first + node.count - 1;
+	unsigned int split;
+	if (mortonCodes[first] == mortonCodes[last]) {
+		// Duplicate codes, halve the range
+		split = first + node.count / 2 - 1;
+	} else {
+		// Binary search for the last code sharing more than the range's common prefix with the first
+		int prefix = commonPrefix(mortonCodes[first], mortonCodes[last]);
+		split = first;
+		unsigned int step = node.count - 1;
+		do {
+			step = (step + 1) / 2;
+			unsigned int next = split + step;
+			if (next < last && commonPrefix(mortonCodes[first], mortonCodes[next]) > prefix)
+				split = next;
+		} while (step > 1);
+	}
+
+	unsigned int leftIdx = nodeCount.fetch_add(2);
+	Node& left = nodes[leftIdx];
+	Node& right = nodes[leftIdx + 1];
+	left.leftFirst = first;
+	left.count = split - first + 1;
+	right.leftFirst = split + 1;
+	right.count = last - split;
+	node.leftFirst = leftIdx;
+	node.count = 0;
+
+	bool fork = left.count >= BVH_TASK_SIZE && right.count >= BVH_TASK_SIZE && claimThread();
+	forkJoin(fork, [=]() { emitLBVH(leftIdx, depth + 1); }, [=]() { emitLBVH(leftIdx + 1, depth + 1); });
+	if (fork) spareThreads++;
+
+	node.bbMin = glm::min(left.bbMin, right.bbMin);
+	node.bbMax = glm::max(left.bbMax, right.bbMax);
+}
+
+// Constructor - adopt a finished hierarchy kept alive by storage
+BVH::BVH(shared_ptr<const void> storage, const Node* nodes, unsigned int nodeCount,
+	const Tri* tris, unsigned int triCount, const BVHStats& stats) :
+	stats(stats), storage(storage), nodeData(nodes), triData(tris), numNodes(nodeCount), numTris(triCount),
+	buildThreads(glm::max(1, (int)thread::hardware_concurrency())) {}
+
+ostream& operator<<(ostream& out, const BVHStats& stats) {
+	if (stats.cached)
+		out << (stats.builder == BUILD_LBVH ? "LBVH" : "SAH") << " BVH from cache: ";
+	else
+		out << (stats.builder == BUILD_LBVH ? "LBVH" : "SAH") << " build, " << stats.threads << " threads: ";
+	return out << stats.buildMs << " ms, SAH cost " << stats.sahCost << ", " << stats.nodes << " nodes, "
+		<< stats.leaves << " leaves";
+}
+
+// SAH cost of the finished tree relative to its root box
+void BVH::computeStats() {
+	stats.sahCost = 0.0f;
+	stats.nodes = nodes.size();
+	stats.leaves = 0;
+	if (nodes.empty()) return;
+
+	float rootArea = glm::max(surfaceArea(nodes[0].bbMin, nodes[0].bbMax), numeric_limits<float>::min());
+	double cost = 0.0;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		const Node& node = nodes[i];
+		float area = surfaceArea(node.bbMin, node.bbMax) / rootArea;
+		if (node.count) {
+			cost += area * node.count;
+			stats.leaves++;
+		} else {
+			cost += area;
+		}
+	}
+	stats.sahCost = (float)cost;
+}
+
+ostream& operator<<(ostream& out, const RefitStats& stats) {
+	if (stats.action == REFIT_BOUNDS)
+		out << "bounds refit";
+	else if (stats.action == REFIT_SUBTREES)
+		out << "subtrees of " << stats.rebuiltTris << " triangles rebuilt";
+	else
+		out << "full rebuild";
+	return out << " in " << stats.ms << " ms, SAH cost " << stats.sahCost << " (refit bounds " << stats.costGrowth
+		<< "x as built)";
+}
+
+RefitStats BVH::refit(const vector<vec3>& vertices, const vector<unsigned int>& elements, float maxGrowth) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	if (elements.size() / 3 != numTris)
+		throw runtime_error("BVH refit needs the triangles the tree was built over");
+	adopt();
+
+	RefitStats result;
+	result.action = REFIT_BOUNDS;
+	result.costGrowth = 1.0f;
+	result.rebuiltTris = 0;
+	spareThreads = buildThreads - 1;
+	if (!nodes.empty()) {
+		// The costs as built are taken before the first refit moves anything
+		if (builtCosts.size() != nodes.size()) {
+			builtCosts.resize(nodes.size());
+			refitNode(0, 0, false, builtCosts, NULL);
+		}
+
+		// A triangle's id is its first element, wherever the build moved it to
+		unsigned int n = tris.size();
+		int chunks = n >= BVH_PARALLEL_SIZE ? buildThreads : 1;
+		unsigned int chunkSize = (n + chunks - 1) / chunks;
+		parallelFor(chunks, [&](int c) {
+			unsigned int first = c * chunkSize, last = std::min(first + chunkSize, n);
+			for (unsigned int i = first; i < last; i++) {
+				Tri& tri = tris[i];
+				vec3 a = vertices[elements[tri.id + 0]];
+				tri.v0 = a;
+				tri.e1 = vertices[elements[tri.id + 1]] - a;
+				tri.e2 = vertices[elements[tri.id + 2]] - a;
+			}
+		});
+
+		vector<float> costs(nodes.size());
+		vector<uvec2> spans(nodes.size());
+		refitNode(0, 0, true, costs, &spans);
+		result.costGrowth = costs[0] / builtCosts[0];
+
+		if (result.costGrowth > maxGrowth) {
+			// Rebuild where the cost grew, unless that is most of the tree anyway
+			vector<uvec2> roots;
+			findDegraded(0, 0, maxGrowth, costs, roots);
+			bool full = false;
+			for (size_t r = 0; r < roots.size(); r++) {
+				uvec2 span = spans[roots[r].x];
+				full = full || roots[r].x == 0 || span.x > span.y;
+				result.rebuiltTris += span.y - span.x;
+			}
+			// Subtrees are rebuilt with the binned SAH, which takes longer than a whole LBVH build
+			full = full || result.rebuiltTris > n / 2 || stats.builder == BUILD_LBVH;
+			// Nor when the boxes above them and the parts left alone already cost too much, as
+			// rebuilding them cannot shrink those
+			if (!full) {
+				float area = glm::max(surfaceArea(nodes[0].bbMin, nodes[0].bbMax), numeric_limits<float>::min());
+				full = rebuiltCost(0, maxGrowth, costs, spans) / area > maxGrowth * builtCosts[0];
+			}
+
+			if (!full) {
+				centroids.resize(n);
+				nodeCount = nodes.size();
+				for (size_t r = 0; r < roots.size(); r++) {
+					unsigned int rootIdx = roots[r].x;
+					unsigned int first = spans[rootIdx].x, count = spans[rootIdx].y - first;
+					for (unsigned int i = first; i < first + count; i++)
+						centroids[i] = tris[i].v0 + (tris[i].e1 + tris[i].e2) / 3.0f;
+					// The new nodes go after the others, the old ones are dropped below
+					nodes.resize(nodeCount + 2 * count);
+					nodes[rootIdx].leftFirst = first;
+					nodes[rootIdx].count = count;
+					updateBounds(rootIdx);
+					subdivide(rootIdx, roots[r].y);
+					builtCosts[rootIdx] = -1.0f;
+				}
+				nodes.resize(nodeCount);
+				centroids.clear();
+				centroids.shrink_to_fit();
+
+				vector<Node> compacted(1);
+				vector<float> compactedCosts(1);
+				compacted.reserve(nodes.size());
+				compactedCosts.reserve(nodes.size());
+				compact(0, 0, compacted, compactedCosts);
+				nodes.swap(compacted);
+				builtCosts.swap(compactedCosts);
+				nodeData = nodes.data();
+				numNodes = nodes.size();
+
+				costs.assign(nodes.size(), 0.0f);
+				refitNode(0, 0, false, costs, NULL);
+				for (size_t i = 0; i < nodes.size(); i++)
+					if (builtCosts[i] < 0.0f) builtCosts[i] = costs[i];
+				result.action = REFIT_SUBTREES;
+				full = costs[0] > maxGrowth * builtCosts[0];
+			}
+
+			if (full) {
+				centroids.resize(n);
+				for (unsigned int i = 0; i < n; i++)
+					centroids[i] = tris[i].v0 + (tris[i].e1 + tris[i].e2) / 3.0f;
+				build(stats.builder);
+				builtCosts.assign(nodes.size(), 0.0f);
+				refitNode(0, 0, false, builtCosts, NULL);
+				result.action = REFIT_REBUILD;
+				result.rebuiltTris = n;
+			}
+		}
+	}
+
+	result.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	if (result.action == REFIT_REBUILD) {
+		stats.cached = false;
+		stats.threads = buildThreads;
+		stats.buildMs = result.ms;
+	}
+	computeStats();
+	result.sahCost = stats.sahCost;
+	return result;
+}
+
+// Take a hierarchy held in external memory into the tree's own arrays, so it can be changed
+void BVH::adopt() {
+	if (!storage) return;
+	nodes.assign(nodeData, nodeData + numNodes);
+	tris.assign(triData, triData + numTris);
+	storage.reset();
+	nodeData = nodes.data();
+	triData = tris.data();
+}
+
+// Fit the subtree's bounds bottom-up around its triangles if fit is set, and store the SAH cost
+// of every node in it relative to the node's own box in costs, and the range of triangles under
+// it in spans (empty, x > y, where they are not contiguous). Returns the cost weighted by the
+// box area. The top subtrees are refit on the free threads.
+float BVH::refitNode(unsigned int nodeIdx, int depth, bool fit, vector<float>& costs, vector<uvec2>* spans) {
+	Node& node = nodes[nodeIdx];
+	if (node.count) {
+		if (fit) updateBounds(nodeIdx);
+		costs[nodeIdx] = (float)node.count;
+		if (spans) (*spans)[nodeIdx] = uvec2(node.leftFirst, node.leftFirst + node.count);
+		return surfaceArea(node.bbMin, node.bbMax) * node.count;
+	}
+
+	unsigned int leftIdx = node.leftFirst;
+	float leftCost, rightCost;
+	bool fork = depth < BVH_REFIT_FORK_DEPTH && claimThread();
+	forkJoin(fork, [&]() { leftCost = refitNode(leftIdx, depth + 1, fit, costs, spans); },
+		[&]() { rightCost = refitNode(leftIdx + 1, depth + 1, fit, costs, spans); });
+	if (fork) spareThreads++;
+
+	const Node& left = nodes[leftIdx];
+	const Node& right = nodes[leftIdx + 1];
+	if (fit) {
+		node.bbMin = glm::min(left.bbMin, right.bbMin);
+		node.bbMax = glm::max(left.bbMax, right.bbMax);
+	}
+	float area = surfaceArea(node.bbMin, node.bbMax);
+	float cost = area + leftCost + rightCost;
+	costs[nodeIdx] = cost / glm::max(area, numeric_limits<float>::min());
+	if (spans) {
+		// Trees built here give every subtree a contiguous range, cached treelet layouts may not
+		uvec2 l = (*spans)[leftIdx], r = (*spans)[leftIdx + 1];
+		bool adjacent = l.x <= l.y && r.x <= r.y && (l.y == r.x || r.y == l.x);
+		(*spans)[nodeIdx] = adjacent ? uvec2(std::min(l.x, r.x), std::max(l.y, r.y)) : uvec2(1, 0);
+	}
+	return cost;
+}
+
+// Collect the subtrees to rebuild as (node, depth): the topmost nodes whose cost grew past
+// maxGrowth while neither child's did, so their own split is what degraded
+void BVH::findDegraded(unsigned int nodeIdx, int depth, float maxGrowth, const vector<float>& costs,
+	vector<uvec2>& roots) {
+	const Node& node = nodes[nodeIdx];
+	if (node.count || costs[nodeIdx] <= maxGrowth * builtCosts[nodeIdx]) return;
+
+	unsigned int leftIdx = node.leftFirst;
+	bool leftGrew = costs[leftIdx] > maxGrowth * builtCosts[leftIdx];
+	bool rightGrew = costs[leftIdx + 1] > maxGrowth * builtCosts[leftIdx + 1];
+	if (!leftGrew && !rightGrew) {
+		roots.push_back(uvec2(nodeIdx, depth));
+		return;
+	}
+	if (leftGrew) findDegraded(leftIdx, depth + 1, maxGrowth, costs, roots);
+	if (rightGrew) findDegraded(leftIdx + 1, depth + 1, maxGrowth, costs, roots);
+}
+
+// Least cost, weighted by box area, the subtree can have once findDegraded's subtrees are rebuilt:
+// a rebuilt subtree costs at least its own box, and at least the boxes of its triangles, since
+// every triangle ends up in a leaf that holds its box
+float BVH::rebuiltCost(unsigned int nodeIdx, float maxGrowth, const vector<float>& costs,
+	const vector<uvec2>& spans) const {
+	const Node& node = nodes[nodeIdx];
+	float area = surfaceArea(node.bbMin, node.bbMax);
+	if (node.count || costs[nodeIdx] <= maxGrowth * builtCosts[nodeIdx]) return area * costs[nodeIdx];
+
+	unsigned int leftIdx = node.leftFirst;
+	bool leftGrew = costs[leftIdx] > maxGrowth * builtCosts[leftIdx];
+	bool rightGrew = costs[leftIdx + 1] > maxGrowth * builtCosts[leftIdx + 1];
+	if (!leftGrew && !rightGrew) {
+		float trisArea = 0.0f;
+		for (unsigned int i = spans[nodeIdx].x; i < spans[nodeIdx].y; i++) {
+			const Tri& tri = tris[i];
+			trisArea += surfaceArea(glm::min(tri.v0, glm::min(tri.v0 + tri.e1, tri.v0 + tri.e2)),
+				glm::max(tri.v0, glm::max(tri.v0 + tri.e1, tri.v0 + tri.e2)));
+		}
+		return glm::max(area, trisArea);
+	}
+	return area + rebuiltCost(leftIdx, maxGrowth, costs, spans) + rebuiltCost(leftIdx + 1, maxGrowth, costs, spans);
+}
+
+// Copy the subtree at oldIdx to newIdx of compacted depth first, children appended in pairs,
+// with its costs as built; nodes without one, added by a rebuild, get -1
+void BVH::compact(unsigned int oldIdx, unsigned int newIdx, vector<Node>& compacted, vector<float>& compactedCosts) {
+	const Node& node = nodes[oldIdx];
+	compacted[newIdx] = node;
+	compactedCosts[newIdx] = oldIdx < builtCosts.size() ? builtCosts[oldIdx] : -1.0f;
+	if (node.count) return;
+
+	unsigned int leftIdx = compacted.size();
+	compacted[newIdx].leftFirst = leftIdx;
+	compacted.resize(leftIdx + 2);
+	compactedCosts.resize(leftIdx + 2);
+	compact(node.leftFirst, leftIdx, compacted, compactedCosts);
+	compact(node.leftFirst + 1, leftIdx + 1, compacted, compactedCosts);
+}
+
+// Closest hit of a single ray
+bool BVH::intersect(const Ray& ray, Hit& hit, bool countCulled) const {
+	if (!numNodes) return false;
+
+	vec3 orig = ray.getOrigin();
+	vec3 dir = ray.getDir();
+	vec3 invDir = 1.0f / dir;
+	int prevTri = hit.tri;
+	if (slabTest(nodeData[0], orig, invDir, hit.t) == numeric_limits<float>::max()) {
+		COUNT_RAY_STAT(culledRays, countCulled);
+		return false;
+	}
+
+	unsigned int stack[64];
+	int sp = 0;
+	unsigned int nodeIdx = 0;
+	while (true) {
+		const Node& node = nodeData[nodeIdx];
+		COUNT_RAY_STAT(nodeVisits, 1);
+		if (node.count) {
+			COUNT_RAY_STAT(triTests, node.count);
+			for (unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+				intersectTri(orig, dir, triData[i], hit);
+			if (sp == 0) break;
+			nodeIdx = stack[--sp];
+			continue;
+		}
+
+		// Visit the nearer child first, defer the other
+		unsigned int near = node.leftFirst, far = node.leftFirst + 1;
+		float dNear = slabTest(nodeData[near], orig, invDir, hit.t);
+		float dFar = slabTest(nodeData[far], orig, invDir, hit.t);
+		if (dNear > dFar) {
+			swap(near, far);
+			swap(dNear, dFar);
+		}
+		if (dNear == numeric_limits<float>::max()) {
+			if (sp == 0) break;
+			nodeIdx = stack[--sp];
+		} else {
+			nodeIdx = near;
+			if (dFar != numeric_limits<float>::max()) stack[sp++] = far;
+		}
+	}
+	return hit.tri != prevTri;
+}
+
+// Closest hits of a coherent packet. Nodes are culled for the whole packet with an
+// interval-arithmetic slab test over the packet's origins and reciprocal directions.
+void BVH::intersect(const RayPacket& packet, Hit* hits, bool countCulled) const {
+	if (!numNodes || packet.count == 0) return;
+
+	vec3 oMin(numeric_limits<float>::max()), oMax(numeric_limits<float>::lowest());
+	vec3 dMin(numeric_limits<float>::max()), dMax(numeric_limits<float>::lowest());
+	vec3 rMin(numeric_limits<float>::max()), rMax(numeric_limits<float>::lowest());
+	for (int i = 0; i < packet.count; i++) {
+		oMin = glm::min(oMin, packet.origins[i]);
+		oMax = glm::max(oMax, packet.origins[i]);
+		dMin = glm::min(dMin, packet.dirs[i]);
+		dMax = glm::max(dMax, packet.dirs[i]);
+		rMin = glm::min(rMin, packet.invDirs[i]);
+		rMax = glm::max(rMax, packet.invDirs[i]);
+	}
+
+	// An axis bounds the packet when all its directions share a sign, or when every ray
+	// runs parallel to it; if fewer than two axes do, the interval test culls almost
+	// nothing and the packet is traced as single rays instead
+	enum { AXIS_FREE, AXIS_SLAB, AXIS_FLAT };
+	int axisMode[3];
+	int boundedAxes = 0;
+	for (int a = 0; a < 3; a++) {
+		if (dMin[a] > 0.0f || dMax[a] < 0.0f)
+			axisMode[a] = AXIS_SLAB;
+		else if (dMin[a] == 0.0f && dMax[a] == 0.0f)
+			axisMode[a] = AXIS_FLAT;
+		else
+			axisMode[a] = AXIS_FREE;
+		if (axisMode[a] != AXIS_FREE) boundedAxes++;
+	}
+	if (boundedAxes < 2) {
+		intersectSingle(packet, hits, countCulled);
+		return;
+	}
+
+	// Entry distance of the packet into a node, FLT_MAX if every ray misses it
+	struct IntervalTest {
+		const vec3 &oMin, &oMax, &rMin, &rMax;
+		const int* axisMode;
+		float operator()(const Node& node, float tMax) const {
+			float tNear = 0.0f, tFar = tMax;
+			for (int a = 0; a < 3; a++) {
+				if (axisMode[a] == AXIS_FLAT) {
+					if (oMax[a] < node.bbMin[a] || oMin[a] > node.bbMax[a]) return numeric_limits<float>::max();
+					continue;
+				}
+				if (axisMode[a] != AXIS_SLAB) continue;
+				// Entry and exit planes swap when the axis is traversed in the negative direction
+				float enter = rMin[a] > 0.0f ? node.bbMin[a] : node.bbMax[a];
+				float exit = rMin[a] > 0.0f ? node.bbMax[a] : node.bbMin[a];
+				float e0 = (enter - oMax[a]) * rMin[a], e1 = (enter - oMax[a]) * rMax[a];
+				float e2 = (enter - oMin[a]) * rMin[a], e3 = (enter - oMin[a]) * rMax[a];
+				float x0 = (exit - oMax[a]) * rMin[a], x1 = (exit - oMax[a]) * rMax[a];
+				float x2 = (exit - oMin[a]) * rMin[a], x3 = (exit - oMin[a]) * rMax[a];
+				tNear = glm::max(tNear, glm::min(glm::min(e0, e1), glm::min(e2, e3)));
+				tFar = glm::min(tFar, glm::max(glm::max(x0, x1), glm::max(x2, x3)));
+			}
+			return tNear <= tFar ? tNear : numeric_limits<float>::max();
+		}
+	} test = { oMin, oMax, rMin, rMax, axisMode };
+
+	if (countCulled)
+		COUNT_RAY_STAT(culledRays, packetMisses(nodeData[0], packet, hits));
+
+	// Farthest closest-hit in the packet bounds how deep any ray still needs to look
+	float tMax = 0.0f;
+	for (int i = 0; i < packet.count; i++) tMax = glm::max(tMax, hits[i].t);
+
+	// Each stack entry remembers the first ray known to still be active in that subtree,
+	// so a coherent packet usually enters a node after a single ray's slab test
+	struct Entry {
+		unsigned int node;
+		int first;
+	} stack[64];
+	int sp = 0;
+	stack[sp].node = 0;
+	stack[sp++].first = 0;
+	while (sp > 0) {
+		Entry entry = stack[--sp];
+		const Node& node = nodeData[entry.node];
+		COUNT_RAY_STAT(nodeVisits, 1);
+		if (test(node, tMax) == numeric_limits<float>::max()) continue;
+
+		int first = entry.first;
+		while (first < packet.count &&
+			slabTest(node, packet.origins[first], packet.invDirs[first], hits[first].t) == numeric_limits<float>::max())
+			first++;
+		if (first == packet.count) continue;
+
+		if (node.count) {
+			for (int r = first; r < packet.count; r++) {
+				if (r > first &&
+					slabTest(node, packet.origins[r], packet.invDirs[r], hits[r].t) == numeric_limits<float>::max())
+					continue;
+				COUNT_RAY_STAT(triTests, node.count);
+				for (unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+					intersectTri(packet.origins[r], packet.dirs[r], triData[i], hits[r]);
+			}
+			tMax = 0.0f;
+			for (int i = 0; i < packet.count; i++) tMax = glm::max(tMax, hits[i].t);
+			continue;
+		}
+
+		// Push the farther child first so the nearer one, as seen by the first active ray, is visited next
+		unsigned int near = node.leftFirst, far = node.leftFirst + 1;
+		if (slabTest(nodeData[near], packet.origins[first], packet.invDirs[first], hits[first].t) >
+			slabTest(nodeData[far], packet.origins[first], packet.invDirs[first], hits[first].t))
+			swap(near, far);
+		stack[sp].node = far;
+		stack[sp++].first = first;
+		stack[sp].node = near;
+		stack[sp++].first = first;
+	}
+}
+
+// Fallback for divergent packets
+void BVH::intersectSingle(const RayPacket& packet, Hit* hits, bool countCulled) const {
+	for (int i = 0; i < packet.count; i++)
+		intersect(Ray(packet.origins[i], packet.dirs[i]), hits[i], countCulled);
+}
+
+// Every node whose box the plane crosses inside the query region, and the triangles it cuts
+void BVH::intersectPlane(const PlaneQuery& query, vector<PlaneSegment>& segments) const {
+	if (!numNodes) return;
+
+	const vec4& plane = query.plane;
+	vec3 normal(plane);
+	unsigned int stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		const Node& node = nodeData[stack[--sp]];
+		if (!boxInQuery(node.bbMin, node.bbMax, query)) continue;
+		if (!node.count) {
+			stack[sp++] = node.leftFirst + 1;
+			stack[sp++] = node.leftFirst;
+			continue;
+		}
+
+		for (unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+			const Tri& tri = triData[i];
+			vec3 v[3] = { tri.v0, tri.v0 + tri.e1, tri.v0 + tri.e2 };
+			float d[3];
+			for (int k = 0; k < 3; k++) d[k] = dot(normal, v[k]) + plane.w;
+
+			// Vertices on the plane and crossings of edges whose ends lie on opposite sides
+			vec3 cut[3];
+			int n = 0;
+			for (int k = 0; k < 3; k++) {
+				int next = (k + 1) % 3;
+				if (d[k] == 0.0f)
+					cut[n++] = v[k];
+				else if (d[next] != 0.0f && (d[k] < 0.0f) != (d[next] < 0.0f))
+					cut[n++] = v[k] + (v[next] - v[k]) * (d[k] / (d[k] - d[next]));
+			}
+			if (n != 2) continue;
+
+			PlaneSegment seg;
+			seg.p0 = cut[0];
+			seg.p1 = cut[1];
+			seg.tri = tri.id;
+			seg.instance = -1;
+			segments.push_back(seg);
+		}
+	}
+}
+
+// Moller-Trumbore test, keeps the hit if it is closer than the current one
+void BVH::intersectTri(const vec3& orig, const vec3& dir, const Tri& tri, Hit& hit) {
+	vec3 pvec = cross(dir, tri.e2);
+	float det = dot(tri.e1, pvec);
+	if (fabs(det) < 1e-8f) return;		// Ray is parallel to the triangle plane
+	float invDet = 1.0f / det;
+
+	vec3 tvec = orig - tri.v0;
+	float beta = dot(tvec, pvec) * invDet;
+	if (beta <= 0.0f || beta >= 1.0f) return;
+	vec3 qvec = cross(tvec, tri.e1);
+	float gamma = dot(dir, qvec) * invDet;
+	if (gamma <= 0.0f || beta + gamma >= 1.0f) return;
+
+	float t = dot(tri.e2, qvec) * invDet;
+	if (t > 0.0f && t < hit.t) {
+		hit.t = t;
+		hit.tri = tri.id;
+	}
+}
+
+float surfaceArea(const vec3& bbMin, const vec3& bbMax) {
+	vec3 e = bbMax - bbMin;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// Entry distance of a ray into a node, FLT_MAX on a miss or if the node lies beyond tMax
+float slabTest(const BVH::Node& node, const vec3& orig, const vec3& invDir, float tMax) {
+	float tNear, tFar;
+	if (slabInterval(node.bbMin, node.bbMax, orig, invDir, tNear, tFar) && tNear < tMax && tFar > 0.0f)
+		return tNear;
+	return numeric_limits<float>::max();
+}
+
+// Rays of the packet that miss the node, for statistics only
+int packetMisses(const BVH::Node& node, const RayPacket& packet, const Hit* hits) {
+	int misses = 0;
+	for (int i = 0; i < packet.count; i++)
+		if (slabTest(node, packet.origins[i], packet.invDirs[i], hits[i].t) == numeric_limits<float>::max())
+			misses++;
+	return misses;
+}
+
+bool slabInterval(const vec3& bbMin, const vec3& bbMax, const vec3& orig, const vec3& invDir, float& tNear,
+	float& tFar) {
+	tNear = -numeric_limits<float>::infinity();
+	tFar = numeric_limits<float>::infinity();
+	for (int a = 0; a < 3; a++) {
+		float t1 = (bbMin[a] - orig[a]) * invDir[a];
+		float t2 = (bbMax[a] - orig[a]) * invDir[a];
+		if (std::isnan(t1) || std::isnan(t2)) continue;
+		tNear = glm::max(tNear, glm::min(t1, t2));
+		tFar = glm::min(tFar, glm::max(t1, t2));
+	}
+	// Rounding can put the exit of a ray through an edge or corner of the box just before its entry
+	tFar *= BVH_SLAB_WIDEN;
+	return tFar >= tNear;
+}
+
+// Whether the plane passes through the box: the box's extent along the normal reaches it
+bool boxOnPlane(const vec3& bbMin, const vec3& bbMax, const vec4& plane) {
+	vec3 normal(plane);
+	vec3 center = (bbMin + bbMax) * 0.5f;
+	vec3 extent = (bbMax - bbMin) * 0.5f;
+	return fabs(dot(normal, center) + plane.w) <= dot(abs(normal), extent);
+}
+
+// Whether the box reaches the query plane and no bound leaves the whole box outside
+bool boxInQuery(const vec3& bbMin, const vec3& bbMax, const PlaneQuery& query) {
+	if (!boxOnPlane(bbMin, bbMax, query.plane)) return false;
+	vec3 center = (bbMin + bbMax) * 0.5f;
+	vec3 extent = (bbMax - bbMin) * 0.5f;
+	for (int i = 0; i < query.boundCount; i++) {
+		vec3 normal(query.bounds[i]);
+		if (dot(normal, center) + query.bounds[i].w + dot(abs(normal), extent) < 0.0f) return false;
+	}
+	return true;
+}
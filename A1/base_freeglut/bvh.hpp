@@ -0,0 +1,209 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <vector>
+#include <limits>
+#include <atomic>
+#include <ostream>
+#include <memory>
+#include <glm/glm.hpp>
+#include "ray.hpp"
+
+// Closest hit found along a ray
+struct Hit {
+	float t;		// Distance along the ray
+	int tri;		// Index of the triangle's first element in Mesh::v_elements, -1 on miss
+	int instance;	// Instance hit when tracing a TLAS, -1 otherwise
+	Hit() : t(std::numeric_limits<float>::max()), tri(-1), instance(-1) {}
+};
+
+// Cut of the scene by a plane, limited to the convex region where
+// dot(bounds[i].xyz, p) + bounds[i].w >= 0 for every bound
+struct PlaneQuery {
+	static const int MAX_BOUNDS = 4;
+
+	glm::vec4 plane;		// dot(plane.xyz, p) + plane.w = 0
+	glm::vec4 bounds[MAX_BOUNDS];
+	int boundCount;
+
+	PlaneQuery() : boundCount(0) {}
+	// Same query for geometry placed by objectToWorld, in that geometry's space
+	PlaneQuery transformed(const glm::mat4& objectToWorld) const {
+		PlaneQuery query;
+		glm::mat4 xform = glm::transpose(objectToWorld);
+		query.plane = xform * plane;
+		for (int i = 0; i < boundCount; i++)
+			query.bounds[i] = xform * bounds[i];
+		query.boundCount = boundCount;
+		return query;
+	}
+};
+
+// Whether the query plane passes through the box inside the query region
+bool boxInQuery(const glm::vec3& bbMin, const glm::vec3& bbMax, const PlaneQuery& query);
+
+// Distances at which the ray enters and leaves the box, false if its line misses the box. A ray
+// parallel to an axis whose origin lies on one of the box's planes there gives 0 * inf = NaN for
+// that plane; the axis then bounds nothing, so rays running along a face still enter the box.
+bool slabInterval(const glm::vec3& bbMin, const glm::vec3& bbMax, const glm::vec3& orig, const glm::vec3& invDir,
+	float& tNear, float& tFar);
+
+// Piece of a triangle cut by a plane
+struct PlaneSegment {
+	glm::vec3 p0, p1;
+	int tri;		// As in Hit
+	int instance;
+};
+
+// Bundle of coherent rays traced through the BVH together
+struct RayPacket {
+	static const int MAX_RAYS = 16;		// Enough for a 4x4 pixel block
+
+	glm::vec3 origins[MAX_RAYS];
+	glm::vec3 dirs[MAX_RAYS];
+	glm::vec3 invDirs[MAX_RAYS];
+	int count;
+
+	RayPacket() : count(0) {}
+	void add(const Ray& ray);
+};
+
+// Construction algorithm
+enum BVHBuilder {
+	BUILD_SAH,		// Binned SAH, best traversal quality
+	BUILD_LBVH		// Morton-code LBVH, builds several times faster at some traversal cost
+};
+
+// Report of a finished build
+struct BVHStats {
+	bool cached;		// Loaded from a cache file, buildMs is then the load time
+	BVHBuilder builder;
+	int threads;
+	double buildMs;
+	float sahCost;		// Expected cost of a ray hitting the root box, one unit per node visit and per triangle test
+	unsigned int nodes;
+	unsigned int leaves;
+};
+
+// One-line summary, e.g. "SAH build, 8 threads: 41.2 ms, SAH cost 19.6, 277709 nodes"
+std::ostream& operator<<(std::ostream& out, const BVHStats& stats);
+
+// What BVH::refit did to keep the tree fit for the moved triangles
+enum RefitAction {
+	REFIT_BOUNDS,		// Only the node bounds were updated
+	REFIT_SUBTREES,		// Subtrees whose cost grew too much were rebuilt
+	REFIT_REBUILD		// The whole tree was rebuilt
+};
+
+// Report of a refit
+struct RefitStats {
+	RefitAction action;
+	double ms;
+	float costGrowth;			// SAH cost with refit bounds over the cost when the tree was built
+	float sahCost;				// Cost of the tree left in place
+	unsigned int rebuiltTris;	// Triangles under rebuilt nodes
+};
+
+// One-line summary, e.g. "bounds refit in 3.1 ms, SAH cost 21.2 (1.08x as built)"
+std::ostream& operator<<(std::ostream& out, const RefitStats& stats);
+
+// Bounding volume hierarchy over the triangles of a mesh. Large subtrees are built as
+// independent tasks, and the binning of the top SAH splits is spread across threads.
+class BVH {
+public:
+	// threads = 0 uses every hardware thread
+	BVH(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& elements,
+		BVHBuilder builder = BUILD_SAH, int threads = 0);
+
+	// Find the closest triangle hit by the ray, returns false on a miss. Rays that miss the root
+	// box count as culledRays in GLC_STATS builds, unless countCulled is false (a TLAS tracing
+	// one of its instances counts its own).
+	bool intersect(const Ray& ray, Hit& hit, bool countCulled = true) const;
+	// Find the closest hits of every ray in the packet, hits must hold packet.count entries
+	void intersect(const RayPacket& packet, Hit* hits, bool countCulled = true) const;
+	// Append the segments where the query plane cuts triangles in nodes that reach the query
+	// region, skipping triangles that lie in the plane or only touch it
+	void intersectPlane(const PlaneQuery& query, std::vector<PlaneSegment>& segments) const;
+
+	// Move the triangles to new vertex positions, with the elements the tree was built over, and
+	// fit the node bounds around them bottom-up. The topology is kept, so the tree degrades as
+	// triangles move apart: once its SAH cost exceeds maxGrowth times its cost as built, the
+	// subtrees that degraded are rebuilt with the binned SAH, or the whole tree when they hold
+	// most of the triangles, rebuilding them is not enough, or it is an LBVH, which is rebuilt
+	// faster than that. A tree adopted from external memory is copied the first time it is refit.
+	RefitStats refit(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& elements,
+		float maxGrowth = 1.5f);
+
+	// Node layout: interior nodes store their left child in leftFirst (right is leftFirst + 1),
+	// leaves store the index of their first triangle and a non-zero count
+	struct Node {
+		glm::vec3 bbMin;
+		unsigned int leftFirst;
+		glm::vec3 bbMax;
+		unsigned int count;
+	};
+
+	// Triangle stored with precomputed edges for the intersection test
+	struct Tri {
+		glm::vec3 v0;
+		glm::vec3 e1;	// v1 - v0
+		glm::vec3 e2;	// v2 - v0
+		int id;			// Index of the first element in Mesh::v_elements
+	};
+
+	// Adopt a finished hierarchy held in external memory, such as a mapped cache file, without
+	// copying it; storage keeps that memory alive. The root is nodes[0].
+	BVH(std::shared_ptr<const void> storage, const Node* nodes, unsigned int nodeCount,
+		const Tri* tris, unsigned int triCount, const BVHStats& stats);
+
+	const Node* getNodes() const { return nodeData; }
+	unsigned int getNodeCount() const { return numNodes; }
+	const Tri* getTris() const { return triData; }
+	unsigned int getTriCount() const { return numTris; }
+	const BVHStats& getStats() const { return stats; }
+
+	// Ray-triangle test used by traversal, keeps the hit if it is closer than the current one
+	static void intersectTri(const glm::vec3& orig, const glm::vec3& dir, const Tri& tri, Hit& hit);
+
+protected:
+	void build(BVHBuilder builder);
+	void updateBounds(unsigned int nodeIdx);
+	void subdivide(unsigned int nodeIdx, int depth);
+	float findSplit(const Node& node, int& axis, float& splitPos) const;
+	void sortMorton();
+	void emitLBVH(unsigned int nodeIdx, int depth);
+	bool claimThread();
+	void computeStats();
+	void adopt();
+	float refitNode(unsigned int nodeIdx, int depth, bool fit, std::vector<float>& costs,
+		std::vector<glm::uvec2>* spans);
+	void findDegraded(unsigned int nodeIdx, int depth, float maxGrowth, const std::vector<float>& costs,
+		std::vector<glm::uvec2>& roots);
+	float rebuiltCost(unsigned int nodeIdx, float maxGrowth, const std::vector<float>& costs,
+		const std::vector<glm::uvec2>& spans) const;
+	void compact(unsigned int oldIdx, unsigned int newIdx, std::vector<Node>& compacted,
+		std::vector<float>& compactedCosts);
+
+	void intersectSingle(const RayPacket& packet, Hit* hits, bool countCulled) const;
+
+	std::vector<Node> nodes;		// Storage of a tree built here
+	std::vector<Tri> tris;
+	std::vector<glm::vec3> centroids;	// Per-triangle centroids, only used while building
+	std::vector<unsigned int> mortonCodes;	// Per-triangle Morton codes, only used by the LBVH build
+	std::vector<float> builtCosts;	// SAH cost of every subtree as built, relative to its own box; kept once refit
+	BVHStats stats;
+
+	// Arrays traversed, in nodes/tris or in external storage
+	std::shared_ptr<const void> storage;
+	const Node* nodeData;
+	const Tri* triData;
+	unsigned int numNodes;
+	unsigned int numTris;
+
+	// Build state shared by the tasks
+	int buildThreads;
+	std::atomic<unsigned int> nodeCount;	// Nodes handed out so far
+	std::atomic<int> spareThreads;			// Threads still free to take a subtree
+};
+
+#endif
@@ -0,0 +1,485 @@
+#include "bvhcache.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <deque>
+#include <algorithm>
+using namespace std;
+using namespace glm;
+
+// Bump whenever the node or triangle layout, or a builder's output, changes
+const uint32_t BVH_CACHE_VERSION = 3;
+const char BVH_CACHE_MAGIC[8] = { 'G', 'L', 'C', 'B', 'V', 'H', '\0', '\0' };
+const uint32_t BVH_CACHE_ENDIAN = 0x01020304;
+const uint64_t BVH_CACHE_ALIGN = 64;
+const uint64_t BVH_CACHE_PAGE = 4096;		// Treelets are cut to fit pages of this size
+
+// File layout: header, then the node array at a page boundary in treelet order and the triangle
+// array at an aligned offset, both exactly as BVH traverses them
+struct BVHCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;		// Written as BVH_CACHE_ENDIAN, reads differently on the other byte order
+	uint32_t nodeSize;		// sizeof(BVH::Node) and sizeof(BVH::Tri) of the writer
+	uint32_t triSize;
+	uint64_t meshHash;
+	uint32_t builder;
+	uint32_t nodeCount;
+	uint32_t triCount;
+	uint32_t leafCount;
+	float sahCost;
+	uint32_t paddingNodes;	// Unused nodes of nodeCount that fill the ends of pages
+	uint64_t nodeOffset;
+	uint64_t triOffset;
+};
+
+// Helper functions
+static uint64_t alignUp(uint64_t offset, uint64_t align = BVH_CACHE_ALIGN) {
+	return (offset + align - 1) / align * align;
+}
+
+static string cacheFilename(const string& cacheDir, uint64_t hash, BVHBuilder builder) {
+	ostringstream name;
+	name << cacheDir << "/" << hex << setw(16) << setfill('0') << hash
+		<< (builder == BUILD_LBVH ? ".lbvh" : ".sah") << ".bvh";
+	return name.str();
+}
+
+static void makeDirectory(const string& dir) {
+#ifdef _WIN32
+	_mkdir(dir.c_str());
+#else
+	mkdir(dir.c_str(), 0755);
+#endif
+}
+
+MappedFile::MappedFile(string filename) : ptr(NULL), length(0) {
+#ifdef _WIN32
+	file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		throw runtime_error("Could not open file: " + filename);
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	length = (size_t)fileSize.QuadPart;
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping)
+		ptr = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr) {
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		throw runtime_error("Could not map file: " + filename);
+	}
+#else
+	fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw runtime_error("Could not open file: " + filename);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		throw runtime_error("Could not map file: " + filename);
+	}
+	length = st.st_size;
+	void* p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		throw runtime_error("Could not map file: " + filename);
+	}
+	ptr = (const char*)p;
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+	UnmapViewOfFile(ptr);
+	CloseHandle(mapping);
+	CloseHandle(file);
+#else
+	munmap((void*)ptr, length);
+	close(fd);
+#endif
+}
+
+size_t MappedFile::residentBytes() const {
+#ifdef _WIN32
+	return 0;
+#else
+	size_t page = sysconf(_SC_PAGESIZE);
+	vector<unsigned char> resident((length + page - 1) / page);
+#ifdef __APPLE__
+	if (mincore((void*)ptr, length, (char*)resident.data()) != 0) return 0;
+#else
+	if (mincore((void*)ptr, length, resident.data()) != 0) return 0;
+#endif
+	size_t pages = 0;
+	for (size_t i = 0; i < resident.size(); i++)
+		pages += resident[i] & 1;
+	return pages * page;
+#endif
+}
+
+void MappedFile::evict(size_t offset) const {
+#ifndef _WIN32
+	size_t page = sysconf(_SC_PAGESIZE);
+	offset = (offset + page - 1) / page * page;
+	if (offset >= length) return;
+	// The mapping is read-only, so dropped pages are read back from the file when touched again
+	madvise((void*)(ptr + offset), length - offset, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, offset, length - offset, POSIX_FADV_DONTNEED);
+#endif
+#endif
+}
+
+void MappedFile::adviseRandom() const {
+#ifndef _WIN32
+	madvise((void*)ptr, length, MADV_RANDOM);
+#endif
+}
+
+// 64-bit FNV-1a over 8-byte words, fast enough to hash multi-million triangle meshes at startup
+static void mixHash(uint64_t& hash, const void* data, size_t bytes) {
+	const unsigned char* p = (const unsigned char*)data;
+	size_t i = 0;
+	for (; i + 8 <= bytes; i += 8) {
+		uint64_t word;
+		memcpy(&word, p + i, 8);
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	for (; i < bytes; i++)
+		hash = (hash ^ p[i]) * 1099511628211ull;
+	hash = (hash ^ bytes) * 1099511628211ull;
+}
+
+uint64_t meshHash(const vector<vec3>& vertices, const vector<unsigned int>& elements) {
+	uint64_t hash = 14695981039346656037ull;
+	mixHash(hash, vertices.data(), vertices.size() * sizeof(vec3));
+	mixHash(hash, elements.data(), elements.size() * sizeof(unsigned int));
+	return hash;
+}
+
+uint64_t fileIdentity(const string& filename) {
+#ifdef _WIN32
+	struct _stat64 info;
+	char path[MAX_PATH];
+	if (_stat64(filename.c_str(), &info) != 0 || !_fullpath(path, filename.c_str(), sizeof(path)))
+		return 0;
+	string absolute(path);
+#else
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0) return 0;
+	char* path = realpath(filename.c_str(), NULL);
+	if (!path) return 0;
+	string absolute(path);
+	free(path);
+#endif
+	// Apart from meshHash, which hashes arrays rather than a name
+	const char kind[] = "file";
+	uint64_t hash = 14695981039346656037ull;
+	int64_t size = info.st_size, mtime = info.st_mtime;
+	mixHash(hash, kind, sizeof(kind));
+	mixHash(hash, absolute.data(), absolute.size());
+	mixHash(hash, &size, sizeof(size));
+	mixHash(hash, &mtime, sizeof(mtime));
+	return hash;
+}
+
+// Map the cache file and check it was written for this mesh and builder; NULL if not usable.
+// mapped, if given, receives the file; built gives the stats of a tree just built and saved there.
+static BVH* loadBVHFile(const string& filename, uint64_t hash, BVHBuilder builder,
+	chrono::steady_clock::time_point start, shared_ptr<MappedFile>* mapped, const BVHStats* built = NULL) {
+	shared_ptr<MappedFile> file;
+	try {
+		file = make_shared<MappedFile>(filename);
+	} catch (const exception&) {
+		return NULL;
+	}
+
+	if (file->size() < sizeof(BVHCacheHeader)) return NULL;
+	const BVHCacheHeader& header = *(const BVHCacheHeader*)file->data();
+	if (memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC)) != 0 ||
+		header.version != BVH_CACHE_VERSION || header.endian != BVH_CACHE_ENDIAN ||
+		header.nodeSize != sizeof(BVH::Node) || header.triSize != sizeof(BVH::Tri) ||
+		header.meshHash != hash || header.builder != (uint32_t)builder)
+		return NULL;
+	if (header.nodeOffset % BVH_CACHE_PAGE || header.triOffset % BVH_CACHE_ALIGN ||
+		header.paddingNodes >= header.nodeCount ||
+		header.nodeOffset + (uint64_t)header.nodeCount * sizeof(BVH::Node) > file->size() ||
+		header.triOffset + (uint64_t)header.triCount * sizeof(BVH::Tri) > file->size())
+		return NULL;
+
+	BVHStats stats;
+	stats.cached = true;
+	stats.builder = builder;
+	stats.threads = 1;
+	stats.buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	stats.sahCost = header.sahCost;
+	stats.nodes = header.nodeCount - header.paddingNodes;
+	stats.leaves = header.leafCount;
+	if (built) stats = *built;
+	if (mapped) *mapped = file;
+	return new BVH(file, (const BVH::Node*)(file->data() + header.nodeOffset), header.nodeCount,
+		(const BVH::Tri*)(file->data() + header.triOffset), header.triCount, stats);
+}
+
+// Reorder the tree into treelets of a page each: a treelet takes the nodes nearest its root,
+// breadth first and sibling pairs together, until its page is full, and the pairs left over root
+// treelets of their own, placed depth first after it, so a ray crosses a page boundary only every
+// few levels. A treelet that does not fit in the rest of a page starts on the next one once less
+// than a quarter of the page is left; padding every such page would grow the node array by a
+// third for little gain, as small subtrees near the leaves share pages anyway. Triangles follow
+// their leaves in the new order, so the triangles of a treelet lie together too. Returns the
+// number of padding nodes added.
+static uint32_t treeletLayout(const BVH& bvh, vector<BVH::Node>& nodes, vector<BVH::Tri>& tris) {
+	const BVH::Node* src = bvh.getNodes();
+	unsigned int count = bvh.getNodeCount();
+	nodes.clear();
+	tris.clear();
+	if (!count) return 0;
+	const size_t pageNodes = BVH_CACHE_PAGE / sizeof(BVH::Node);
+
+	// Children are always stored after their parent, so subtree sizes add up back to front
+	vector<unsigned int> subtree(count, 1);
+	for (unsigned int i = count; i-- > 0;)
+		if (!src[i].count) subtree[i] += subtree[src[i].leftFirst] + subtree[src[i].leftFirst + 1];
+
+	BVH::Node padding;
+	padding.bbMin = padding.bbMax = vec3(0.0f);
+	padding.leftFirst = padding.count = 0;
+	uint32_t paddingNodes = 0;
+	vector<unsigned int> newIndex(count);
+	nodes.reserve(count + count / 8);
+	auto place = [&](unsigned int i) {
+		newIndex[i] = nodes.size();
+		nodes.push_back(src[i]);
+	};
+
+	// Fill the page up to pageEnd with pairs from the frontier, breadth first; the pairs that do
+	// not fit are pushed to start treelets of their own, the first one on top
+	vector<unsigned int> treelets;		// Left child of the pair at the root of each treelet left
+	auto fill = [&](deque<unsigned int>& frontier, size_t pageEnd) {
+		while (!frontier.empty() && nodes.size() + 2 <= pageEnd) {
+			unsigned int left = frontier.front();
+			frontier.pop_front();
+			place(left);
+			place(left + 1);
+			for (unsigned int k = left; k <= left + 1; k++)
+				if (!src[k].count) frontier.push_back(src[k].leftFirst);
+		}
+		treelets.insert(treelets.end(), frontier.rbegin(), frontier.rend());
+	};
+
+	deque<unsigned int> frontier;
+	place(0);
+	if (!src[0].count) frontier.push_back(src[0].leftFirst);
+	fill(frontier, pageNodes);
+	while (!treelets.empty()) {
+		unsigned int left = treelets.back();
+		treelets.pop_back();
+		size_t need = std::min<size_t>(subtree[left] + subtree[left + 1], pageNodes);
+		size_t rest = pageNodes - nodes.size() % pageNodes;
+		if (need > rest && (rest < 2 || rest < pageNodes / 4)) {
+			nodes.insert(nodes.end(), rest, padding);
+			paddingNodes += rest;
+		}
+		frontier.assign(1, left);
+		fill(frontier, (nodes.size() / pageNodes + 1) * pageNodes);
+	}
+
+	// Point interior nodes at their children's new places and leaves at their triangles
+	tris.reserve(bvh.getTriCount());
+	for (unsigned int i = 0; i < count; i++) {
+		BVH::Node& node = nodes[newIndex[i]];
+		if (!node.count) node.leftFirst = newIndex[src[i].leftFirst];
+	}
+	for (size_t i = 0; i < nodes.size(); i++) {
+		BVH::Node& node = nodes[i];
+		if (!node.count) continue;
+		const BVH::Tri* first = bvh.getTris() + node.leftFirst;
+		node.leftFirst = tris.size();
+		tris.insert(tris.end(), first, first + node.count);
+	}
+	return paddingNodes;
+}
+
+// Write to a temporary name first so a crash never leaves a truncated cache file behind
+static void saveBVHFile(const string& filename, uint64_t hash, const BVH& bvh) {
+	vector<BVH::Node> nodes;
+	vector<BVH::Tri> tris;
+	uint32_t paddingNodes = treeletLayout(bvh, nodes, tris);
+
+	BVHCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+	header.version = BVH_CACHE_VERSION;
+	header.endian = BVH_CACHE_ENDIAN;
+	header.nodeSize = sizeof(BVH::Node);
+	header.triSize = sizeof(BVH::Tri);
+	header.meshHash = hash;
+	header.builder = bvh.getStats().builder;
+	header.nodeCount = nodes.size();
+	header.triCount = tris.size();
+	header.leafCount = bvh.getStats().leaves;
+	header.sahCost = bvh.getStats().sahCost;
+	header.paddingNodes = paddingNodes;
+	header.nodeOffset = alignUp(sizeof(header), BVH_CACHE_PAGE);
+	header.triOffset = alignUp(header.nodeOffset + (uint64_t)header.nodeCount * sizeof(BVH::Node));
+
+	string tmpName = filename + ".tmp";
+	{
+		ofstream file(tmpName, ios::binary);
+		if (!file.is_open()) {
+			cerr << "Could not write BVH cache file: " << tmpName << endl;
+			return;
+		}
+		const char zeros[BVH_CACHE_PAGE] = {};
+		file.write((const char*)&header, sizeof(header));
+		file.write(zeros, header.nodeOffset - sizeof(header));
+		file.write((const char*)nodes.data(), (streamsize)header.nodeCount * sizeof(BVH::Node));
+		file.write(zeros, header.triOffset - header.nodeOffset - header.nodeCount * sizeof(BVH::Node));
+		file.write((const char*)tris.data(), (streamsize)header.triCount * sizeof(BVH::Tri));
+		if (!file) {
+			cerr << "Could not write BVH cache file: " << tmpName << endl;
+			file.close();
+			remove(tmpName.c_str());
+			return;
+		}
+	}
+	remove(filename.c_str());
+	if (rename(tmpName.c_str(), filename.c_str()) != 0) {
+		cerr << "Could not write BVH cache file: " << filename << endl;
+		remove(tmpName.c_str());
+	}
+}
+
+// The BVH cached under hash, or else the one build() returns, saved under hash for the next run
+template <class Build>
+static BVH* cachedBVH(const string& cacheDir, uint64_t hash, BVHBuilder builder, shared_ptr<MappedFile>* mapped,
+	chrono::steady_clock::time_point start, Build build) {
+	string filename = cacheFilename(cacheDir, hash, builder);
+	BVH* bvh = loadBVHFile(filename, hash, builder, start, mapped);
+	if (bvh)
+		return bvh;
+
+	bvh = build();
+	makeDirectory(cacheDir);
+	saveBVHFile(filename, hash, *bvh);
+	if (!mapped)
+		return bvh;
+
+	// Trade the tree just built for the file it was written to
+	BVHStats stats = bvh->getStats();
+	delete bvh;
+	bvh = loadBVHFile(filename, hash, builder, start, mapped, &stats);
+	if (!bvh)
+		throw runtime_error("Could not map BVH cache file: " + filename);
+	return bvh;
+}
+
+BVH* loadCachedBVH(string cacheDir, const vector<vec3>& vertices, const vector<unsigned int>& elements,
+	BVHBuilder builder, int threads, shared_ptr<MappedFile>* mapped) {
+	if (cacheDir.empty()) {
+		if (mapped)
+			throw runtime_error("A mapped BVH needs a cache directory");
+		return new BVH(vertices, elements, builder, threads);
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	return cachedBVH(cacheDir, meshHash(vertices, elements), builder, mapped, start,
+		[&]() { return new BVH(vertices, elements, builder, threads); });
+}
+
+BVH* loadCachedBVH(string cacheDir, const string& objFile, MeshData& mesh, BVHBuilder builder, int threads,
+	shared_ptr<MappedFile>* mapped) {
+	mesh = MeshData();
+	uint64_t identity = fileIdentity(objFile);
+	if (cacheDir.empty() || !identity) {
+		if (mapped)
+			throw runtime_error("A mapped BVH needs a cache directory and a mesh file");
+		mesh.load(objFile);
+		return new BVH(mesh.raw_vertices, mesh.v_elements, builder, threads);
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	return cachedBVH(cacheDir, identity, builder, mapped, start, [&]() {
+		mesh.load(objFile);
+		return new BVH(mesh.raw_vertices, mesh.v_elements, builder, threads);
+	});
+}
+
+ostream& operator<<(ostream& out, const PagingStats& stats) {
+	return out << stats.majorFaults << " major and " << stats.minorFaults << " minor page faults, "
+		<< stats.readBytes / 1048576.0 << " MB read, " << stats.residentBytes / 1048576.0 << " MB resident (peak "
+		<< stats.peakResidentBytes / 1048576.0 << " MB), " << stats.evictions << " eviction(s)";
+}
+
+PageBudget::PageBudget(shared_ptr<const MappedFile> file, const BVH& bvh, size_t capBytes) :
+	file(file), capBytes(capBytes) {
+	// The header and the root treelet are touched by every ray and stay in memory
+	pinnedBytes = (const char*)bvh.getNodes() - file->data() + BVH_CACHE_PAGE;
+	// Read-ahead would pull in far more of the tree than the rays of a band touch
+	if (capBytes) file->adviseRandom();
+	memset(&stats, 0, sizeof(stats));
+	memset(&startStats, 0, sizeof(startStats));
+}
+
+// Faults and reads of the whole process so far
+static void processPaging(PagingStats& stats) {
+#ifndef _WIN32
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return;
+	stats.minorFaults = usage.ru_minflt;
+	stats.majorFaults = usage.ru_majflt;
+	stats.readBytes = (long long)usage.ru_inblock * 512;
+#endif
+}
+
+void PageBudget::begin() {
+	memset(&stats, 0, sizeof(stats));
+	// Pages left over from earlier work count against the cap from the start
+	if (capBytes && file->residentBytes() > capBytes)
+		file->evict(pinnedBytes);
+	processPaging(startStats);
+	stats.peakResidentBytes = file->residentBytes();
+}
+
+void PageBudget::check() {
+	size_t resident = file->residentBytes();
+	stats.peakResidentBytes = std::max(stats.peakResidentBytes, resident);
+	if (capBytes && resident > capBytes) {
+		file->evict(pinnedBytes);
+		stats.evictions++;
+	}
+}
+
+const PagingStats& PageBudget::end() {
+	PagingStats now;
+	memset(&now, 0, sizeof(now));
+	processPaging(now);
+	stats.minorFaults = now.minorFaults - startStats.minorFaults;
+	stats.majorFaults = now.majorFaults - startStats.majorFaults;
+	stats.readBytes = now.readBytes - startStats.readBytes;
+	stats.residentBytes = file->residentBytes();
+	stats.peakResidentBytes = std::max(stats.peakResidentBytes, stats.residentBytes);
+	return stats;
+}
@@ -0,0 +1,108 @@
+#ifndef BVHCACHE_HPP
+#define BVHCACHE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <glm/glm.hpp>
+#include "bvh.hpp"
+#include "meshdata.hpp"
+
+// Read-only view of a whole file, memory-mapped where the platform supports it
+class MappedFile {
+public:
+	MappedFile(std::string filename);
+	~MappedFile();
+
+	const char* data() const { return ptr; }
+	size_t size() const { return length; }
+	// Bytes of the file currently in memory, whole pages (0 where residency is not known)
+	size_t residentBytes() const;
+	// Drop the pages from offset to the end from memory; they are read again when next touched
+	void evict(size_t offset) const;
+	// Read only the page touched on a fault, rather than reading ahead as for sequential access
+	void adviseRandom() const;
+
+protected:
+	const char* ptr;
+	size_t length;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+
+private:
+	// Disallow copy and move
+	MappedFile(const MappedFile& other);
+	MappedFile(MappedFile&& other);
+	MappedFile& operator=(const MappedFile& other);
+	MappedFile& operator=(MappedFile&& other);
+};
+
+// Hash of the vertex and element arrays, identifies a mesh in the BVH cache
+uint64_t meshHash(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& elements);
+// Hash of a file's absolute path, size and modification time in seconds, identifies a mesh file in
+// the BVH cache without reading it; 0 if the file cannot be examined
+uint64_t fileIdentity(const std::string& filename);
+
+// Return the BVH of the mesh for this builder. A cache file in cacheDir named after the
+// mesh hash and builder is mapped and used in place; if it is missing or stale the BVH
+// is built and written there for the next run. An empty cacheDir always builds. The file
+// holds the nodes in page-sized treelets, so traversal of a mapped tree touches few pages.
+// With mapped given, a tree that had to be built is swapped for its file too, so the BVH is
+// always read from the file, and mapped receives the file.
+BVH* loadCachedBVH(std::string cacheDir, const std::vector<glm::vec3>& vertices,
+	const std::vector<unsigned int>& elements, BVHBuilder builder = BUILD_SAH, int threads = 0,
+	std::shared_ptr<MappedFile>* mapped = NULL);
+// Same for the mesh in objFile, with the cache file named after fileIdentity instead, so a cached
+// BVH is found without reading the mesh. The mesh is loaded into mesh only when the BVH has to be
+// built, and mesh is left empty otherwise. Rewriting the file within the second it was written,
+// to the same size, goes unnoticed.
+BVH* loadCachedBVH(std::string cacheDir, const std::string& objFile, MeshData& mesh,
+	BVHBuilder builder = BUILD_SAH, int threads = 0, std::shared_ptr<MappedFile>* mapped = NULL);
+
+// Page faults and storage reads of the process while rendering, and what a mapped file holds in memory
+struct PagingStats {
+	long long minorFaults;		// Served from the file cache
+	long long majorFaults;		// Waited for storage
+	long long readBytes;		// Read from storage
+	size_t residentBytes;		// Of the file, at the end
+	size_t peakResidentBytes;	// Most of the file seen in memory at a check
+	int evictions;				// Times the file was evicted to keep under the cap
+};
+
+// One-line summary, e.g. "12 major and 3400 minor page faults, 0.4 MB read, 2.1 MB resident (peak 4 MB), 3 eviction(s)"
+std::ostream& operator<<(std::ostream& out, const PagingStats& stats);
+
+// Keeps a mapped BVH cache file under a resident memory cap. check() is called between pieces
+// of work, such as bands of a frame; once more than capBytes of the file is in memory, every page
+// past the header and the root treelet is dropped, from the process and from the file cache, and
+// read back from storage when next touched. The cap is exceeded by at most the pages one piece of
+// work touches. Fault and read counts are those of the whole process, and are not kept on Windows.
+class PageBudget {
+public:
+	// capBytes = 0 only counts
+	PageBudget(std::shared_ptr<const MappedFile> file, const BVH& bvh, size_t capBytes);
+
+	// Start counting
+	void begin();
+	// Evict the file if it is over the cap
+	void check();
+	// Counts since begin()
+	const PagingStats& end();
+
+	size_t getCap() const { return capBytes; }
+
+protected:
+	std::shared_ptr<const MappedFile> file;
+	size_t capBytes;
+	size_t pinnedBytes;		// Start of the file never evicted
+	PagingStats stats;
+	PagingStats startStats;	// Process counts at begin()
+};
+
+#endif
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Renders a few frames locally and again on two workers over TCP, while a third connection that
+# never introduces itself stays open, and fails unless every distributed image is byte-identical
+# to the local one.
+#
+# Usage: check_distributed.sh [GLC_HEADLESS [OBJ [PORT]]]
+#   defaults: ./glc_headless, models/intersecting.obj, 47011
+set -e
+bin=$(realpath "${1:-./glc_headless}")
+obj=$(realpath "${2:-models/intersecting.obj}")
+port=${3:-47011}
+dir=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$dir"' EXIT
+cd "$dir"
+
+modes="perspective orthographic pushbroom crossed-slit bilinear"
+for mode in $modes; do
+	echo "--mode $mode --cam 20 10 0 --size 300 200 --out local-$mode.ppm" >> local.txt
+	echo "--mode $mode --cam 20 10 0 --size 300 200 --out dist-$mode.ppm" >> dist.txt
+done
+"$bin" --obj "$obj" --cache "" --jobs local.txt > local.log
+
+# The silent connection takes the coordinator's first accept, and must not hold up the workers
+(exec 2> /dev/null
+for i in $(seq 100); do
+	exec 3<> "/dev/tcp/127.0.0.1/$port" && { sleep 30; exit; }
+	sleep 0.1
+done) &
+"$bin" --cache "" --worker "127.0.0.1:$port" > worker1.log &
+"$bin" --cache "" --worker "127.0.0.1:$port" > worker2.log &
+start=$(date +%s)
+"$bin" --obj "$obj" --cache "" --jobs dist.txt --serve "127.0.0.1:$port" 2 > dist.log 2>&1
+seconds=$(( $(date +%s) - start ))
+echo "Distributed run took $seconds s:"
+grep -E "worker|Rejected" dist.log | sed 's/^/  /'
+
+status=0
+if [ $seconds -ge 30 ]; then
+	echo "The coordinator waited for the silent connection"
+	status=1
+fi
+for mode in $modes; do
+	if cmp -s "local-$mode.ppm" "dist-$mode.ppm"; then
+		echo "$mode: identical"
+	else
+		echo "$mode: DIFFERS"
+		status=1
+	fi
+done
+exit $status
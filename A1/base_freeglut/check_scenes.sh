@@ -0,0 +1,38 @@
+#!/bin/bash
+# Ray casts the regression scenes through the BVH and again testing every triangle, in every
+# camera mode and from orbits whose rays run along the axes, through the scenes' edges and
+# vertices and along the faces of BVH boxes, and fails unless every pixel agrees. Perspective
+# and orthographic frames are also rasterized and must see the same triangles (--check).
+#
+# Usage: check_scenes.sh [GLC_HEADLESS]
+#   default: ./glc_headless
+set -e
+bin=$(realpath "${1:-./glc_headless}")
+models=$(realpath "$(dirname "$0")/models")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+for mode in perspective orthographic pushbroom crossed-slit pencil bilinear; do
+	for cam in "0 0 0" "90 0 0" "0 90 0" "30 10 2"; do
+		check=""
+		if [ $mode = perspective ] || [ $mode = orthographic ]; then check=--check; fi
+		for packet in 1 4; do
+			echo "--mode $mode --cam $cam --packet $packet --size 200 200 --check-bvh $check" \
+				"--out $mode-${cam// /_}-$packet.ppm" >> jobs.txt
+		done
+	done
+done
+
+status=0
+for obj in sphere.obj intersecting.obj; do
+	if "$bin" --obj "$models/$obj" --cache "" --jobs jobs.txt > "$obj.log" 2>&1; then
+		echo "$obj: $(grep -c "check:" "$obj.log") checks passed"
+	else
+		echo "$obj: FAILED"
+		awk '/\.ppm: / { frame = $1 } /check: / { n = $0; sub(/.*check: /, "", n); if (n + 0) print "  " frame $0 }' "$obj.log"
+		grep "Fatal error" "$obj.log" | sed 's/^/  /' || true
+		status=1
+	fi
+done
+exit $status
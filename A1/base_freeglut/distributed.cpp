@@ -0,0 +1,582 @@
+#include "distributed.hpp"
+#include "render.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+using namespace std;
+using namespace glm;
+
+// Bump whenever a message layout changes
+const uint32_t TILE_PROTOCOL_VERSION = 1;
+const char TILE_PROTOCOL_MAGIC[8] = { 'G', 'L', 'C', 'T', 'I', 'L', 'E', '\0' };
+const uint32_t TILE_PROTOCOL_ENDIAN = 0x01020304;
+const uint32_t TILE_MESSAGE_LIMIT = 64 << 20;	// Larger messages are taken for garbage
+
+// Every message is a header followed by size bytes of fields
+enum TileMessage {
+	MSG_HELLO = 1,	// Worker: magic, version, endian, name
+	MSG_FRAME,		// Coordinator: frame id, then the TileFrame
+	MSG_TILE,		// Coordinator: frame id, tile index, x0, y0, width, height
+	MSG_PIXELS		// Worker: frame id, tile index, milliseconds spent, then the tile's pixels row by row
+};
+
+struct MessageHeader {
+	uint32_t type;
+	uint32_t size;
+};
+
+// Fields of a received message, throwing when it ends before they do
+struct MessageReader {
+	const char* data;
+	size_t size;
+	size_t pos;
+
+	template <class T>
+	T get() {
+		T value;
+		memcpy(&value, bytes(sizeof(T)), sizeof(T));
+		return value;
+	}
+	string getString() {
+		uint32_t length = get<uint32_t>();
+		return string(bytes(length), length);
+	}
+	const char* bytes(size_t count) {
+		if (size - pos < count)
+			throw runtime_error("Truncated tile message");
+		pos += count;
+		return data + pos - count;
+	}
+};
+
+// Helper functions
+template <class T>
+static void put(vector<char>& out, const T& value) {
+	const char* bytes = (const char*)&value;
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+static void putString(vector<char>& out, const string& s) {
+	put(out, (uint32_t)s.size());
+	out.insert(out.end(), s.begin(), s.end());
+}
+
+// Send the whole buffer, false once the peer is gone
+static bool sendAll(int socket, const char* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+	while (size > 0) {
+		ssize_t sent = send(socket, data, size, flags);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool recvAll(int socket, char* data, size_t size) {
+	while (size > 0) {
+		ssize_t received = recv(socket, data, size, 0);
+		if (received < 0 && errno == EINTR) continue;
+		if (received <= 0) return false;
+		data += received;
+		size -= received;
+	}
+	return true;
+}
+
+static bool sendMessage(int socket, TileMessage type, const vector<char>& payload) {
+	MessageHeader header = { (uint32_t)type, (uint32_t)payload.size() };
+	return sendAll(socket, (const char*)&header, sizeof(header)) &&
+		(payload.empty() || sendAll(socket, payload.data(), payload.size()));
+}
+
+// Blocking receive of one whole message, false once the peer is gone
+static bool recvMessage(int socket, MessageHeader& header, vector<char>& payload) {
+	if (!recvAll(socket, (char*)&header, sizeof(header))) return false;
+	if (header.size > TILE_MESSAGE_LIMIT)
+		throw runtime_error("Oversized tile message");
+	payload.resize(header.size);
+	return header.size == 0 || recvAll(socket, payload.data(), header.size);
+}
+
+static bool isUnixAddress(const string& address) {
+	return address.compare(0, 5, "unix:") == 0;
+}
+
+// Listening socket for the coordinator, or a connected one for a worker (-1 if nobody listens yet)
+static int openSocket(const string& address, bool listening) {
+	if (isUnixAddress(address)) {
+		string path = address.substr(5);
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(addr.sun_path))
+			throw runtime_error("Invalid UNIX socket path: " + path);
+		strcpy(addr.sun_path, path.c_str());
+
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			throw runtime_error("Could not create a socket for " + address);
+		if (listening) {
+			unlink(path.c_str());
+			if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+				close(fd);
+				throw runtime_error("Could not listen on " + address);
+			}
+		} else if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	size_t colon = address.rfind(':');
+	if (colon == string::npos)
+		throw runtime_error("Address is neither HOST:PORT nor unix:PATH: " + address);
+	string host = address.substr(0, colon), port = address.substr(colon + 1);
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	addrinfo* found;
+	if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &found) != 0)
+		throw runtime_error("Could not resolve " + address);
+
+	int fd = -1;
+	for (addrinfo* ai = found; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) continue;
+		int on = 1;
+		if (listening) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0) break;
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			// Tile requests are tiny and must not wait to be coalesced
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(found);
+	if (fd < 0 && listening)
+		throw runtime_error("Could not listen on " + address);
+	return fd;
+}
+
+TileCoordinator::TileCoordinator(const string& address, int minWorkers) :
+	address(address), listener(-1), frameId(0), remaining(0), stolen(0) {
+	// A worker dying mid-send must not take the coordinator down
+	signal(SIGPIPE, SIG_IGN);
+	listener = openSocket(address, true);
+	cout << "Waiting for " << minWorkers << " worker(s) on " << address << endl;
+	int connected = 0;
+	while (connected < minWorkers) {
+		serve(NULL);
+		connected = 0;
+		for (size_t i = 0; i < workers.size(); i++)
+			if (workers[i].socket != -1 && workers[i].greeted) connected++;
+	}
+}
+
+TileCoordinator::~TileCoordinator() {
+	for (size_t i = 0; i < workers.size(); i++)
+		if (workers[i].socket != -1) close(workers[i].socket);
+	if (listener != -1) close(listener);
+	if (isUnixAddress(address)) unlink(address.substr(5).c_str());
+}
+
+// Take the connection; it becomes a worker once its HELLO arrives
+void TileCoordinator::accept() {
+	int fd = ::accept(listener, NULL, NULL);
+	if (fd < 0) return;
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	Worker worker;
+	worker.socket = fd;
+	worker.greeted = false;
+	worker.pending = 0;
+	worker.lastHeard = clock::now();
+	worker.frame = -1;
+	worker.tiles = 0;
+	worker.pixels = 0;
+	worker.busyMs = 0.0;
+	worker.active = false;
+	workers.push_back(worker);
+}
+
+// Wait up to a second for messages and connections and handle them, then drop silent workers
+void TileCoordinator::serve(u8vec3* pixels) {
+	vector<pollfd> fds;
+	vector<int> polled;
+	pollfd listen = { listener, POLLIN, 0 };
+	fds.push_back(listen);
+	for (size_t i = 0; i < workers.size(); i++) {
+		if (workers[i].socket == -1) continue;
+		pollfd fd = { workers[i].socket, POLLIN, 0 };
+		fds.push_back(fd);
+		polled.push_back(i);
+	}
+
+	if (poll(fds.data(), fds.size(), 1000) < 0) {
+		if (errno == EINTR) return;
+		throw runtime_error("Waiting for workers failed");
+	}
+	for (size_t k = 0; k < polled.size(); k++) {
+		Worker& worker = workers[polled[k]];
+		if (fds[k + 1].revents && worker.socket != -1 && !receive(worker, pixels))
+			disconnect(worker);
+	}
+	if (fds[0].revents & POLLIN)
+		accept();
+	dropSilent();
+}
+
+// Close connections that never said HELLO, and hand the tiles of workers that stopped returning
+// them to the others
+void TileCoordinator::dropSilent() {
+	clock::time_point now = clock::now();
+	for (size_t i = 0; i < workers.size(); i++) {
+		Worker& worker = workers[i];
+		if (worker.socket == -1) continue;
+		double silent = chrono::duration<double>(now - worker.lastHeard).count();
+		if (!worker.greeted && silent > HELLO_TIMEOUT) {
+			cerr << "Rejected a worker: no greeting within " << HELLO_TIMEOUT << " seconds" << endl;
+			disconnect(worker);
+		} else if (worker.greeted && worker.pending > 0 && silent > WORKER_TIMEOUT) {
+			cerr << "Worker " << worker.name << " returned no tile for " << WORKER_TIMEOUT << " seconds" << endl;
+			disconnect(worker);
+		}
+	}
+	// Connections turned away before they became workers leave nothing to report
+	size_t kept = 0;
+	for (size_t i = 0; i < workers.size(); i++)
+		if (workers[i].greeted || workers[i].socket != -1)
+			workers[kept++] = workers[i];
+	workers.resize(kept);
+}
+
+void TileCoordinator::disconnect(Worker& worker) {
+	close(worker.socket);
+	worker.socket = -1;
+	if (!worker.greeted) return;
+	int requeued = 0;
+	for (size_t i = 0; i < worker.inFlight.size(); i++) {
+		Tile& tile = tiles[worker.inFlight[i]];
+		tile.owners--;
+		if (!tile.done && tile.owners == 0) {
+			queue.push_front(worker.inFlight[i]);
+			requeued++;
+		}
+	}
+	worker.inFlight.clear();
+	cerr << "Worker " << worker.name << " disconnected, " << requeued << " tile(s) requeued" << endl;
+}
+
+// Tile in flight on another worker only, for an idle worker to duplicate; -1 if there is none
+int TileCoordinator::stealable(const Worker& worker) const {
+	for (size_t t = 0; t < tiles.size(); t++) {
+		if (tiles[t].done || tiles[t].owners != 1) continue;
+		bool own = false;
+		for (size_t i = 0; i < worker.inFlight.size(); i++)
+			own |= worker.inFlight[i] == (int)t;
+		if (!own) return t;
+	}
+	return -1;
+}
+
+void TileCoordinator::assign(Worker& worker) {
+	while ((int)worker.inFlight.size() < MAX_IN_FLIGHT) {
+		int t;
+		if (!queue.empty()) {
+			t = queue.front();
+			queue.pop_front();
+		} else if (worker.inFlight.empty() && (t = stealable(worker)) != -1) {
+			stolen++;
+		} else {
+			return;
+		}
+		tiles[t].owners++;
+		worker.inFlight.push_back(t);
+		if (worker.pending++ == 0)
+			worker.lastHeard = clock::now();
+
+		bool sent = true;
+		if (worker.frame != frameId) {
+			vector<char> payload;
+			put(payload, (int32_t)frameId);
+			putString(payload, frame.obj);
+			putString(payload, frame.cacheDir);
+			put(payload, (uint32_t)frame.builder);
+			put(payload, frame.cam.o0);
+			put(payload, frame.cam.ox);
+			put(payload, frame.cam.oy);
+			put(payload, frame.cam.d0);
+			put(payload, frame.cam.dx);
+			put(payload, frame.cam.dy);
+			put(payload, (int32_t)frame.rows);
+			put(payload, (int32_t)frame.cols);
+			put(payload, (int32_t)frame.packetSize);
+			put(payload, frame.background);
+			sent = sendMessage(worker.socket, MSG_FRAME, payload);
+			worker.frame = frameId;
+		}
+		const Tile& tile = tiles[t];
+		vector<char> payload;
+		put(payload, (int32_t)frameId);
+		put(payload, (int32_t)t);
+		put(payload, (int32_t)tile.x0);
+		put(payload, (int32_t)tile.y0);
+		put(payload, (int32_t)tile.width);
+		put(payload, (int32_t)tile.height);
+		if (!sent || !sendMessage(worker.socket, MSG_TILE, payload)) {
+			disconnect(worker);
+			return;
+		}
+	}
+}
+
+// Read what the worker sent, its greeting first, and copy every complete tile into pixels; false
+// if it is gone or sent something else than that
+bool TileCoordinator::receive(Worker& worker, u8vec3* pixels) {
+	char buffer[1 << 16];
+	ssize_t received = recv(worker.socket, buffer, sizeof(buffer), 0);
+	if (received < 0 && errno == EINTR) return true;
+	if (received <= 0) {
+		if (!worker.greeted) cerr << "Rejected a worker: no greeting" << endl;
+		return false;
+	}
+	worker.inbox.insert(worker.inbox.end(), buffer, buffer + received);
+
+	size_t pos = 0;
+	try {
+		while (worker.inbox.size() - pos >= sizeof(MessageHeader)) {
+			MessageHeader header;
+			memcpy(&header, &worker.inbox[pos], sizeof(header));
+			if (header.size > TILE_MESSAGE_LIMIT)
+				throw runtime_error("oversized message");
+			if (worker.inbox.size() - pos - sizeof(header) < header.size) break;
+			MessageReader msg = { &worker.inbox[pos + sizeof(header)], header.size, 0 };
+			pos += sizeof(header) + header.size;
+			if (!worker.greeted) {
+				// The worker introduces itself first; anything else is turned away
+				if (header.type != MSG_HELLO)
+					throw runtime_error("no greeting");
+				if (memcmp(msg.bytes(sizeof(TILE_PROTOCOL_MAGIC)), TILE_PROTOCOL_MAGIC, sizeof(TILE_PROTOCOL_MAGIC)) != 0 ||
+					msg.get<uint32_t>() != TILE_PROTOCOL_VERSION || msg.get<uint32_t>() != TILE_PROTOCOL_ENDIAN)
+					throw runtime_error("different protocol version or byte order");
+				worker.name = msg.getString();
+				worker.greeted = true;
+				worker.lastHeard = clock::now();
+				cout << "Worker " << worker.name << " connected" << endl;
+				continue;
+			}
+			if (header.type != MSG_PIXELS)
+				throw runtime_error("unexpected message");
+
+			// Tiles of an earlier frame, stolen and finished elsewhere, are dropped
+			int frame = msg.get<int32_t>();
+			int t = msg.get<int32_t>();
+			float renderMs = msg.get<float>();
+			if (worker.pending > 0) worker.pending--;
+			worker.lastHeard = clock::now();
+			if (frame != frameId) continue;
+			if (t < 0 || t >= (int)tiles.size())
+				throw runtime_error("unknown tile");
+			for (size_t i = 0; i < worker.inFlight.size(); i++) {
+				if (worker.inFlight[i] == t) {
+					worker.inFlight.erase(worker.inFlight.begin() + i);
+					tiles[t].owners--;
+					break;
+				}
+			}
+
+			Tile& tile = tiles[t];
+			const char* data = msg.bytes(tile.width * tile.height * sizeof(u8vec3));
+			if (!tile.done) {
+				for (int y = 0; y < tile.height; y++)
+					memcpy(&pixels[(tile.y0 + y) * this->frame.cols + tile.x0], data + y * tile.width * sizeof(u8vec3),
+						tile.width * sizeof(u8vec3));
+				tile.done = true;
+				remaining--;
+			}
+			worker.tiles++;
+			worker.pixels += tile.width * tile.height;
+			worker.busyMs += renderMs;
+			worker.lastResult = clock::now();
+			worker.active = true;
+		}
+	} catch (const exception& e) {
+		if (worker.greeted)
+			cerr << "Worker " << worker.name << ": " << e.what() << endl;
+		else
+			cerr << "Rejected a worker: " << e.what() << endl;
+		return false;
+	}
+	worker.inbox.erase(worker.inbox.begin(), worker.inbox.begin() + pos);
+	return true;
+}
+
+void TileCoordinator::render(const TileFrame& frame, u8vec3* pixels) {
+	this->frame = frame;
+	frameId++;
+	tiles.clear();
+	queue.clear();
+	for (int y0 = 0; y0 < frame.rows; y0 += TILE) {
+		for (int x0 = 0; x0 < frame.cols; x0 += TILE) {
+			Tile tile = { x0, y0, glm::min(TILE, frame.cols - x0), glm::min(TILE, frame.rows - y0), false, 0 };
+			queue.push_back(tiles.size());
+			tiles.push_back(tile);
+		}
+	}
+	remaining = tiles.size();
+	stolen = 0;
+	// Tiles still in flight belong to the previous frame, their results will be dropped
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].inFlight.clear();
+		workers[i].tiles = 0;
+		workers[i].pixels = 0;
+		workers[i].busyMs = 0.0;
+		workers[i].active = false;
+	}
+
+	frameStart = clock::now();
+	clock::time_point lastWorker = frameStart;
+	while (remaining > 0) {
+		bool connected = false;
+		for (size_t i = 0; i < workers.size(); i++) {
+			if (workers[i].socket != -1 && workers[i].greeted) assign(workers[i]);
+			connected |= workers[i].socket != -1 && workers[i].greeted;
+		}
+
+		if (connected) {
+			lastWorker = clock::now();
+		} else if (chrono::duration<double>(clock::now() - lastWorker).count() > WORKER_TIMEOUT) {
+			ostringstream message;
+			message << "No worker connected for " << WORKER_TIMEOUT << " seconds, " << remaining << " tile(s) left";
+			throw runtime_error(message.str());
+		}
+		serve(pixels);
+	}
+}
+
+void TileCoordinator::report(ostream& out) const {
+	for (size_t i = 0; i < workers.size(); i++) {
+		const Worker& worker = workers[i];
+		if (!worker.active) continue;
+		double seconds = chrono::duration<double>(worker.lastResult - frameStart).count();
+		out << "  worker " << worker.name << ": " << worker.tiles << " tiles, " << worker.pixels << " pixels, "
+			<< worker.pixels / glm::max(worker.busyMs, 1e-3) / 1e3 << " Mpixels/s while rendering, last tile after "
+			<< seconds * 1e3 << " ms" << (worker.socket == -1 ? " (disconnected)" : "") << endl;
+	}
+	if (stolen)
+		out << "  " << stolen << " tile(s) stolen from slower workers" << endl;
+}
+
+int runTileWorker(const string& address, function<const BVH&(const TileFrame&)> loadScene) {
+	int fd;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while ((fd = openSocket(address, false)) < 0) {
+		if (chrono::duration<double>(chrono::steady_clock::now() - start).count() > TileCoordinator::WORKER_TIMEOUT)
+			throw runtime_error("No coordinator listening on " + address);
+		this_thread::sleep_for(chrono::milliseconds(100));
+	}
+
+	char host[256] = "";
+	gethostname(host, sizeof(host) - 1);
+	ostringstream name;
+	name << host << ":" << getpid();
+	vector<char> hello(TILE_PROTOCOL_MAGIC, TILE_PROTOCOL_MAGIC + sizeof(TILE_PROTOCOL_MAGIC));
+	put(hello, TILE_PROTOCOL_VERSION);
+	put(hello, TILE_PROTOCOL_ENDIAN);
+	putString(hello, name.str());
+	if (!sendMessage(fd, MSG_HELLO, hello)) {
+		close(fd);
+		throw runtime_error("Lost the coordinator at " + address);
+	}
+	cout << "Worker " << name.str() << " connected to " << address << endl;
+
+	TileFrame frame;
+	int frameId = -1;
+	const BVH* bvh = NULL;
+	CameraKind kind = KIND_PERSPECTIVE;
+	vector<u8vec3> image;
+	vector<RayBatch> batches;
+	NoInstrumentation instr;
+	int rendered = 0;
+	MessageHeader header;
+	vector<char> payload;
+	while (recvMessage(fd, header, payload)) {
+		MessageReader msg = { payload.data(), payload.size(), 0 };
+		if (header.type == MSG_FRAME) {
+			frameId = msg.get<int32_t>();
+			frame.obj = msg.getString();
+			frame.cacheDir = msg.getString();
+			frame.builder = (BVHBuilder)msg.get<uint32_t>();
+			frame.cam.o0 = msg.get<vec3>();
+			frame.cam.ox = msg.get<vec3>();
+			frame.cam.oy = msg.get<vec3>();
+			frame.cam.d0 = msg.get<vec3>();
+			frame.cam.dx = msg.get<vec3>();
+			frame.cam.dy = msg.get<vec3>();
+			frame.rows = msg.get<int32_t>();
+			frame.cols = msg.get<int32_t>();
+			frame.packetSize = msg.get<int32_t>();
+			frame.background = msg.get<u8vec3>();
+			bvh = &loadScene(frame);
+			kind = classifyCamera(frame.cam);
+			image.assign(frame.rows * frame.cols, frame.background);
+			batches.resize(frame.packetSize);
+		} else if (header.type == MSG_TILE) {
+			int tileFrame = msg.get<int32_t>();
+			int t = msg.get<int32_t>();
+			int x0 = msg.get<int32_t>(), y0 = msg.get<int32_t>();
+			int width = msg.get<int32_t>(), height = msg.get<int32_t>();
+			if (tileFrame != frameId || x0 < 0 || y0 < 0 || width <= 0 || height <= 0 ||
+				x0 + width > frame.cols || y0 + height > frame.rows)
+				throw runtime_error("Tile outside the frame it belongs to");
+
+			u8vec3 background = frame.background;
+			auto shade = [background](const Hit& hit) { return shadeTriangle(hit, background); };
+			chrono::steady_clock::time_point tileStart = chrono::steady_clock::now();
+			renderTile(*bvh, frame.cam, kind, x0, y0, width, height, frame.cols, frame.packetSize, shade, &image[0],
+				instr, batches);
+			float renderMs = chrono::duration<float, milli>(chrono::steady_clock::now() - tileStart).count();
+
+			vector<char> reply;
+			put(reply, (int32_t)frameId);
+			put(reply, (int32_t)t);
+			put(reply, renderMs);
+			for (int y = y0; y < y0 + height; y++) {
+				const char* row = (const char*)&image[y * frame.cols + x0];
+				reply.insert(reply.end(), row, row + width * sizeof(u8vec3));
+			}
+			if (!sendMessage(fd, MSG_PIXELS, reply)) break;
+			rendered++;
+		} else {
+			close(fd);
+			throw runtime_error("Unexpected message from the coordinator");
+		}
+	}
+	close(fd);
+	return rendered;
+}
@@ -0,0 +1,103 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <ostream>
+#include <functional>
+#include <chrono>
+#include <glm/glm.hpp>
+#include "bvh.hpp"
+#include "glc.hpp"
+
+// Frame to ray cast on worker processes. Workers load the mesh themselves, with their own BVH
+// cache, so obj and cacheDir must be valid paths where the workers run.
+struct TileFrame {
+	std::string obj;
+	std::string cacheDir;
+	BVHBuilder builder;
+	GeneralLinearCamera cam;	// Rays in object space
+	int rows, cols;
+	int packetSize;
+	glm::u8vec3 background;
+};
+
+// Hands out the tiles of frames to worker processes connected at address, "HOST:PORT" for TCP
+// or "unix:PATH" for a UNIX socket, and assembles the pixels they send back. A worker holds at
+// most MAX_IN_FLIGHT tiles and gets the next one from the queue whenever it returns one, so fast
+// workers take more tiles. Once the queue is empty, an idle worker steals a tile still in flight
+// on another worker and whichever copy comes back first is kept. The unfinished tiles of a worker
+// that disconnects, or returns nothing for WORKER_TIMEOUT seconds, go back to the queue, and
+// workers may join at any time. Connections are served without blocking: one that has not
+// introduced itself within HELLO_TIMEOUT seconds is closed. Messages are sent in the byte order
+// of the coordinator; workers of the other byte order are turned away.
+class TileCoordinator {
+public:
+	static const int TILE = 64;				// Pixels per side of a tile
+	static const int MAX_IN_FLIGHT = 2;		// Tiles queued on a worker, so it never waits for the next one
+	static const int WORKER_TIMEOUT = 60;	// Seconds a frame waits while no worker is connected, or
+											// for a worker with tiles in flight to return one
+	static const int HELLO_TIMEOUT = 5;		// Seconds a new connection has to introduce itself
+
+	// Listen on address and wait until minWorkers workers have connected
+	TileCoordinator(const std::string& address, int minWorkers);
+	~TileCoordinator();
+
+	// Ray cast frame into pixels (row-major)
+	void render(const TileFrame& frame, glm::u8vec3* pixels);
+	// Tiles, pixels and throughput of every worker that returned tiles of the last frame
+	void report(std::ostream& out) const;
+
+protected:
+	typedef std::chrono::steady_clock clock;
+
+	struct Tile {
+		int x0, y0, width, height;
+		bool done;
+		int owners;		// Workers it is in flight on
+	};
+
+	struct Worker {
+		int socket;				// -1 once disconnected
+		bool greeted;			// Sent its HELLO, until then it gets no tiles
+		std::string name;
+		std::vector<char> inbox;	// Received bytes not yet parsed into messages
+		std::deque<int> inFlight;	// Tiles of the current frame sent and not returned
+		int pending;				// Tiles of any frame sent and not returned
+		clock::time_point lastHeard;	// Connection, or last tile returned or sent while none was pending
+		int frame;					// Last frame described to the worker
+		// Work of the current frame
+		int tiles;
+		long long pixels;
+		double busyMs;				// Time the worker spent rendering them, as it reports
+		clock::time_point lastResult;
+		bool active;				// Returned a tile of the current frame
+	};
+
+	void accept();
+	void serve(glm::u8vec3* pixels);
+	void dropSilent();
+	void disconnect(Worker& worker);
+	void assign(Worker& worker);
+	bool receive(Worker& worker, glm::u8vec3* pixels);
+	int stealable(const Worker& worker) const;
+
+	std::string address;
+	int listener;
+	std::vector<Worker> workers;
+	std::vector<Tile> tiles;
+	std::deque<int> queue;			// Tiles not in flight anywhere
+	int frameId;
+	TileFrame frame;
+	int remaining;					// Tiles of the frame not returned yet
+	int stolen;						// Tiles of the frame handed out a second time
+	clock::time_point frameStart;
+};
+
+// Serve tiles for the coordinator at address until it closes the connection, retrying the
+// connection for up to TileCoordinator::WORKER_TIMEOUT seconds while it is not listening yet.
+// loadScene returns the BVH of a frame's mesh. Returns the number of tiles rendered.
+int runTileWorker(const std::string& address, std::function<const BVH&(const TileFrame&)> loadScene);
+
+#endif
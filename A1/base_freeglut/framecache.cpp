@@ -0,0 +1,82 @@
+#include "framecache.hpp"
+#include <cstring>
+using namespace std;
+using namespace glm;
+
+uint64_t RenderKey::hash() const {
+	uint64_t h = 14695981039346656037ull;
+	auto mix = [&](uint32_t word) { h = (h ^ word) * 1099511628211ull; };
+	// Adding 0 turns -0 into +0, which compares equal
+	auto mixFloat = [&](float f) {
+		f += 0.0f;
+		uint32_t word;
+		memcpy(&word, &f, sizeof(word));
+		mix(word);
+	};
+	for (int i = 0; i < 3; i++) mixFloat(camCoords[i]);
+	for (int c = 0; c < 3; c++) {
+		for (int r = 0; r < 3; r++) {
+			mixFloat(stVertices[c][r]);
+			mixFloat(uvVertices[c][r]);
+		}
+	}
+	mix((uint32_t)cameraMode);
+	mix((uint32_t)width);
+	mix((uint32_t)height);
+	mix((uint32_t)meshVersion);
+	mix((uint32_t)slices | (uint32_t)raster << 1);
+	return h;
+}
+
+FrameCache::FrameCache(size_t capacityBytes) :
+	capacity(capacityBytes), bytes(0), hits(0), misses(0) {}
+
+const u8vec4* FrameCache::find(const RenderKey& key) {
+	auto it = index.find(key);
+	if (it == index.end()) {
+		misses++;
+		return NULL;
+	}
+	hits++;
+	frames.splice(frames.begin(), frames, it->second);
+	return it->second->pixels.data();
+}
+
+void FrameCache::insert(const RenderKey& key, const u8vec4* pixels) {
+	size_t frameBytes = (size_t)key.width * key.height * sizeof(u8vec4);
+	auto it = index.find(key);
+	if (it != index.end()) {
+		bytes -= it->second->pixels.size() * sizeof(u8vec4);
+		frames.erase(it->second);
+		index.erase(it);
+	}
+	if (frameBytes > capacity) return;
+
+	Frame frame;
+	frame.key = key;
+	frame.pixels.assign(pixels, pixels + key.width * key.height);
+	frames.push_front(std::move(frame));
+	index[key] = frames.begin();
+	bytes += frameBytes;
+	evict();
+}
+
+void FrameCache::clear() {
+	frames.clear();
+	index.clear();
+	bytes = 0;
+}
+
+void FrameCache::setCapacity(size_t capacityBytes) {
+	capacity = capacityBytes;
+	evict();
+}
+
+// Drop least recently used frames until the rest fits
+void FrameCache::evict() {
+	while (bytes > capacity && !frames.empty()) {
+		bytes -= frames.back().pixels.size() * sizeof(u8vec4);
+		index.erase(frames.back().key);
+		frames.pop_back();
+	}
+}
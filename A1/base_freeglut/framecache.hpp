@@ -0,0 +1,70 @@
+#ifndef FRAMECACHE_HPP
+#define FRAMECACHE_HPP
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Inputs that determine a rendered GLC image
+struct RenderKey {
+	glm::vec3 camCoords;
+	glm::mat3 stVertices;
+	glm::mat3 uvVertices;
+	int cameraMode;
+	int width, height;		// Internal resolution of the render target
+	int meshVersion;
+	bool slices, raster;	// Render path: pushbroom plane slices, rasterized projective cameras
+
+	bool operator==(const RenderKey& other) const {
+		return camCoords == other.camCoords && stVertices == other.stVertices &&
+			uvVertices == other.uvVertices && cameraMode == other.cameraMode &&
+			width == other.width && height == other.height && meshVersion == other.meshVersion &&
+			slices == other.slices && raster == other.raster;
+	}
+	bool operator!=(const RenderKey& other) const { return !(*this == other); }
+
+	// FNV-1a over the fields, consistent with operator==
+	uint64_t hash() const;
+};
+
+// Finished frames by render key, least recently used ones evicted first once the
+// stored pixels exceed the memory cap
+class FrameCache {
+public:
+	FrameCache(size_t capacityBytes);
+
+	// Pixels of the frame rendered for key, NULL on a miss. A hit becomes the most recently used.
+	const glm::u8vec4* find(const RenderKey& key);
+	// Store a width x height frame, evicting old ones to stay within the cap. Frames larger
+	// than the whole cap are not kept.
+	void insert(const RenderKey& key, const glm::u8vec4* pixels);
+	void clear();
+
+	void setCapacity(size_t capacityBytes);
+	size_t getCapacity() const { return capacity; }
+	size_t getBytes() const { return bytes; }
+	size_t getFrameCount() const { return frames.size(); }
+	unsigned long getHits() const { return hits; }
+	unsigned long getMisses() const { return misses; }
+
+protected:
+	struct Frame {
+		RenderKey key;
+		std::vector<glm::u8vec4> pixels;
+	};
+	struct KeyHash {
+		size_t operator()(const RenderKey& key) const { return (size_t)key.hash(); }
+	};
+
+	void evict();
+
+	std::list<Frame> frames;	// Most recently used first
+	std::unordered_map<RenderKey, std::list<Frame>::iterator, KeyHash> index;
+	size_t capacity;
+	size_t bytes;
+	unsigned long hits, misses;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include "framewriter.hpp"
+#include <fstream>
+#include <chrono>
+#include <stdexcept>
+#include <cctype>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+using namespace std;
+using namespace glm;
+
+static bool hasExtension(const string& filename, const string& extension) {
+	if (filename.size() < extension.size()) return false;
+	for (size_t i = 0; i < extension.size(); i++)
+		if (tolower(filename[filename.size() - extension.size() + i]) != extension[i]) return false;
+	return true;
+}
+
+static void checkFormat(const string& filename) {
+	if (!hasExtension(filename, ".png") && !hasExtension(filename, ".ppm") && !hasExtension(filename, ".pfm"))
+		throw runtime_error("Unsupported image format (use .png, .ppm or .pfm): " + filename);
+}
+
+void writeImage(const string& filename, int width, int height, const vector<u8vec3>& pixels) {
+	checkFormat(filename);
+	if (hasExtension(filename, ".png")) {
+		// A negative stride starts at the top row, as PNG does, without flipping the image in a
+		// global stb setting that other threads writing at the same time would share
+		int stride = width * 3;
+		const u8vec3* top = &pixels[(height - 1) * width];
+		if (!stbi_write_png(filename.c_str(), width, height, 3, top, -stride))
+			throw runtime_error("Could not write output file: " + filename);
+		return;
+	}
+
+	ofstream file(filename, ios::binary);
+	if (!file.is_open())
+		throw runtime_error("Could not open output file: " + filename);
+	if (hasExtension(filename, ".ppm")) {
+		file << "P6\n" << width << " " << height << "\n255\n";
+		for (int y = height - 1; y >= 0; y--)
+			file.write((const char*)&pixels[y * width], width * 3);
+	} else {
+		// PFM rows run bottom to top already; a negative scale marks little-endian floats
+		const unsigned short probe = 1;
+		bool little = *(const unsigned char*)&probe == 1;
+		file << "PF\n" << width << " " << height << "\n" << (little ? "-1.0" : "1.0") << "\n";
+		vector<float> row(width * 3);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++)
+				for (int c = 0; c < 3; c++)
+					row[x * 3 + c] = pixels[y * width + x][c] / 255.0f;
+			file.write((const char*)&row[0], row.size() * sizeof(float));
+		}
+	}
+	if (!file)
+		throw runtime_error("Could not write output file: " + filename);
+}
+
+FrameWriter::FrameWriter(int threads, int queueDepth) :
+	queueDepth(glm::max(0, queueDepth)), busy(0), closing(false), written(0), encodeMs(0.0), stallMs(0.0) {
+	if (threads <= 0)
+		threads = glm::max(1, (int)thread::hardware_concurrency());
+	// Without a queue every frame is written by write() itself
+	if (this->queueDepth == 0) threads = 0;
+	for (int t = 0; t < threads; t++)
+		encoders.push_back(thread(&FrameWriter::encode, this));
+}
+
+FrameWriter::~FrameWriter() {
+	{
+		lock_guard<mutex> guard(lock);
+		closing = true;
+	}
+	queued.notify_all();
+	for (size_t t = 0; t < encoders.size(); t++)
+		encoders[t].join();
+}
+
+void FrameWriter::write(const string& filename, int width, int height, vector<u8vec3>&& pixels) {
+	typedef chrono::steady_clock clock;
+	// Fail on the frame itself rather than once it is written
+	checkFormat(filename);
+	if (encoders.empty()) {
+		clock::time_point start = clock::now();
+		writeImage(filename, width, height, pixels);
+		encodeMs += chrono::duration<double, milli>(clock::now() - start).count();
+		written++;
+		return;
+	}
+
+	unique_lock<mutex> guard(lock);
+	if ((int)queue.size() >= queueDepth) {
+		clock::time_point start = clock::now();
+		taken.wait(guard, [this] { return (int)queue.size() < queueDepth; });
+		stallMs += chrono::duration<double, milli>(clock::now() - start).count();
+	}
+	Frame frame;
+	frame.filename = filename;
+	frame.width = width;
+	frame.height = height;
+	frame.pixels.swap(pixels);
+	queue.push_back(std::move(frame));
+	queued.notify_one();
+	throwError();
+}
+
+void FrameWriter::finish() {
+	unique_lock<mutex> guard(lock);
+	taken.wait(guard, [this] { return queue.empty() && busy == 0; });
+	throwError();
+}
+
+void FrameWriter::throwError() {
+	if (error.empty()) return;
+	string message;
+	message.swap(error);
+	throw runtime_error(message);
+}
+
+void FrameWriter::encode() {
+	typedef chrono::steady_clock clock;
+	unique_lock<mutex> guard(lock);
+	for (;;) {
+		queued.wait(guard, [this] { return !queue.empty() || closing; });
+		if (queue.empty()) return;
+		Frame frame = std::move(queue.front());
+		queue.pop_front();
+		busy++;
+		taken.notify_all();
+		guard.unlock();
+
+		clock::time_point start = clock::now();
+		string failure;
+		try {
+			writeImage(frame.filename, frame.width, frame.height, frame.pixels);
+		} catch (const exception& e) {
+			failure = e.what();
+		}
+		double ms = chrono::duration<double, milli>(clock::now() - start).count();
+
+		guard.lock();
+		busy--;
+		encodeMs += ms;
+		if (failure.empty())
+			written++;
+		else if (error.empty())
+			error = failure;
+		taken.notify_all();
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef FRAMEWRITER_HPP
+#define FRAMEWRITER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <glm/glm.hpp>
+
+// Write row-major pixels whose first row is the bottom of the image, as glTexImage2D expects.
+// The format comes from the extension: .png, .ppm, or .pfm for 32-bit float RGB in [0, 1].
+void writeImage(const std::string& filename, int width, int height, const std::vector<glm::u8vec3>& pixels);
+
+// Writes finished frames on encoder threads while the next ones render. Frames wait in a queue
+// of at most queueDepth; write() blocks while it is full, so rendering never runs further ahead
+// of the encoders than that, and a depth of 0 writes every frame before write() returns.
+// Frames are independent, so several threads encode as many of them at once, in any order.
+class FrameWriter {
+public:
+	// threads = 0 uses every hardware thread
+	FrameWriter(int threads = 1, int queueDepth = 4);
+	// Writes the frames still queued, dropping their errors; call finish() to see them
+	~FrameWriter();
+
+	// Queue pixels to be written to filename as writeImage does, taking them over. Throws the
+	// first error of a frame written since the last call.
+	void write(const std::string& filename, int width, int height, std::vector<glm::u8vec3>&& pixels);
+	// Wait until every queued frame is written, and throw the first error of any of them
+	void finish();
+
+	int getThreads() const { return (int)encoders.size(); }
+	int getWritten() const { return written; }
+	// Time the encoders spent writing frames, added over the threads
+	double getEncodeMs() const { return encodeMs; }
+	// Time write() waited for room in the queue
+	double getStallMs() const { return stallMs; }
+
+protected:
+	struct Frame {
+		std::string filename;
+		int width, height;
+		std::vector<glm::u8vec3> pixels;
+	};
+
+	void encode();
+	void throwError();
+
+	int queueDepth;
+	std::vector<std::thread> encoders;
+	std::mutex lock;
+	std::condition_variable queued;		// A frame was queued, or the writer is closing
+	std::condition_variable taken;		// An encoder took a frame or finished one
+	std::deque<Frame> queue;
+	int busy;					// Frames being encoded
+	bool closing;
+	std::string error;			// First error not thrown yet
+	int written;
+	double encodeMs;
+	double stallMs;
+
+private:
+	// Disallow copy and move
+	FrameWriter(const FrameWriter& other);
+	FrameWriter(FrameWriter&& other);
+	FrameWriter& operator=(const FrameWriter& other);
+	FrameWriter& operator=(FrameWriter&& other);
+};
+
+#endif
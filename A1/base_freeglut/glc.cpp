@@ -0,0 +1,124 @@
+#include "glc.hpp"
+#include <cmath>
+#include <glm/gtc/matrix_transform.hpp>
+using namespace std;
+using namespace glm;
+
+// st triangles for the uv triangle (0,0), (1,0), (0,1). Writing st = A * uv, the GLC
+// type follows from the roots of det((1 - l) I + l A) = 0, i.e. the depths at which
+// all rays cross a common point or line.
+static const struct {
+	const char* name;
+	unsigned char key;
+	float st[9];
+} glcPresetTable[] = {
+	{ "Perspective",  'p', { 0.0f, 0.0f, 1.0f,   3.0f, 0.0f, 1.0f,   0.0f, 3.0f, 1.0f } },	// A = 3I, pinhole
+	{ "Orthographic", 'o', { 0.0f, 0.0f, 1.0f,   1.0f, 0.0f, 1.0f,   0.0f, 1.0f, 1.0f } },	// A = I, no roots
+	{ "Pushbroom",    'b', { 0.0f, 0.0f, 1.0f,   1.0f, 0.0f, 1.0f,   0.0f, 0.0f, 1.0f } },	// A = diag(1, 0), one root
+	{ "Crossed-slit", 'x', { 0.0f, 0.0f, 1.0f,   3.0f, 0.0f, 1.0f,   0.0f, -1.0f, 1.0f } },	// A = diag(3, -1), two roots
+	{ "Pencil",       'n', { 0.0f, 0.0f, 1.0f,   3.0f, 0.0f, 1.0f,   1.0f, 3.0f, 1.0f } },	// A = [3 1; 0 3], double root
+	{ "Bilinear",     'l', { 0.0f, 0.0f, 1.0f,   1.0f, 1.0f, 1.0f,   -1.0f, 1.0f, 1.0f } },	// A = [1 -1; 1 1], complex roots
+};
+
+void RayBatch::resize(int n) {
+	ox.resize(n); oy.resize(n); oz.resize(n);
+	dx.resize(n); dy.resize(n); dz.resize(n);
+}
+
+GeneralLinearCamera::GeneralLinearCamera() :
+	o0(0.0f), ox(0.0f), oy(0.0f), d0(0.0f, 0.0f, 1.0f), dx(0.0f), dy(0.0f) {}
+
+void GeneralLinearCamera::setup(const mat3& uvVertices, const mat3& stVertices,
+	const vec3& viewPlaneStart, const vec2& viewPlaneSize, int width, int height) {
+	// Pixel (x, y) sits at viewPlaneStart + x * px + y * py on the uv plane
+	vec3 px(viewPlaneSize.x / width, 0.0f, 0.0f);
+	vec3 py(0.0f, viewPlaneSize.y / height, 0.0f);
+
+	// Barycentric (alpha, beta) of a point on the uv triangle, affine in the point
+	mat2 M = mat2(uvVertices[0].x - uvVertices[2].x, uvVertices[0].y - uvVertices[2].y,
+		uvVertices[1].x - uvVertices[2].x, uvVertices[1].y - uvVertices[2].y);
+	mat2 invM = inverse(M);
+	vec2 ab0 = invM * vec2(viewPlaneStart.x - uvVertices[2].x, viewPlaneStart.y - uvVertices[2].y);
+	vec2 abx = invM * vec2(px.x, px.y);
+	vec2 aby = invM * vec2(py.x, py.y);
+
+	// The same weights on the st triangle give the second point of the ray
+	vec3 sa = stVertices[0] - stVertices[2];
+	vec3 sb = stVertices[1] - stVertices[2];
+	vec3 s0 = stVertices[2] + ab0.x * sa + ab0.y * sb;
+	vec3 sx = abx.x * sa + abx.y * sb;
+	vec3 sy = aby.x * sa + aby.y * sb;
+
+	o0 = viewPlaneStart;
+	ox = px;
+	oy = py;
+	d0 = s0 - o0;
+	dx = sx - px;
+	dy = sy - py;
+}
+
+GeneralLinearCamera GeneralLinearCamera::transformed(const mat4& xform) const {
+	GeneralLinearCamera cam;
+	cam.o0 = vec3(xform * vec4(o0, 1.0f));
+	cam.ox = vec3(xform * vec4(ox, 0.0f));
+	cam.oy = vec3(xform * vec4(oy, 0.0f));
+	cam.d0 = vec3(xform * vec4(d0, 0.0f));
+	cam.dx = vec3(xform * vec4(dx, 0.0f));
+	cam.dy = vec3(xform * vec4(dy, 0.0f));
+	return cam;
+}
+
+Ray GeneralLinearCamera::ray(float x, float y) const {
+	return Ray(o0 + y * oy + x * ox, normalize(d0 + y * dy + x * dx));
+}
+
+// Lanes of a scanline: origin and normalized direction of columns x0 .. x0 + count - 1. The
+// arrays are restrict parameters, which GCC only honors on parameters, so the loop vectorizes
+// without checks for overlapping arrays.
+static void stepScanline(int x0, int count, vec3 oRow, vec3 oStep, vec3 dRow, vec3 dStep,
+	float* __restrict rox, float* __restrict roy, float* __restrict roz,
+	float* __restrict rdx, float* __restrict rdy, float* __restrict rdz) {
+	for (int i = 0; i < count; i++) {
+		float fx = (float)(x0 + i);
+		rox[i] = oRow.x + fx * oStep.x;
+		roy[i] = oRow.y + fx * oStep.y;
+		roz[i] = oRow.z + fx * oStep.z;
+		float vx = dRow.x + fx * dStep.x;
+		float vy = dRow.y + fx * dStep.y;
+		float vz = dRow.z + fx * dStep.z;
+		float invLen = 1.0f / sqrtf(vx * vx + vy * vy + vz * vz);
+		rdx[i] = vx * invLen;
+		rdy[i] = vy * invLen;
+		rdz[i] = vz * invLen;
+	}
+}
+
+void GeneralLinearCamera::scanline(int y, int x0, int count, RayBatch& batch) const {
+	if ((int)batch.ox.size() < count) batch.resize(count);
+
+	// Row start, then step along x. Each lane is rowStart + x * step for its own column x, which
+	// keeps the loop free of dependencies (and of accumulated drift) so it vectorizes, and gives
+	// a pixel the same ray whichever scanline or tile it was cast in.
+	stepScanline(x0, count, o0 + (float)y * oy, ox, d0 + (float)y * dy, dx,
+		batch.ox.data(), batch.oy.data(), batch.oz.data(), batch.dx.data(), batch.dy.data(), batch.dz.data());
+}
+
+mat4 objectFromOrbit(const vec3& camCoords) {
+	mat4 view = translate(mat4(1.0f), vec3(0.0, 0.0, -camCoords.z));
+	mat4 rot = rotate(mat4(1.0f), radians(camCoords.y), vec3(1.0, 0.0, 0.0));
+	rot = rotate(rot, radians(camCoords.x), vec3(0.0, 1.0, 0.0));
+	return inverse(view * rot);
+}
+
+vector<GLCPreset> defaultGLCPresets() {
+	vector<GLCPreset> presets;
+	for (int i = 0; i < sizeof(glcPresetTable) / sizeof(glcPresetTable[0]); i++) {
+		const float* v = glcPresetTable[i].st;
+		GLCPreset preset;
+		preset.name = glcPresetTable[i].name;
+		preset.key = glcPresetTable[i].key;
+		preset.stVertices = mat3(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8]);
+		presets.push_back(preset);
+	}
+	return presets;
+}
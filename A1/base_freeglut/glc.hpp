@@ -0,0 +1,57 @@
+#ifndef GLC_HPP
+#define GLC_HPP
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "ray.hpp"
+
+// Named GLC configuration: the st-plane triangle matched with the uv-plane triangle
+struct GLCPreset {
+	std::string name;
+	unsigned char key;		// Keyboard shortcut
+	glm::mat3 stVertices;	// One vertex per column, on the z = 1 plane
+};
+
+// Rays of one scanline in structure-of-arrays layout
+struct RayBatch {
+	std::vector<float> ox, oy, oz;	// Origins
+	std::vector<float> dx, dy, dz;	// Normalized directions
+
+	void resize(int n);
+	Ray ray(int i) const { return Ray(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i])); }
+};
+
+// General linear camera. For fixed uv/st triangles both the ray origin and the
+// unnormalized ray direction are affine in the pixel coordinate, so they are
+// reduced once per camera change to a base value plus per-pixel x and y steps.
+class GeneralLinearCamera {
+public:
+	GeneralLinearCamera();
+
+	// Precompute the affine coefficients. The view plane starts at viewPlaneStart
+	// on the uv (z = 0) plane and spans viewPlaneSize over width x height pixels.
+	void setup(const glm::mat3& uvVertices, const glm::mat3& stVertices,
+		const glm::vec3& viewPlaneStart, const glm::vec2& viewPlaneSize, int width, int height);
+
+	// Same camera with its rays expressed in another space
+	GeneralLinearCamera transformed(const glm::mat4& xform) const;
+
+	// Ray through the corner of pixel (x, y)
+	Ray ray(float x, float y) const;
+	// Rays of pixels x0 .. x0 + count - 1 on row y, written to batch[0 .. count - 1]
+	void scanline(int y, int x0, int count, RayBatch& batch) const;
+
+	// origin = o0 + x * ox + y * oy, direction = normalize(d0 + x * dx + y * dy)
+	glm::vec3 o0, ox, oy;
+	glm::vec3 d0, dx, dy;
+};
+
+// Transform from camera space into object space for a camera orbiting the mesh at
+// spherical coordinates (theta, phi, radius), matching the interactive viewer
+glm::mat4 objectFromOrbit(const glm::vec3& camCoords);
+
+// Built-in configurations: perspective, orthographic, pushbroom, crossed-slit, pencil and bilinear
+std::vector<GLCPreset> defaultGLCPresets();
+
+#endif
@@ -0,0 +1,671 @@
+// Offline GLC renderer: ray casts frames straight to image files, without a window or GL context.
+//
+// Usage: glc_headless [options] [--jobs FILE]
+//   --obj FILE            Mesh to render (default models/rectangle.obj)
+//   --mode NAME           GLC preset, e.g. perspective, pushbroom, crossed-slit (default perspective)
+//   --cam THETA PHI DIST  Orbit camera in degrees and distance (default 0 0 0)
+//   --uv 9 FLOATS         uv triangle, one vertex after the other
+//   --st 9 FLOATS         st triangle, overrides the preset
+//   --size W H            Image size in pixels (default 500 500)
+//   --packet N            Ray packet size, 1, 2 or 4 (default 4)
+//   --slices on|off       Render pushbroom cameras by plane slices (default on)
+//   --raster on|off       Rasterize perspective and orthographic cameras (default on)
+//   --check               Also ray cast every rasterized frame and fail unless all pixels match
+//   --check-bvh           Also ray cast every frame testing every triangle, and fail unless the
+//                         BVH finds the same closest hit in all pixels
+//   --aa N BUDGET         Anti-alias edges with N = 4 or 16 rays per pixel, at most BUDGET times
+//                         the pixel count extra rays per frame (default 1 1, off)
+//   --aa-compare          Also render uniform 4x and 16x supersampling and report the error of
+//                         the adaptive and the uniform 4x image against the 16x one
+//   --builder NAME        BVH builder, sah or lbvh (default sah)
+//   --views R C SPACING   Render an R x C light field instead, the uv triangle of each view
+//                         shifted by SPACING; --out gets the views tiled, row 0 at the bottom
+//   --threads N           BVH build and light-field threads, 0 for all hardware threads (default 0)
+//   --cache DIR           BVH cache directory, "" to always build (default cache)
+//   --resident MB         Ray cast from the mapped BVH cache file, in bands of rows, evicting it
+//                         whenever more than MB megabytes of it are in memory (0 for no cap), and
+//                         report page faults and reads; not with --aa or --views
+//   --deform SECONDS      Bend the mesh by a wave this far into its animation and refit its BVH
+//                         for the frame; frames ray cast here, not on workers or with --resident
+//   --refit-limit GROWTH  Rebuild BVH subtrees, or the whole BVH, once refitting has grown its
+//                         SAH cost by more than GROWTH times (default 1.5)
+//   --out FILE            Output image, .png, .ppm or .pfm for float RGB (default out.png)
+//   --jobs FILE           Render one frame per line of FILE; each line holds options
+//                         applied on top of the command line ones, # starts a comment
+//   --writers N           Threads writing images while the next frames render, 0 for all
+//                         hardware threads (default 1)
+//   --write-queue N       Frames waiting to be written before rendering waits for the writers,
+//                         0 to write each one before the next frame (default 4)
+//   --stats FILE          Write the rays, hits and timings of every frame to FILE as JSON; node
+//                         visits and triangle tests are counted in GLC_STATS builds (make STATS=1).
+//                         Frames are then ray cast rather than rasterized or sliced
+//   --serve ADDR N        Ray cast frames on worker processes instead, in 64x64 tiles; waits for N
+//                         workers to connect at ADDR, HOST:PORT or unix:PATH
+//   --worker ADDR         Run as a worker for the coordinator at ADDR until it exits
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <cctype>
+#include <cmath>
+#include <glm/glm.hpp>
+#include "meshdata.hpp"
+#include "bvh.hpp"
+#include "bvhcache.hpp"
+#include "glc.hpp"
+#include "render.hpp"
+#include "pushbroom.hpp"
+#include "raster.hpp"
+#include "lightfield.hpp"
+#include "antialias.hpp"
+#include "distributed.hpp"
+#include "framewriter.hpp"
+using namespace std;
+using namespace glm;
+
+// One frame to render
+struct Job {
+	string obj;
+	string mode;
+	vec3 camCoords;
+	mat3 uvVertices;
+	mat3 stVertices;
+	bool customST;		// stVertices given explicitly instead of taken from the preset
+	int width, height;
+	int packetSize;
+	bool slices;
+	bool raster;
+	bool check;
+	bool checkBVH;
+	int aaSamples;			// Rays per edge pixel, 1 for none
+	float aaBudget;			// Extra rays per frame over the pixel count
+	bool aaCompare;
+	int viewRows, viewCols;	// Light-field grid, 0 x 0 for a single frame
+	float viewSpacing;
+	BVHBuilder builder;
+	int threads;
+	string cacheDir;
+	float residentMB;		// Cap on the mapped BVH in memory, negative to load the BVH as usual
+	float deformTime;		// Point of the mesh's wave animation in seconds, negative for the mesh at rest
+	float refitGrowth;		// SAH cost growth past which refitting rebuilds
+	string out;
+
+	Job() : obj("models/rectangle.obj"), mode("perspective"), camCoords(0.0f),
+		uvVertices(0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f), stVertices(1.0f),
+		customST(false), width(500), height(500), packetSize(4), slices(true), raster(true), check(false),
+		checkBVH(false), aaSamples(1), aaBudget(1.0f), aaCompare(false),
+		viewRows(0), viewCols(0), viewSpacing(0.0f), builder(BUILD_SAH), threads(0),
+		cacheDir("cache"), residentMB(-1.0f), deformTime(-1.0f), refitGrowth(1.5f), out("out.png") {}
+};
+
+// Options of the whole run rather than of a frame, only accepted on the command line
+struct RunOptions {
+	string jobFile;
+	string statsFile;
+	string serveAddress;	// Coordinator address when distributing tiles
+	int serveWorkers;		// Workers to wait for before the first frame
+	string workerAddress;	// Coordinator to work for, instead of rendering jobs
+	int writers;			// Image writer threads
+	int writeQueue;			// Frames rendered ahead of the writers
+	RunOptions() : serveWorkers(1), writers(1), writeQueue(4) {}
+};
+
+// Mesh and BVH loaded once and shared by every job rendering the same file
+struct Scene {
+	MeshData mesh;
+	shared_ptr<MappedFile> file;	// Cache file the BVH is read from when mapped
+	BVH* bvh;
+	vector<vec3> rest;		// Vertices as loaded, once the mesh is deformed
+	float deformTime;		// Point of the wave the mesh and BVH are at, negative at rest
+	Scene(const Job& job) : bvh(NULL), deformTime(-1.0f) {
+		if (job.residentMB < 0.0f) {
+			mesh.load(job.obj);
+			bvh = loadCachedBVH(job.cacheDir, mesh.raw_vertices, mesh.v_elements, job.builder, job.threads);
+			return;
+		}
+		// Rays only need the mapped BVH, found by the file alone; the mesh is read only to build
+		// it, and not kept in memory beside it
+		bvh = loadCachedBVH(job.cacheDir, job.obj, mesh, job.builder, job.threads, &file);
+		mesh = MeshData();
+	}
+	~Scene() { delete bvh; }
+};
+
+static const vec2 viewPlaneSize(4.0f, 4.0f);
+static const vec3 viewPlaneStart(-2.0f, -2.0f, 0.0f);
+static const u8vec3 bgColor(255, 255, 255);
+// Rows ray cast between checks of the resident memory cap
+static const int PAGED_BAND_ROWS = 16;
+
+string lowercase(string s) {
+	for (size_t i = 0; i < s.size(); i++)
+		s[i] = tolower(s[i]);
+	return s;
+}
+
+// Read count floats following option args[i] into values
+void readFloats(const vector<string>& args, size_t& i, int count, float* values) {
+	if (i + count >= args.size())
+		throw runtime_error("Option " + args[i] + " expects " + to_string(count) + " values");
+	for (int k = 0; k < count; k++) {
+		try {
+			values[k] = stof(args[++i]);
+		} catch (const exception&) {
+			throw runtime_error("Option " + args[i - k - 1] + " - invalid number: " + args[i]);
+		}
+	}
+}
+
+string readString(const vector<string>& args, size_t& i) {
+	if (i + 1 >= args.size())
+		throw runtime_error("Option " + args[i] + " expects a value");
+	return args[++i];
+}
+
+bool readSwitch(const vector<string>& args, size_t& i) {
+	string value = lowercase(readString(args, i));
+	if (value != "on" && value != "off")
+		throw runtime_error("Option " + args[i - 1] + " expects on or off");
+	return value == "on";
+}
+
+mat3 readMat3(const vector<string>& args, size_t& i) {
+	float v[9];
+	readFloats(args, i, 9, v);
+	return mat3(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8]);
+}
+
+// Apply options to job; options of the whole run go to run, and are only accepted where it is given
+void parseOptions(const vector<string>& args, Job& job, RunOptions* run) {
+	for (size_t i = 0; i < args.size(); i++) {
+		const string& opt = args[i];
+		if (opt == "--obj") {
+			job.obj = readString(args, i);
+		} else if (opt == "--mode") {
+			job.mode = lowercase(readString(args, i));
+			job.customST = false;
+		} else if (opt == "--cam") {
+			float v[3];
+			readFloats(args, i, 3, v);
+			job.camCoords = vec3(v[0], v[1], v[2]);
+		} else if (opt == "--uv") {
+			job.uvVertices = readMat3(args, i);
+		} else if (opt == "--st") {
+			job.stVertices = readMat3(args, i);
+			job.customST = true;
+		} else if (opt == "--size") {
+			float v[2];
+			readFloats(args, i, 2, v);
+			job.width = (int)v[0];
+			job.height = (int)v[1];
+			if (job.width <= 0 || job.height <= 0)
+				throw runtime_error("Option --size expects positive values");
+		} else if (opt == "--packet") {
+			float v;
+			readFloats(args, i, 1, &v);
+			job.packetSize = (int)v;
+			if (job.packetSize < 1 || job.packetSize * job.packetSize > RayPacket::MAX_RAYS)
+				throw runtime_error("Option --packet expects 1, 2 or 4");
+		} else if (opt == "--slices") {
+			job.slices = readSwitch(args, i);
+		} else if (opt == "--raster") {
+			job.raster = readSwitch(args, i);
+		} else if (opt == "--check") {
+			job.check = true;
+		} else if (opt == "--check-bvh") {
+			job.checkBVH = true;
+		} else if (opt == "--aa") {
+			float v[2];
+			readFloats(args, i, 2, v);
+			job.aaSamples = (int)v[0];
+			job.aaBudget = glm::max(0.0f, v[1]);
+		} else if (opt == "--aa-compare") {
+			job.aaCompare = true;
+		} else if (opt == "--views") {
+			float v[3];
+			readFloats(args, i, 3, v);
+			job.viewRows = (int)v[0];
+			job.viewCols = (int)v[1];
+			job.viewSpacing = v[2];
+			if (job.viewRows <= 0 || job.viewCols <= 0)
+				throw runtime_error("Option --views expects a positive number of rows and columns");
+		} else if (opt == "--builder") {
+			string name = lowercase(readString(args, i));
+			if (name == "sah")
+				job.builder = BUILD_SAH;
+			else if (name == "lbvh")
+				job.builder = BUILD_LBVH;
+			else
+				throw runtime_error("Unknown BVH builder: " + name);
+		} else if (opt == "--threads") {
+			float v;
+			readFloats(args, i, 1, &v);
+			job.threads = glm::max(0, (int)v);
+		} else if (opt == "--cache") {
+			job.cacheDir = readString(args, i);
+		} else if (opt == "--resident") {
+			float v;
+			readFloats(args, i, 1, &v);
+			job.residentMB = glm::max(0.0f, v);
+		} else if (opt == "--deform") {
+			float v;
+			readFloats(args, i, 1, &v);
+			job.deformTime = glm::max(0.0f, v);
+		} else if (opt == "--refit-limit") {
+			float v;
+			readFloats(args, i, 1, &v);
+			job.refitGrowth = glm::max(1.0f, v);
+		} else if (opt == "--out") {
+			job.out = readString(args, i);
+		} else if (opt == "--jobs" && run) {
+			run->jobFile = readString(args, i);
+		} else if (opt == "--stats" && run) {
+			run->statsFile = readString(args, i);
+		} else if (opt == "--serve" && run) {
+			run->serveAddress = readString(args, i);
+			float v;
+			readFloats(args, i, 1, &v);
+			run->serveWorkers = glm::max(1, (int)v);
+		} else if (opt == "--worker" && run) {
+			run->workerAddress = readString(args, i);
+		} else if (opt == "--writers" && run) {
+			float v;
+			readFloats(args, i, 1, &v);
+			run->writers = glm::max(0, (int)v);
+		} else if (opt == "--write-queue" && run) {
+			float v;
+			readFloats(args, i, 1, &v);
+			run->writeQueue = glm::max(0, (int)v);
+		} else {
+			throw runtime_error("Unknown option: " + opt);
+		}
+	}
+}
+
+// Split the job file into one job per non-empty line
+vector<Job> readJobs(string filename, const Job& base) {
+	ifstream file(filename);
+	if (!file.is_open())
+		throw runtime_error("Could not open job file: " + filename);
+
+	vector<Job> jobs;
+	string line;
+	int lineNum = 0;
+	while (getline(file, line)) {
+		lineNum++;
+		size_t comment = line.find('#');
+		if (comment != string::npos)
+			line.erase(comment);
+
+		istringstream tokens(line);
+		vector<string> args;
+		string arg;
+		while (tokens >> arg)
+			args.push_back(arg);
+		if (args.empty())
+			continue;
+
+		Job job = base;
+		try {
+			parseOptions(args, job, NULL);
+		} catch (const exception& e) {
+			throw runtime_error(filename + ":" + to_string(lineNum) + " - " + e.what());
+		}
+		jobs.push_back(job);
+	}
+	return jobs;
+}
+
+const GLCPreset& findPreset(const vector<GLCPreset>& presets, const string& mode) {
+	for (size_t i = 0; i < presets.size(); i++)
+		if (lowercase(presets[i].name) == mode)
+			return presets[i];
+	throw runtime_error("Unknown GLC mode: " + mode);
+}
+
+// Rasterize the frame and ray cast it pixel by pixel; returns the number of pixels whose
+// closest triangle or instance differs
+int checkRaster(Rasterizer& rasterizer, const BVH& bvh, const GeneralLinearCamera& cam, const Job& job) {
+	if (!Rasterizer::supports(cam))
+		throw runtime_error("--check needs a perspective or orthographic camera");
+	vector<Hit> rasterHits(job.width * job.height), tracedHits(job.width * job.height);
+	auto keep = [](const Hit& hit) { return hit; };
+	rasterizer.render(bvh, cam, job.height, job.width, keep, &rasterHits[0]);
+	NoInstrumentation instr;
+	renderFrame(bvh, cam, classifyCamera(cam), job.height, job.width, job.packetSize, keep, &tracedHits[0], instr);
+
+	int differ = 0;
+	for (size_t i = 0; i < rasterHits.size(); i++)
+		if (rasterHits[i].tri != tracedHits[i].tri || rasterHits[i].instance != tracedHits[i].instance)
+			differ++;
+	return differ;
+}
+
+// Every triangle of a BVH tested against every ray, in the order they are stored
+struct BruteForce {
+	const BVH& bvh;
+	BruteForce(const BVH& bvh) : bvh(bvh) {}
+	bool intersect(const Ray& ray, Hit& hit) const {
+		int prevTri = hit.tri;
+		for (unsigned int i = 0; i < bvh.getTriCount(); i++)
+			BVH::intersectTri(ray.getOrigin(), ray.getDir(), bvh.getTris()[i], hit);
+		return hit.tri != prevTri;
+	}
+	void intersect(const RayPacket& packet, Hit* hits) const {
+		for (int i = 0; i < packet.count; i++)
+			intersect(Ray(packet.origins[i], packet.dirs[i]), hits[i]);
+	}
+};
+
+// Ray cast the frame through the BVH and by brute force; returns the number of pixels where
+// one hits and the other misses, or the closest hits lie at different distances. Triangles
+// meeting where a ray crosses them are hit at the same distance and either may be kept.
+int checkBVH(const BVH& bvh, const GeneralLinearCamera& cam, CameraKind kind, const Job& job) {
+	vector<Hit> tracedHits(job.width * job.height), bruteHits(job.width * job.height);
+	auto keep = [](const Hit& hit) { return hit; };
+	NoInstrumentation instr;
+	renderFrame(bvh, cam, kind, job.height, job.width, job.packetSize, keep, &tracedHits[0], instr);
+	renderFrame(BruteForce(bvh), cam, kind, job.height, job.width, job.packetSize, keep, &bruteHits[0], instr);
+
+	int differ = 0;
+	for (size_t i = 0; i < tracedHits.size(); i++) {
+		const Hit& a = tracedHits[i];
+		const Hit& b = bruteHits[i];
+		if ((a.tri == -1) != (b.tri == -1) || (a.tri != -1 && fabs(a.t - b.t) > 1e-5f * glm::max(1.0f, b.t)))
+			differ++;
+	}
+	return differ;
+}
+
+// Work for the coordinator at address, loading each mesh the first time a frame needs it with
+// the builder, threads and cache of the frame and the command line; returns the tiles rendered
+int serveTiles(const string& address, const Job& base) {
+	map<string, unique_ptr<Scene> > scenes;
+	return runTileWorker(address, [&](const TileFrame& frame) -> const BVH& {
+		unique_ptr<Scene>& scene = scenes[frame.obj + (frame.builder == BUILD_LBVH ? "#lbvh" : "#sah")];
+		if (!scene) {
+			Job job = base;
+			job.obj = frame.obj;
+			job.builder = frame.builder;
+			job.cacheDir = frame.cacheDir;
+			scene.reset(new Scene(job));
+			cout << "Loaded " << job.obj << ": " << scene->mesh.v_elements.size() / 3 << " triangles" << endl;
+		}
+		return *scene->bvh;
+	});
+}
+
+// Ray cast the frame in bands of rows from the mapped BVH, keeping it under the budget's cap in between
+template <class Instrumentation, class Shade>
+void renderPaged(const BVH& bvh, const GeneralLinearCamera& cam, CameraKind kind, const Job& job, Shade shade,
+	u8vec3* pixels, Instrumentation& instr, PageBudget& budget) {
+	vector<RayBatch> batches(job.packetSize);
+	for (int y = 0; y < job.height; y += PAGED_BAND_ROWS) {
+		renderTile(bvh, cam, kind, 0, y, job.width, glm::min(PAGED_BAND_ROWS, job.height - y), job.width,
+			job.packetSize, shade, pixels, instr, batches);
+		budget.check();
+	}
+	instr.report();
+}
+
+// Root mean square difference of two images over their color channels
+double rmse(const vector<u8vec3>& a, const vector<u8vec3>& b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); i++) {
+		vec3 d = vec3(a[i].r, a[i].g, a[i].b) - vec3(b[i].r, b[i].g, b[i].b);
+		sum += dot(d, d);
+	}
+	return sqrt(sum / (3.0 * a.size()));
+}
+
+// Render the frame with 16 rays in every pixel as the reference, and with 4, and print the
+// rays spent and the error of those and of the rendered frame against the reference
+void compareAntialiasing(AdaptiveSampler& sampler, const BVH& bvh, const GeneralLinearCamera& cam, CameraKind kind,
+	const Job& job, const vector<u8vec3>& rendered) {
+	auto shade = [](const Hit& hit) { return shadeTriangle(hit, bgColor); };
+	int pixelCount = job.width * job.height;
+	long long renderedRays = job.aaSamples > 1 ? sampler.getRays() : pixelCount;
+	vector<u8vec3> reference(pixelCount), uniform(pixelCount);
+	AdaptiveSampler uniformSampler(AdaptiveSampler::MAX_SAMPLES);
+	uniformSampler.renderUniform(bvh, cam, kind, job.height, job.width, job.packetSize, shade, &reference[0]);
+	uniformSampler.setSamples(4);
+	uniformSampler.renderUniform(bvh, cam, kind, job.height, job.width, job.packetSize, shade, &uniform[0]);
+
+	cout << "  this frame: " << (double)renderedRays / pixelCount << " rays per pixel, RMSE "
+		<< rmse(rendered, reference) << " against 16x" << endl;
+	cout << "  uniform 4x: " << (double)uniformSampler.getRays() / pixelCount << " rays per pixel, RMSE "
+		<< rmse(uniform, reference) << " against 16x" << endl;
+}
+
+// One JSON object per frame, in job order
+void writeStats(string filename, const vector<Job>& jobs, const vector<RayCounters>& frameStats) {
+	ofstream file(filename);
+	if (!file.is_open())
+		throw runtime_error("Could not open statistics file: " + filename);
+	file << "{\"statsBuild\": " << (RAY_STATS_BUILD ? "true" : "false") << ", \"frames\": [\n";
+	for (size_t j = 0; j < frameStats.size(); j++) {
+		string out;
+		for (size_t k = 0; k < jobs[j].out.size(); k++) {
+			if (jobs[j].out[k] == '"' || jobs[j].out[k] == '\\') out += '\\';
+			out += jobs[j].out[k];
+		}
+		file << "  {\"out\": \"" << out << "\", \"stats\": " << frameStats[j].toJSON() << "}"
+			<< (j + 1 < frameStats.size() ? ",\n" : "\n");
+	}
+	file << "]}" << endl;
+	if (!file)
+		throw runtime_error("Could not write statistics file: " + filename);
+}
+
+int main(int argc, char** argv) {
+	typedef chrono::steady_clock clock;
+	try {
+		Job base;
+		RunOptions run;
+		parseOptions(vector<string>(argv + 1, argv + argc), base, &run);
+		if (!run.workerAddress.empty()) {
+			int tiles = serveTiles(run.workerAddress, base);
+			cout << "Coordinator closed the connection, " << tiles << " tile(s) rendered" << endl;
+			return 0;
+		}
+		vector<Job> jobs = run.jobFile.empty() ? vector<Job>(1, base) : readJobs(run.jobFile, base);
+		unique_ptr<TileCoordinator> coordinator;
+		if (!run.serveAddress.empty())
+			coordinator.reset(new TileCoordinator(run.serveAddress, run.serveWorkers));
+
+		vector<GLCPreset> presets = defaultGLCPresets();
+		map<string, Scene*> scenes;
+		SliceRenderer slicer;
+		Rasterizer rasterizer;
+		AdaptiveSampler sampler;
+		FrameWriter writer(run.writers, run.writeQueue);
+		int failedChecks = 0;
+		vector<u8vec3> pixels;
+		double totalMs = 0.0;
+		vector<RayCounters> frameStats;
+
+		for (size_t j = 0; j < jobs.size(); j++) {
+			const Job& job = jobs[j];
+
+			// Load each mesh and build its BVH only the first time a job uses it with that builder;
+			// frames ray cast on workers only need it here to check or compare them
+			bool paged = job.residentMB >= 0.0f;
+			if (paged && (job.viewRows || job.aaSamples > 1))
+				throw runtime_error(job.out + " - --resident renders single frames without anti-aliasing");
+			if (paged && job.deformTime >= 0.0f)
+				throw runtime_error(job.out + " - --resident BVHs are read-only and cannot be deformed");
+			bool distributed = coordinator && job.aaSamples <= 1 && !job.viewRows && !paged && job.deformTime < 0.0f;
+			Scene*& scene = scenes[job.obj + (job.builder == BUILD_LBVH ? "#lbvh" : "#sah") + (paged ? "#mapped" : "")];
+			if (!scene && (!distributed || job.check || job.checkBVH || job.aaCompare)) {
+				clock::time_point loadStart = clock::now();
+				scene = new Scene(job);
+				cout << "Loaded " << job.obj << ": " << scene->bvh->getTriCount() << " triangles in "
+					<< chrono::duration<double, milli>(clock::now() - loadStart).count() << " ms" << endl;
+				cout << "  " << scene->bvh->getStats() << endl;
+			}
+
+			// Move the mesh to the job's point of the wave, or back to rest, and refit its BVH
+			if (scene && job.deformTime != scene->deformTime) {
+				if (scene->rest.empty())
+					scene->rest = scene->mesh.raw_vertices;
+				if (job.deformTime >= 0.0f) {
+					pair<vec3, vec3> bounds = scene->mesh.boundingBox();
+					waveVertices(scene->rest, bounds.first, bounds.second, job.deformTime, scene->mesh.raw_vertices);
+				} else {
+					scene->mesh.raw_vertices = scene->rest;
+				}
+				RefitStats refit = scene->bvh->refit(scene->mesh.raw_vertices, scene->mesh.v_elements, job.refitGrowth);
+				scene->deformTime = job.deformTime;
+				if (job.deformTime >= 0.0f)
+					cout << "Deformed " << job.obj << " to " << job.deformTime << " s of its wave: " << refit << endl;
+				else
+					cout << "Restored " << job.obj << ": " << refit << endl;
+			}
+
+			mat3 stVertices = job.customST ? job.stVertices : findPreset(presets, job.mode).stVertices;
+			auto shade = [](const Hit& hit) { return shadeTriangle(hit, bgColor); };
+			if (job.viewRows) {
+				vector<LightFieldView> views = lightFieldGrid(job.uvVertices, stVertices, job.viewRows, job.viewCols,
+					job.viewSpacing);
+				vector<u8vec3> lightField(views.size() * job.width * job.height, bgColor);
+				LightFieldRenderer renderer(job.threads, !run.statsFile.empty());
+				clock::time_point start = clock::now();
+				renderer.render(*scene->bvh, views, objectFromOrbit(job.camCoords),
+					viewPlaneStart, viewPlaneSize, job.height, job.width, job.packetSize, shade, &lightField[0]);
+				double renderMs = chrono::duration<double, milli>(clock::now() - start).count();
+				totalMs += renderMs;
+				frameStats.push_back(renderer.getCounters());
+
+				// Tile the views into one image, view (r, c) at column c of row r from the bottom
+				int mosaicWidth = job.viewCols * job.width;
+				pixels.resize(lightField.size());
+				for (size_t v = 0; v < views.size(); v++) {
+					int r = (int)v / job.viewCols, c = (int)v % job.viewCols;
+					for (int y = 0; y < job.height; y++) {
+						const u8vec3* row = &lightField[0] + (v * job.height + y) * job.width;
+						copy(row, row + job.width, &pixels[(r * job.height + y) * mosaicWidth + c * job.width]);
+					}
+				}
+				writer.write(job.out, mosaicWidth, job.viewRows * job.height, std::move(pixels));
+				cout << job.out << ": " << job.viewRows << "x" << job.viewCols << " views of " << job.width << "x"
+					<< job.height << " " << (job.customST ? string("custom") : job.mode) << ", rendered in " << renderMs
+					<< " ms, " << renderMs / views.size() << " ms per view" << endl;
+				continue;
+			}
+
+			GeneralLinearCamera camera;
+			camera.setup(job.uvVertices, stVertices, viewPlaneStart, viewPlaneSize, job.width, job.height);
+			GeneralLinearCamera objCam = camera.transformed(objectFromOrbit(job.camCoords));
+
+			pixels.assign(job.width * job.height, bgColor);
+			CameraKind kind = classifyCamera(objCam);
+			bool antialiased = job.aaSamples > 1;
+			// Frames are ray cast when counting their work, rasterizing and slicing trace no rays
+			bool counted = !run.statsFile.empty();
+			bool rasterized = !antialiased && !distributed && !paged && !counted && job.raster && Rasterizer::supports(objCam);
+			bool sliced = !rasterized && !distributed && !paged && !counted && job.slices && kind == KIND_PUSHBROOM && SliceRenderer::supports(objCam);
+			RayCounters counters;
+			StatsInstrumentation stats(counters);
+			NoInstrumentation instr;
+			threadRayCounters().reset();
+			unique_ptr<PageBudget> budget;
+			if (paged)
+				budget.reset(new PageBudget(scene->file, *scene->bvh, (size_t)(job.residentMB * 1048576.0)));
+			clock::time_point start = clock::now();
+			sampler.setSamples(job.aaSamples);
+			sampler.setBudget(job.aaBudget);
+			if (distributed) {
+				TileFrame frame;
+				frame.obj = job.obj;
+				frame.cacheDir = job.cacheDir;
+				frame.builder = job.builder;
+				frame.cam = objCam;
+				frame.rows = job.height;
+				frame.cols = job.width;
+				frame.packetSize = job.packetSize;
+				frame.background = bgColor;
+				coordinator->render(frame, &pixels[0]);
+			} else if (paged) {
+				budget->begin();
+				if (counted)
+					renderPaged(*scene->bvh, objCam, kind, job, shade, &pixels[0], stats, *budget);
+				else
+					renderPaged(*scene->bvh, objCam, kind, job, shade, &pixels[0], instr, *budget);
+			} else if (antialiased)
+				sampler.render(*scene->bvh, objCam, kind, job.height, job.width, job.packetSize, shade, &pixels[0]);
+			else if (rasterized)
+				rasterizer.render(*scene->bvh, objCam, job.height, job.width, shade, &pixels[0]);
+			else if (sliced)
+				slicer.render(*scene->bvh, objCam, job.height, job.width, shade, &pixels[0]);
+			else if (counted)
+				renderFrame(*scene->bvh, objCam, kind, job.height, job.width, job.packetSize, shade, &pixels[0], stats);
+			else
+				renderFrame(*scene->bvh, objCam, kind, job.height, job.width, job.packetSize, shade, &pixels[0], instr);
+			double renderMs = chrono::duration<double, milli>(clock::now() - start).count();
+			totalMs += renderMs;
+			collectThreadRayCounters(counters);
+			PagingStats paging;
+			if (paged) paging = budget->end();
+			if (antialiased)
+				counters.rays = sampler.getRays();
+			frameStats.push_back(counters);
+
+			cout << job.out << ": " << job.width << "x" << job.height << " "
+				<< (job.customST ? string("custom") : job.mode)
+				<< (rasterized ? " (rasterized)" : sliced ? " (sliced)" : distributed ? " (distributed)" : paged ? " (mapped)" : "")
+				<< ", rendered in " << renderMs << " ms" << endl;
+			if (distributed)
+				coordinator->report(cout);
+			if (paged)
+				cout << "  paging: " << paging << endl;
+			if (counted && RAY_STATS_BUILD && counters.rays)
+				cout << "  bounds: " << counters.culledRays << " of " << counters.rays << " rays ("
+					<< 100.0 * counters.culledRays / counters.rays << "%) missed the scene's bounding box" << endl;
+			if (antialiased)
+				cout << "  anti-aliasing: " << sampler.getRefinedPixels() << " pixels refined, "
+					<< (double)sampler.getRays() / (job.width * job.height) << " rays per pixel" << endl;
+			if (job.aaCompare)
+				compareAntialiasing(sampler, *scene->bvh, objCam, kind, job, pixels);
+
+			if (job.check) {
+				int differ = checkRaster(rasterizer, *scene->bvh, objCam, job);
+				cout << "  check: " << differ << " of " << job.width * job.height
+					<< " pixels differ from ray casting" << endl;
+				if (differ) failedChecks++;
+			}
+			if (job.checkBVH) {
+				int differ = checkBVH(*scene->bvh, objCam, kind, job);
+				cout << "  BVH check: " << differ << " of " << job.width * job.height
+					<< " pixels differ from testing every triangle" << endl;
+				if (differ) failedChecks++;
+			}
+			// The writers take the pixels over, the next frame allocates its own
+			writer.write(job.out, job.width, job.height, std::move(pixels));
+		}
+		clock::time_point writeStart = clock::now();
+		writer.finish();
+
+		cout << jobs.size() << " frame(s), " << totalMs << " ms total, "
+			<< totalMs / jobs.size() << " ms per frame" << endl;
+		cout << writer.getWritten() << " image(s) written on " << writer.getThreads() << " thread(s) in "
+			<< writer.getEncodeMs() << " ms, rendering waited " << writer.getStallMs() << " ms for the queue and "
+			<< chrono::duration<double, milli>(clock::now() - writeStart).count() << " ms after the last frame" << endl;
+		if (!run.statsFile.empty())
+			writeStats(run.statsFile, jobs, frameStats);
+
+		for (map<string, Scene*>::iterator it = scenes.begin(); it != scenes.end(); ++it)
+			delete it->second;
+		if (failedChecks) {
+			cerr << failedChecks << " check(s) failed" << endl;
+			return -1;
+		}
+	} catch (const exception& e) {
+		cerr << "Fatal error: " << e.what() << endl;
+		return -1;
+	}
+	return 0;
+}
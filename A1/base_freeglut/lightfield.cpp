@@ -0,0 +1,25 @@
+#include "lightfield.hpp"
+#include <stdexcept>
+using namespace std;
+using namespace glm;
+
+vector<LightFieldView> lightFieldGrid(const mat3& uvVertices, const mat3& stVertices,
+	int viewRows, int viewCols, float spacing) {
+	if (viewRows <= 0 || viewCols <= 0)
+		throw runtime_error("A light field needs at least one view");
+
+	vector<LightFieldView> views;
+	for (int r = 0; r < viewRows; r++) {
+		for (int c = 0; c < viewCols; c++) {
+			vec3 shift(spacing * (c - (viewCols - 1) * 0.5f), spacing * (r - (viewRows - 1) * 0.5f), 0.0f);
+			LightFieldView view;
+			view.uvVertices = mat3(uvVertices[0] + shift, uvVertices[1] + shift, uvVertices[2] + shift);
+			view.stVertices = stVertices;
+			views.push_back(view);
+		}
+	}
+	return views;
+}
+
+LightFieldRenderer::LightFieldRenderer(int threads, bool countWork) :
+	threads(threads > 0 ? threads : glm::max(1, (int)thread::hardware_concurrency())), countWork(countWork) {}
@@ -0,0 +1,110 @@
+#ifndef LIGHTFIELD_HPP
+#define LIGHTFIELD_HPP
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <glm/glm.hpp>
+#include "bvh.hpp"
+#include "glc.hpp"
+#include "render.hpp"
+#include "raystats.hpp"
+
+// One view of a light field: a GLC given by its uv and st triangles in camera space
+struct LightFieldView {
+	glm::mat3 uvVertices;
+	glm::mat3 stVertices;
+};
+
+// viewRows x viewCols views for a light-field display, row by row. View (r, c) shifts the uv
+// triangle within the uv plane by spacing times its offset from the center of the grid and
+// keeps the st triangle, so the views look through the same st window from a grid of positions.
+std::vector<LightFieldView> lightFieldGrid(const glm::mat3& uvVertices, const glm::mat3& stVertices,
+	int viewRows, int viewCols, float spacing);
+
+// Renders many views of one scene as a single job into one contiguous light-field array. The
+// images are cut into tiles and each tile is ray cast for every view before the next one, so
+// the BVH nodes the rays of a tile visit are still cached when the neighbouring views trace the
+// same part of the scene. Tiles are handed out to threads from a shared counter. When counting
+// is on, each thread counts its work apart and adds it to the render's counters when it runs out
+// of tiles; otherwise the tiles are ray cast without instrumentation.
+class LightFieldRenderer {
+public:
+	static const int TILE = 32;		// Pixels per side of a tile
+
+	// threads = 0 uses every hardware thread; countWork fills getCounters() on every render
+	LightFieldRenderer(int threads = 0, bool countWork = false);
+
+	// Render every view at rows x cols into lightField, pixel (x, y) of view v at
+	// lightField[(v * rows + y) * cols + x]; for a grid of views this is the 4D array
+	// [view row][view column][y][x]. The views are placed in accel's space by objectFromCamera
+	// and their pixels cover viewPlaneSize from viewPlaneStart, as GeneralLinearCamera::setup.
+	template <class Shade, class Pixel, class Accel>
+	void render(const Accel& accel, const std::vector<LightFieldView>& views, const glm::mat4& objectFromCamera,
+		const glm::vec3& viewPlaneStart, const glm::vec2& viewPlaneSize, int rows, int cols, int packetSize,
+		Shade shade, Pixel* lightField) {
+		std::vector<GeneralLinearCamera> cameras(views.size());
+		std::vector<CameraKind> kinds(views.size());
+		for (size_t v = 0; v < views.size(); v++) {
+			GeneralLinearCamera cam;
+			cam.setup(views[v].uvVertices, views[v].stVertices, viewPlaneStart, viewPlaneSize, cols, rows);
+			cameras[v] = cam.transformed(objectFromCamera);
+			kinds[v] = classifyCamera(cameras[v]);
+		}
+
+		int tileCount = ((cols + TILE - 1) / TILE) * ((rows + TILE - 1) / TILE);
+		std::atomic<int> nextTile(0);
+		std::mutex countersLock;
+		counters.reset();
+		threadRayCounters().reset();
+		auto work = [&]() {
+			if (!countWork) {
+				NoInstrumentation instr;
+				renderTiles(accel, cameras, kinds, rows, cols, packetSize, shade, lightField, nextTile, instr);
+				return;
+			}
+			RayCounters local;
+			StatsInstrumentation instr(local);
+			renderTiles(accel, cameras, kinds, rows, cols, packetSize, shade, lightField, nextTile, instr);
+			std::lock_guard<std::mutex> lock(countersLock);
+			counters.add(local);
+			collectThreadRayCounters(counters);
+		};
+
+		std::vector<std::thread> workers;
+		for (int i = 1; i < glm::min(threads, tileCount); i++)
+			workers.push_back(std::thread(work));
+		work();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	// Work of the last render, summed over its threads; traversal times add up the threads' times.
+	// All zero unless countWork is on.
+	const RayCounters& getCounters() const { return counters; }
+
+protected:
+	// Take tiles from nextTile until none are left and ray cast each one for every view
+	template <class Shade, class Pixel, class Accel, class Instrumentation>
+	void renderTiles(const Accel& accel, const std::vector<GeneralLinearCamera>& cameras,
+		const std::vector<CameraKind>& kinds, int rows, int cols, int packetSize, Shade shade, Pixel* lightField,
+		std::atomic<int>& nextTile, Instrumentation& instr) {
+		std::vector<RayBatch> batches(packetSize);
+		int tileCols = (cols + TILE - 1) / TILE;
+		int tileCount = tileCols * ((rows + TILE - 1) / TILE);
+		for (int tile = nextTile++; tile < tileCount; tile = nextTile++) {
+			int x0 = tile % tileCols * TILE, y0 = tile / tileCols * TILE;
+			int width = glm::min(TILE, cols - x0), height = glm::min(TILE, rows - y0);
+			for (size_t v = 0; v < cameras.size(); v++)
+				renderTile(accel, cameras[v], kinds[v], x0, y0, width, height, cols, packetSize, shade,
+					lightField + v * rows * cols, instr, batches);
+		}
+	}
+
+	int threads;
+	bool countWork;
+	RayCounters counters;
+};
+
+#endif
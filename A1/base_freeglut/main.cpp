@@ -1,5 +1,7 @@
 #include <iostream>
+#include <fstream>
 #include <cassert>
+#include <chrono>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -8,6 +10,18 @@
 #include "util.hpp"
 #include "mesh.hpp"
 #include "ray.hpp"
+#include "bvh.hpp"
+#include "tlas.hpp"
+#include "bvhcache.hpp"
+#include "glc.hpp"
+#include "render.hpp"
+#include "pushbroom.hpp"
+#include "raster.hpp"
+#include "reproject.hpp"
+#include "rendertarget.hpp"
+#include "framecache.hpp"
+#include "raystats.hpp"
+#include "antialias.hpp"
 using namespace std;
 using namespace glm;
 
@@ -28,6 +42,9 @@ GLuint vbuf;		   // Vertex buffer
 GLuint ibuf;
 GLsizei vcount; // Number of vertices
 Mesh *mesh;		// Mesh loaded from .obj file
+BVH *bvh;		// Acceleration structure over the mesh, in object space
+BVHBuilder bvhBuilder; // Algorithm used to build bvh
+TLAS scene;		// Copies of the mesh placed in object space, the first one untransformed
 
 
 // Camera state
@@ -40,20 +57,55 @@ vec2 mouseOrigin; // Original mouse coordinates upon clicking
 vec3 velocity;
 pair<vec3, vec3> meshBB;
 bool debug;
-vector<glm::u8vec3> textureData;
-GLuint texture;
+RenderTarget target;			// Image the camera renders into, at the window size times the render scale
+ScaleController scaleControl(16.0); // Adjusts the render scale toward a target frame time
+bool autoScale;					// Let scaleControl pick the render scale
 
 u8vec3 bgColor;
 
-mat3 uvVertices, orthographicSTVertices, perspectiveSTVertices, pushbroomSTVertices;
+mat3 uvVertices;
+vector<GLCPreset> glcPresets; // Selectable st-plane configurations
 mat3 stVertices;
 vec3 viewPlaneStartPos;
-GLint cameraMode;
+GLint cameraMode;			  // Index of the active preset
+GeneralLinearCamera camera;	  // Ray generator for the current camera, in camera space
+CameraKind cameraKind;		  // Specialized render loop for the current camera
+int packetSize; // Pixels per side of the ray packets traced together
+bool slicePushbroom;  // Render pushbroom cameras by plane slices instead of per-pixel traversal
+SliceRenderer slicer; // Segment buffers reused by every sliced frame
+bool rasterProjective; // Rasterize perspective and orthographic cameras instead of ray casting
+Rasterizer rasterizer; // Depth and visibility buffers of the rasterized frames
+bool reprojectDrags;	 // Reuse the previous frame's hits while the camera is dragged
+Reprojector reprojector; // Hits of the previous frame, kept for reprojection
+bool antialias;		 // Cast extra rays through edge pixels while the camera rests
+AdaptiveSampler sampler; // Edge detection and sample budget of anti-aliased frames
+bool showStats;			 // Count the ray-casting work of each frame and overlay its per-pixel cost
+RayCounters frameStats;	 // Counters of the last frame traced while showStats is on
+vector<float> pixelCost; // Node visits and triangle tests of each pixel of that frame
+
+// The texture is only re-traced when an input of the image changes
+RenderKey renderedKey; // Inputs of the image currently in the texture
+bool renderedValid;	   // Whether the texture holds a ray-cast image at all
+int meshVersion;	   // Bumped whenever the mesh is (re)loaded or its instances change
+FrameCache frameCache(64 << 20); // Finished frames of recently visited camera states, up to 64 MB
+
+// Mesh animation
+bool deforming;				   // Bend the mesh by a travelling wave every frame, refitting its BVH
+vector<vec3> restVertices;	   // Mesh vertices as loaded, while deforming
+chrono::steady_clock::time_point deformStart; // Time 0 of the wave
+int deformFrames;			   // Frames deformed, and how many of them rebuilt part or all of the BVH
+int deformRebuilds;
+double refitMs;				   // Time spent refitting them
+
+// Progressive rendering
+bool progressive;			  // Refine the image over several frames instead of tracing it at once
+double frameBudgetMs;		  // Ray-casting time allowed per frame while refining
+ProgressiveRenderer progress; // Refinement state of the current image
 
 
 // Constants
 // const int MENU_VIEWMODE = 0;		// Toggle view mode
-const int MENU_EXIT = 3;		 // Exit application
+const int MENU_EXIT = -1;		 // Exit application, presets use their index
 const int VIEWMODE_TRIANGLE = 0; // View triangle
 const int VIEWMODE_OBJ = 1;		 // View obj-loaded mesh
 const int PERSPECTIVE = 0;
@@ -80,12 +132,19 @@ void idle();
 void menu(int cmd);
 void cleanup();
 
-vec3 computeCurPixelPos(vec2 screenCoord);
-Ray generateRay(vec3 curPixelPos);
-float ray_triangle_intersect(Ray ray, vector<Vtx> meshVertices);
-vector<Vtx> get_coordinates();
+void selectCamera(int preset);
+void updateCamera();
 
+mat4 objectFromCamera();
+u8vec4 shadeHit(const Hit &hit);
+bool traceImage(int size, u8vec4 *pixels);
+void benchmarkTraversal();
+void benchmarkSpecialization();
+RenderKey currentRenderKey();
+void addInstances(int count);
 void GLCRender();
+void setRenderScale(float scale);
+void setDeforming(bool on);
 
 int main(int argc, char **argv)
 {
@@ -126,7 +185,20 @@ void initState()
 	ibuf = 0;
 	vcount = 0;
 	mesh = NULL;
-	texture = 0;
+	bvh = NULL;
+	bvhBuilder = BUILD_SAH;
+	packetSize = 4;
+	slicePushbroom = true;
+	rasterProjective = true;
+	reprojectDrags = true;
+	antialias = false;
+	showStats = false;
+	renderedValid = false;
+	meshVersion = 0;
+	deforming = false;
+	progressive = false;
+	frameBudgetMs = 12.0;
+	autoScale = false;
 
 	camCoords = vec3(0.0, 0.0, 0.0);
 	camRot = false;
@@ -138,11 +210,11 @@ void initState()
 	viewPlaneStartPos = vec3(-2.0f, -2.0f, 0.0f);
 
 	bgColor = u8vec3(255, 255, 255);
+	glcPresets = defaultGLCPresets();
 
 	// Set window and context settings
 	width = 500;
 	height = 500;
-	textureData.resize(width * height, bgColor);
 
 }
 
@@ -159,9 +231,8 @@ void initGLUT(int *argc, char **argv)
 
 	// Create a menu
 	glutCreateMenu(menu);
-	glutAddMenuEntry("Perspective", PERSPECTIVE);
-	glutAddMenuEntry("Orthographic", ORTHO);
-	glutAddMenuEntry("Pushbroom", PUSHBROOM);
+	for (int i = 0; i < glcPresets.size(); i++)
+		glutAddMenuEntry(glcPresets[i].name.c_str(), i);
 	glutAddMenuEntry("Exit", MENU_EXIT);
 	glutAttachMenu(GLUT_RIGHT_BUTTON);
 
@@ -172,7 +243,8 @@ void initGLUT(int *argc, char **argv)
 	glutKeyboardFunc(keyPressed);
 	glutMouseFunc(mouseBtn);
 	glutMotionFunc(mouseMove);
-	glutIdleFunc(idle);
+	// No idle callback unless the mesh is animated: frames are only drawn on demand, so an idle
+	// window uses no CPU
 	glutCloseFunc(cleanup);
 }
 
@@ -255,10 +327,17 @@ void initObj()
 	// Scale and center mesh using bounding box
 	meshBB = mesh->boundingBox();
 
-	// generateRay( vec3(0.7f, 0.3f, 1) );
-	// ray_triangle_intersect(Ray(vec3(0, 0, 0), vec3(1, 0, 0)));
-	// vector<Vtx> meshVertices = get_coordinates();
-	// float t = ray_triangle_intersect(Ray(vec3(0, 0, 0), vec3(0, 0, 1)), meshVertices);
+	// The BVH stays in object space, rays are moved into it instead
+	if (!bvh)
+	{
+		// Reuse the BVH built by an earlier run for the same mesh when there is one
+		bvh = loadCachedBVH("cache", mesh->raw_vertices, mesh->v_elements, bvhBuilder);
+		std::cout << bvh->getStats() << std::endl;
+		scene.clear();
+		scene.addInstance(bvh, mat4(1.0f));
+		reprojector.setMesh(*mesh);
+		meshVersion++;
+	}
 }
 
 void initTexture()
@@ -301,13 +380,8 @@ void initTexture()
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-	// Create texture object
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, textureData.data());
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	// Create the render target's texture and the pixel buffers feeding it
+	target.init(width, height, 1.0f, u8vec4(bgColor, 255));
 
 	assert(glGetError() == GL_NO_ERROR);
 }
@@ -318,262 +392,275 @@ void initCamera()
 					  1.0f, 0.0f, 0.0f,
 					  0.0f, 1.0f, 0.0f);
 
-	perspectiveSTVertices = mat3(0.0f, 0.0f, 1.0f,
-								 3.0f, 0.0f, 1.0f,
-								 0.0f, 3.0f, 1.0f);
-
-	orthographicSTVertices = mat3(0.0f, 0.0f, 1.0f,
-								  1.0f, 0.0f, 1.0f,
-								  0.0f, 1.0f, 1.0f);
-
-	pushbroomSTVertices = mat3(0.0f, 0.0f, 1.0f,
-							   1.0f, 0.0f, 1.0f,
-							   0.0f, 0.0f, 1.0f);
-
-	stVertices = perspectiveSTVertices;
-	cameraMode = PERSPECTIVE;
+	selectCamera(PERSPECTIVE);
 }
 
-vec3 computeCurPixelPos(vec2 screenCoord)
+void selectCamera(int preset)
 {
-	// suppose the view plane is in the same plane as the uv plane
-	// which is in z = 0 plane
-	// the viewplane has a range of [-1, 1] in both x and y axis in z = 0 plane
-	// so if my screenwidth and height is 512x512, then
-	// to calculate the current pixel position, I will start from -1, -1 and count accordingly
-
-	vec3 curPixelPos = viewPlaneStartPos + vec3(screenCoord.x * 4.0f / width, screenCoord.y * 4.0f / height, 0);
-	return curPixelPos;
+	cameraMode = preset;
+	stVertices = glcPresets[preset].stVertices;
+	updateCamera();
 }
 
-Ray generateRay(vec3 curPixelPos)
+void updateCamera()
 {
-	// as the viewplane is in z = 0 plane, same as uv plane
-	// we need to find out the alpha and beta for the coordinates of the uv plane
-	// we can use the same alpha, beta to get the coordinates of the st plane
-	// then we can generate a ray connecting the curPixelPos with the coord of the st plane
+	// the view plane lies in the uv (z = 0) plane and spans 4x4 units from viewPlaneStartPos,
+	// sampled at the render target's resolution
+	camera.setup(uvVertices, stVertices, viewPlaneStartPos, vec2(4.0f, 4.0f), target.getWidth(), target.getHeight());
+	cameraKind = classifyCamera(camera);
+}
 
-	// using barycentric coordinates, determining alpha, beta from uv plane
-	// COLUMN IS ROW MAJOR
-	// --------------------------------------------------------
-	mat2 M = mat2(uvVertices[0].x - uvVertices[2].x, uvVertices[0].y - uvVertices[2].y,
-				  uvVertices[1].x - uvVertices[2].x, uvVertices[1].y - uvVertices[2].y);
-	vec2 V = vec2(curPixelPos.x - uvVertices[2].x, curPixelPos.y - uvVertices[2].y);
+mat4 objectFromCamera()
+{
+	// Inverse of the camera transform that orbits the mesh
+	return objectFromOrbit(camCoords);
+}
 
-	vec2 result = inverse(M) * V;
-	float alpha = result.x;
-	float beta = result.y;
+u8vec4 shadeHit(const Hit &hit)
+{
+	return u8vec4(shadeTriangle(hit, bgColor), 255);
+}
 
-	if (debug == true)
+bool traceImage(int size, u8vec4 *pixels)
+{
+	// Generate rays directly in object space; the camera kind and the debug policy are
+	// resolved here once per frame, never inside the pixel loop. Returns false when the
+	// image was reprojected, which may differ slightly from a ray-cast one, or when it skipped
+	// anti-aliasing that is turned on.
+	GeneralLinearCamera objCamera = camera.transformed(objectFromCamera());
+	// Debugging and statistics follow every ray, so they need every pixel ray cast
+	bool traced = debug || showStats;
+	bool smooth = antialias && !camRot && !traced;
+	if (smooth)
 	{
-		std::cout << "alpha: " << alpha << " , beta: " << beta << endl;
+		sampler.render(scene, objCamera, cameraKind, target.getHeight(), target.getWidth(), size, shadeHit, pixels);
 	}
-
-	// compute the coordinate for the ST plane
-	vec3 sti = alpha * stVertices[0] + beta * stVertices[1] + (1 - alpha - beta) * stVertices[2];
-	if (debug == true)
+	else if (slicePushbroom && !traced && cameraKind == KIND_PUSHBROOM && SliceRenderer::supports(objCamera))
 	{
-		std::cout << "STI: " << sti.x << ", " << sti.y << ", " << sti.z << std::endl;
+		slicer.render(scene, objCamera, target.getHeight(), target.getWidth(), shadeHit, pixels);
 	}
-
-	// calculate ray center and direction
-	// ray will be basically uvi - curPixelPos(on uv plane)
-	vec3 rayOrigin = curPixelPos;
-
-	// changing z of rayOrigin so that it shows everything within z = 0 plane too
-	// rayOrigin.z = 0f; // NOT SURE
-
-	vec3 rayDir = normalize(sti - curPixelPos);
-	if (debug == true)
+	else if (reprojectDrags && camRot && !traced)
 	{
-		Ray temp = Ray(rayOrigin, rayDir);
-		temp.printRay();
+		// Ahead of rasterizing, which it outruns while the camera moves little per frame
+		reprojector.render(scene, objCamera, cameraKind, target.getHeight(), target.getWidth(), size, shadeHit, pixels);
+		return false;
 	}
-
-	return Ray(rayOrigin, rayDir);
+	else if (rasterProjective && !traced && Rasterizer::supports(objCamera))
+	{
+		rasterizer.render(scene, objCamera, target.getHeight(), target.getWidth(), shadeHit, pixels);
+	}
+	else if (debug == true)
+	{
+		DebugInstrumentation instr;
+		renderFrame(scene, objCamera, cameraKind, target.getHeight(), target.getWidth(), size, shadeHit, pixels, instr);
+	}
+	else if (showStats)
+	{
+		StatsInstrumentation instr(frameStats, &pixelCost, target.getWidth());
+		renderFrame(scene, objCamera, cameraKind, target.getHeight(), target.getWidth(), size, shadeHit, pixels, instr);
+	}
+	else
+	{
+		NoInstrumentation instr;
+		renderFrame(scene, objCamera, cameraKind, target.getHeight(), target.getWidth(), size, shadeHit, pixels, instr);
+	}
+	return smooth || !antialias;
 }
 
-float ray_triangle_intersect(Ray ray, vector<Vtx> meshVertices)
+void benchmarkTraversal()
 {
-	for (int i = 0; i < mesh->v_elements.size(); i += 3)
+	// Compare single-ray traversal against 2x2 and 4x4 packets in every camera mode, with
+	// the rasterized and sliced paths turned off so every mode is ray cast
+	const int sizes[] = {1, 2, 4};
+	const int runs = 5;
+	int savedMode = cameraMode;
+	bool savedRaster = rasterProjective, savedSlices = slicePushbroom;
+	rasterProjective = slicePushbroom = false;
+
+	for (int m = 0; m < glcPresets.size(); m++)
 	{
-		// Decide whether the ray can interact with the plane
-		if (fabs(dot(meshVertices[i + 0].norm, ray.getDir())) < 0.001)
+		selectCamera(m);
+		double singleMs = 0.0;
+		for (int s = 0; s < 3; s++)
 		{
-			// It means ray and triangle plane will not have intersection
-			return -1;
-		}
-		// ray.printRay();
-		// std::cout << meshVertices[0].norm.x << ", " << meshVertices[0].norm.y << ", " << meshVertices[0].norm.z << std::endl;
-		// barycentric coordinates calculation
-
-		float ax = meshVertices[i + 0].pos.x;
-		float ay = meshVertices[i + 0].pos.y;
-		float az = meshVertices[i + 0].pos.z;
-
-		float bx = meshVertices[i + 1].pos.x;
-		float by = meshVertices[i + 1].pos.y;
-		float bz = meshVertices[i + 1].pos.z;
-
-		float cx = meshVertices[i + 2].pos.x;
-		float cy = meshVertices[i + 2].pos.y;
-		float cz = meshVertices[i + 2].pos.z;
-
-		float r0x = ray.getOrigin().x;
-		float r0y = ray.getOrigin().y;
-		float r0z = ray.getOrigin().z;
-
-		float rdx = ray.getDir().x;
-		float rdy = ray.getDir().y;
-		float rdz = ray.getDir().z;
-
-		mat3 A = mat3(ax - bx, ay - by, az - bz,
-					  ax - cx, ay - cy, az - cz,
-					  rdx, rdy, rdz);
-		float detA = determinant(A);
-
-		float beta = determinant(mat3(ax - r0x, ay - r0y, az - r0z,
-									  ax - cx, ay - cy, az - cz,
-									  rdx, rdy, rdz)) /
-					 detA;
-
-		float gamma = determinant(mat3(ax - bx, ay - by, az - bz,
-									   ax - r0x, ay - r0y, az - r0z,
-									   rdx, rdy, rdz)) /
-					  detA;
-
-		float t = determinant(mat3(ax - bx, ay - by, az - bz,
-								   ax - cx, ay - cy, az - cz,
-								   ax - r0x, ay - r0y, az - r0z)) /
-				  detA;
-
-		// std::cout << " Ray triangle intersection: " << std::endl;
-		// std::cout << "Beta: "<< beta << " , Gamma: " << gamma << " ,t: " << t << std::endl;
-
-		if (beta > 0 && gamma > 0 && t > 0 && (beta + gamma) < 1)
-		{
-			return i;
+			auto start = chrono::high_resolution_clock::now();
+			for (int r = 0; r < runs; r++)
+				traceImage(sizes[s], target.pixels());
+			double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+			if (sizes[s] == 1)
+				singleMs = ms;
+			std::cout << glcPresets[m].name << " " << sizes[s] << "x" << sizes[s] << ": " << ms << " ms"
+					  << " (speedup " << singleMs / ms << "x)" << std::endl;
 		}
 	}
-
-	return -1;
+	rasterProjective = savedRaster;
+	slicePushbroom = savedSlices;
+	selectCamera(savedMode);
 }
 
-vector<Vtx> get_coordinates()
+void benchmarkSpecialization()
 {
+	// Compare the generic loop (per-pixel normalize, runtime debug checks) with the
+	// loop specialized for the camera kind, both tracing 4x4 packets
+	const int runs = 5;
+	int savedMode = cameraMode;
 
-	vector<Vtx> meshVertices;
-	vector<vec3> rawVerts = vector<vec3>(mesh->raw_vertices.size());
-
-	// CALCULATE COORDINATES FOR MESH OBJECTS
-	mat4 xform;
-	mat4 view = translate(mat4(1.0f), vec3(0.0, 0.0, -camCoords.z));
-	mat4 rot = rotate(mat4(1.0f), radians(camCoords.y), vec3(1.0, 0.0, 0.0));
-	rot = rotate(rot, radians(camCoords.x), vec3(0.0, 1.0, 0.0));
-	xform = view * rot;
-	if (debug == true)
+	for (int m = 0; m < glcPresets.size(); m++)
 	{
-		std::cout << "Inside get coordinates func " << std::endl;
-		std::cout << "Xform Matrix: " << std::endl;
-		for (int i = 0; i < 4; i++)
+		selectCamera(m);
+		GeneralLinearCamera objCamera = camera.transformed(objectFromCamera());
+
+		auto start = chrono::high_resolution_clock::now();
+		for (int r = 0; r < runs; r++)
 		{
-			for (int j = 0; j < 4; j++)
-			{
-				std::cout << xform[i][j] << " ";
-			}
-			std::cout << std::endl;
+			FlagInstrumentation instr(debug);
+			renderFrame<PerspectiveKind>(scene, objCamera, target.getHeight(), target.getWidth(), 4, shadeHit, target.pixels(), instr);
 		}
+		double genericMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+
+		start = chrono::high_resolution_clock::now();
+		for (int r = 0; r < runs; r++)
+		{
+			NoInstrumentation instr;
+			renderFrame(scene, objCamera, cameraKind, target.getHeight(), target.getWidth(), 4, shadeHit, target.pixels(), instr);
+		}
+		double specializedMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+
+		std::cout << glcPresets[m].name << ": generic " << genericMs << " ms, specialized " << specializedMs << " ms"
+				  << " (speedup " << genericMs / specializedMs << "x)" << std::endl;
 	}
-	for (int i = 0; i < mesh->raw_vertices.size(); i++)
-	{
-		vec4 rawVert = vec4(mesh->raw_vertices[i], 1.f);
-		// std::cout << rawVert.x << " " << rawVert.y << " " << rawVert.z << " --> ";
-		rawVert = xform * rawVert;
-		rawVerts[i] = vec3(rawVert.x, rawVert.y, rawVert.z); // CHECK FOR THE Z COORDINATES
-															 // std::cout << rawVerts[i].x << ", " << rawVerts[i].y << ", " << rawVerts[i].z << std::endl;
-	}
-
-	// Regenerate the vertices
-	meshVertices = vector<Vtx>(mesh->v_elements.size());
-	for (int i = 0; i < mesh->v_elements.size(); i += 3)
-	{
-		// Store positions
-		meshVertices[i + 0].pos = rawVerts[mesh->v_elements[i + 0]];
-		meshVertices[i + 1].pos = rawVerts[mesh->v_elements[i + 1]];
-		meshVertices[i + 2].pos = rawVerts[mesh->v_elements[i + 2]];
-		// Calculate normals
-		vec3 normal = normalize(cross(meshVertices[i + 1].pos - meshVertices[i + 0].pos,
-									  meshVertices[i + 2].pos - meshVertices[i + 0].pos));
-		meshVertices[i + 0].norm = normal;
-		meshVertices[i + 1].norm = normal;
-		meshVertices[i + 2].norm = normal;
-	}
-	// std::cout << "Mesh Vertices: " << std::endl;
-	// for (int i = 0; i < mesh->v_elements.size(); i += 1) {
-	// 	// Store positions
-	// 	std::cout << "Positions: " << std::endl;
-	// 	std::cout << meshVertices[i].pos.x << ", " << meshVertices[i].pos.y << ", " << meshVertices[i].pos.z << std::endl;
-	// 	std::cout << "Normal: " << std::endl;
-	// 	std::cout << meshVertices[i].norm.x << ", " << meshVertices[i].norm.y << ", " << meshVertices[i].norm.z << std::endl;
-
-	// }
-	return meshVertices;
+	selectCamera(savedMode);
 }
 
-void GLCRender()
+void addInstances(int count)
 {
-	vector<Vtx> meshVertices = get_coordinates();
-	// std::cout << "Mesh Vertices: " << std::endl;
-	// for (int i = 0; i < mesh->v_elements.size(); i += 1) {
-	// 	// Store positions
-	// 	std::cout << "Positions: " << std::endl;
-	// 	std::cout << meshVertices[i].pos.x << ", " << meshVertices[i].pos.y << ", " << meshVertices[i].pos.z << std::endl;
-	// 	std::cout << "Normal: " << std::endl;
-	// 	std::cout << meshVertices[i].norm.x << ", " << meshVertices[i].norm.y << ", " << meshVertices[i].norm.z << std::endl;
-
-	// }
+	// Scatter scaled and rotated copies of the mesh around the original. Each copy shares
+	// the mesh's BVH and only refits the top level.
+	vec3 size = meshBB.second - meshBB.first;
+	vec3 center = (meshBB.first + meshBB.second) * 0.5f;
+	float spread = 4.0f * glm::max(size.x, size.y);
+	static unsigned int seed = 1;
+	auto random = [&]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / 16777216.0f; };
+
+	auto start = chrono::high_resolution_clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		vec3 offset((random() - 0.5f) * spread, (random() - 0.5f) * spread, random() * size.z);
+		mat4 xform = translate(mat4(1.0f), center + offset);
+		xform = rotate(xform, random() * 360.0f, vec3(0.0f, 0.0f, 1.0f));
+		xform = scale(xform, vec3(0.2f + 0.3f * random()));
+		xform = translate(xform, -center);
+		scene.addInstance(bvh, xform);
+	}
+	double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+	meshVersion++;
+	std::cout << "Instances: " << scene.getInstances().size() << " (added " << count << " in " << ms << " ms)" << std::endl;
+}
 
-	// std::cout << "width, height: " << width << ", " << height << std::endl;
+RenderKey currentRenderKey()
+{
+	RenderKey key;
+	key.camCoords = camCoords;
+	key.stVertices = stVertices;
+	key.uvVertices = uvVertices;
+	key.cameraMode = cameraMode;
+	key.width = target.getWidth();
+	key.height = target.getHeight();
+	key.meshVersion = meshVersion;
+	key.slices = slicePushbroom;
+	key.raster = rasterProjective;
+	return key;
+}
 
-	for (int i = 0; i < width; i++)
+void GLCRender()
+{
+	// Redraw the cached texture unless an input of the image changed,
+	// or a progressive image still has passes left
+	RenderKey key = currentRenderKey();
+	bool changed = !renderedValid || key != renderedKey;
+	if (!changed && (!progressive || progress.converged()))
+		return;
+	if (key.meshVersion != renderedKey.meshVersion)
+		reprojector.reset(); // Its hits belong to the old instances
+	renderedKey = key;
+	renderedValid = true;
+
+	int pixelCount = target.getWidth() * target.getHeight();
+	if (progressive)
 	{
-		for (int j = 0; j < height; j++)
+		if (changed)
 		{
-			// iterate through each pixel and compute their coordinates
-			vec3 curPixelPos = computeCurPixelPos(vec2(j, i));
-			if (debug == true)
-			{
-				std::cout << curPixelPos.x << ", " << curPixelPos.y << ", " << curPixelPos.z << std::endl;
-			}
-
-			// generate Ray with curPixelPos
-			Ray genRay = generateRay(curPixelPos);
-
-			// std::cout << "Current Pixel Pos: " << curPixelPos.x << ", " << curPixelPos.y << ", " << curPixelPos.z << std::endl;
-			// genRay.printRay();
-			// see if ray intersects with triangle
-			float t = ray_triangle_intersect(genRay, meshVertices);
-			if (t == 0)
+			// A state seen before starts out converged from the cached frame
+			progress.restart();
+			const u8vec4 *cached = frameCache.find(key);
+			if (cached)
 			{
-				// std::cout <<"1 ";
-				textureData[i * height + j] = u8vec3(255, 0, 0);
-			}
-			else if(t == 3){
-				textureData[i * height + j] = u8vec3(0, 255, 0);
-	
+				copy(cached, cached + pixelCount, target.pixels());
+				progress.finish();
 			}
+		}
+		// Passes build on each other, so they accumulate in the target's CPU copy and
+		// the current state is copied into the pixel buffer
+		if (!progress.converged())
+		{
+			GeneralLinearCamera objCamera = camera.transformed(objectFromCamera());
+			if (progress.refine(scene, objCamera, target.getHeight(), target.getWidth(), shadeHit, target.pixels(), frameBudgetMs))
+				frameCache.insert(key, target.pixels());
 			else
-			{
-				// std::cout << "0 ";
-				textureData[i * height + j] = bgColor;
-			}
+				glutPostRedisplay(); // Keep refining on the next frame
+		}
+		copy(target.pixels(), target.pixels() + pixelCount, target.map());
+		target.upload();
+	}
+	else
+	{
+		// Revisited states are re-uploaded from the cache without tracing, unless the work
+		// of tracing them is being counted
+		const u8vec4 *cached = showStats ? NULL : frameCache.find(key);
+		if (cached)
+		{
+			copy(cached, cached + pixelCount, target.map());
+			target.upload();
+			return;
+		}
+
+		// Ray cast into the CPU copy, which is kept in the cache and copied into the mapped
+		// buffer while the previous frame may still be uploading
+		if (showStats)
+		{
+			frameStats.reset();
+			threadRayCounters().reset();
+			pixelCost.assign(pixelCount, 0.0f);
+		}
+		auto start = chrono::high_resolution_clock::now();
+		bool exact = traceImage(packetSize, target.pixels());
+		double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+		auto uploadStart = chrono::high_resolution_clock::now();
+		copy(target.pixels(), target.pixels() + pixelCount, target.map());
+		if (showStats)
+			overlayCostHeatmap(pixelCost, target.map());
+		target.upload();
+		if (showStats)
+		{
+			frameStats.uploadMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - uploadStart).count();
+			collectThreadRayCounters(frameStats);
 		}
-		// std::cout << std::endl;
+		if (exact && !deforming)
+			frameCache.insert(key, target.pixels()); // An animated mesh never comes back to the same version
+
+		// Resample at the new scale on the next frame; the controller settles within a few
+		if (autoScale)
+			setRenderScale(scaleControl.update(target.getScale(), ms));
 	}
+}
 
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, textureData.data());
-	glBindTexture(GL_TEXTURE_2D, 0);
+void setRenderScale(float scale)
+{
+	if (!target.setScale(scale))
+		return;
+	updateCamera();
+	std::cout << "Render scale: " << target.getScale() << " (" << target.getWidth() << "x" << target.getHeight() << ")" << std::endl;
+	glutPostRedisplay();
 }
 
 
@@ -613,8 +700,8 @@ void display()
 		case VIEWMODE_OBJ:
 		{
 			// Load model on demand
-			if (!mesh)
-				mesh = new Mesh("models/rectangle.obj");
+			if (!mesh || !bvh)
+				initObj();
 
 			// // Scale and center mesh using bounding box
 			// pair<vec3, vec3> meshBB = mesh->boundingBox();
@@ -636,7 +723,7 @@ void display()
 		// Draw the textured quad
 		glBindVertexArray(vao);
 		glActiveTexture(GL_TEXTURE0 + 0);
-		glBindTexture(GL_TEXTURE_2D, texture);
+		glBindTexture(GL_TEXTURE_2D, target.getTexture());
 		glDrawElements(GL_TRIANGLES, vcount, GL_UNSIGNED_BYTE, NULL);
 		glBindTexture(GL_TEXTURE_2D, 0);
 		glBindVertexArray(0);
@@ -646,8 +733,6 @@ void display()
 
 		// Display the back buffer
 		glutSwapBuffers();
-
-		glutPostRedisplay();
 	}
 	catch (const exception &e)
 	{
@@ -661,27 +746,135 @@ void reshape(GLint width, GLint height)
 	::width = width;
 	::height = height;
 	glViewport(0, 0, width, height);
+	target.resize(width, height);
+	updateCamera();
 }
 
 void keyPressed(unsigned char key, int x, int y)
 {
+	for (int i = 0; i < glcPresets.size(); i++)
+	{
+		if (glcPresets[i].key == key)
+		{
+			selectCamera(i);
+			glutPostRedisplay();
+			return;
+		}
+	}
+
 	switch(key)
 	{
-	case 'p':
-		cameraMode = PERSPECTIVE;
-		stVertices = perspectiveSTVertices;
+	case 'k':
+		// Cycle single rays, 2x2 and 4x4 packets
+		packetSize = packetSize >= 4 ? 1 : packetSize * 2;
+		std::cout << "Packet size: " << packetSize << "x" << packetSize << std::endl;
 		glutPostRedisplay();
 		break;
-	case 'o':
-		cameraMode = ORTHO;
-		stVertices = orthographicSTVertices;
+	case 'j':
+		// Toggle plane-slice rendering of pushbroom cameras
+		slicePushbroom = !slicePushbroom;
+		std::cout << "Pushbroom slices: " << (slicePushbroom ? "on" : "off") << std::endl;
 		glutPostRedisplay();
 		break;
-	case 'b':
-		cameraMode = PUSHBROOM;
-		stVertices = pushbroomSTVertices;
+	case 'r':
+		// Toggle rasterized visibility for projective cameras
+		rasterProjective = !rasterProjective;
+		std::cout << "Rasterize projective cameras: " << (rasterProjective ? "on" : "off") << std::endl;
 		glutPostRedisplay();
 		break;
+	case 'e':
+		// Toggle reprojection of the previous frame while dragging
+		reprojectDrags = !reprojectDrags;
+		std::cout << "Reproject while dragging: " << (reprojectDrags ? "on" : "off") << std::endl;
+		break;
+	case 'm':
+		// Toggle adaptive anti-aliasing; cached frames were rendered in the other mode
+		antialias = !antialias;
+		frameCache.clear();
+		renderedValid = false;
+		std::cout << "Anti-aliasing: " << (antialias ? "on" : "off") << " (" << sampler.getSamples()
+				  << " rays per edge pixel, budget " << sampler.getBudget() << " rays per pixel)" << std::endl;
+		glutPostRedisplay();
+		break;
+	case 'h':
+		// Toggle ray-casting counters and the per-pixel cost heatmap
+		showStats = !showStats;
+		renderedValid = false;
+		std::cout << "Ray-casting statistics: " << (showStats ? "on" : "off")
+				  << (showStats && !RAY_STATS_BUILD ? " (node and triangle counts need a GLC_STATS build)" : "") << std::endl;
+		glutPostRedisplay();
+		break;
+	case 'H':
+	{
+		// Dump the counters of the last counted frame
+		ofstream file("ray_stats.json");
+		file << frameStats.toJSON() << std::endl;
+		std::cout << "Ray-casting statistics written to ray_stats.json: " << frameStats.toJSON() << std::endl;
+		break;
+	}
+	case 'c':
+		// Frame cache statistics
+		std::cout << "Frame cache: " << frameCache.getFrameCount() << " frames, "
+				  << frameCache.getBytes() / (1 << 20) << " of " << frameCache.getCapacity() / (1 << 20) << " MB, "
+				  << frameCache.getHits() << " hits, " << frameCache.getMisses() << " misses" << std::endl;
+		break;
+	case 'C':
+		frameCache.clear();
+		std::cout << "Frame cache cleared" << std::endl;
+		break;
+	case 'g':
+		// Toggle progressive refinement, re-trace the image in the new mode
+		progressive = !progressive;
+		renderedValid = false;
+		std::cout << "Progressive rendering: " << (progressive ? "on" : "off") << std::endl;
+		glutPostRedisplay();
+		break;
+	case '[':
+	case ']':
+		// Lower or raise the render resolution by hand, which turns automatic scaling off
+		autoScale = false;
+		setRenderScale(target.getScale() + (key == '[' ? -0.125f : 0.125f));
+		break;
+	case 'a':
+		// Toggle automatic render scale
+		autoScale = !autoScale;
+		std::cout << "Automatic render scale: " << (autoScale ? "on" : "off")
+				  << " (target " << scaleControl.getTarget() << " ms)" << std::endl;
+		if (!autoScale)
+			setRenderScale(1.0f);
+		break;
+	case 'i':
+		// Add copies of the mesh to the scene
+		addInstances(10);
+		glutPostRedisplay();
+		break;
+	case 'I':
+		// Back to the single mesh
+		scene.clear();
+		scene.addInstance(bvh, mat4(1.0f));
+		meshVersion++;
+		std::cout << "Instances: 1" << std::endl;
+		glutPostRedisplay();
+		break;
+	case 'w':
+		// Toggle the wave animation of the mesh
+		setDeforming(!deforming);
+		glutPostRedisplay();
+		break;
+	case 'v':
+		// Rebuild the mesh BVH with the other builder, the scene goes back to a single instance
+		setDeforming(false);
+		bvhBuilder = bvhBuilder == BUILD_SAH ? BUILD_LBVH : BUILD_SAH;
+		scene.clear();
+		delete bvh;
+		bvh = NULL;
+		initObj();
+		glutPostRedisplay();
+		break;
+	case 't':
+		benchmarkTraversal();
+		benchmarkSpecialization();
+		break;
 	}
 }
 
@@ -708,6 +901,19 @@ void mouseBtn(int button, int state, int x, int y)
 	{
 		// Deactivate rotation
 		camRot = false;
+		if (antialias)
+			renderedValid = false; // Anti-alias the frame the camera came to rest at
+		if (reprojectDrags && reprojector.getFrames() > 0)
+		{
+			// Replace the last reprojected frame by an exact one
+			std::cout << "Reprojection: " << reprojector.getFrames() << " frames (" << reprojector.getFullFrames()
+					  << " traced in full), " << 100.0 * reprojector.getTracedPixels() / reprojector.getPixels()
+					  << "% of pixels traced" << std::endl;
+			reprojector.resetStats();
+			reprojector.reset();
+			renderedValid = false;
+			glutPostRedisplay();
+		}
 	}
 	if (button == 3)
 	{
@@ -745,27 +951,63 @@ void mouseMove(int x, int y)
 
 void idle()
 {
-	// // add velocity to the bounding box coordinates of the object
-	// meshBB.first += velocity;
-	// meshBB.second += velocity;
+	// Advance the wave and refit the BVH for it, instead of rebuilding it every frame
+	if (!deforming)
+		return;
+	float time = chrono::duration<float>(chrono::steady_clock::now() - deformStart).count();
+	waveVertices(restVertices, meshBB.first, meshBB.second, time, mesh->raw_vertices);
+	RefitStats refit = bvh->refit(mesh->raw_vertices, mesh->v_elements);
+	scene.refitInstances(bvh);
+	meshVersion++;
+	deformFrames++;
+	refitMs += refit.ms;
+	if (refit.action != REFIT_BOUNDS)
+	{
+		deformRebuilds++;
+		std::cout << "Refit: " << refit << std::endl;
+	}
+	glutPostRedisplay();
+}
+
+void setDeforming(bool on)
+{
+	if (on == deforming || !mesh || !bvh)
+		return;
+	deforming = on;
+	if (on)
+	{
+		restVertices = mesh->raw_vertices;
+		deformStart = chrono::steady_clock::now();
+		deformFrames = 0;
+		deformRebuilds = 0;
+		refitMs = 0.0;
+		glutIdleFunc(idle);
+		std::cout << "Wave animation: on" << std::endl;
+		return;
+	}
+
+	// Back to the mesh as loaded
+	glutIdleFunc(NULL);
+	mesh->raw_vertices = restVertices;
+	restVertices.clear();
+	RefitStats refit = bvh->refit(mesh->raw_vertices, mesh->v_elements);
+	scene.refitInstances(bvh);
+	meshVersion++;
+	std::cout << "Wave animation: off (" << deformFrames << " frames, " << refitMs / glm::max(deformFrames, 1)
+			  << " ms per refit, " << deformRebuilds << " rebuilds); rest pose " << refit << std::endl;
 }
 
 void menu(int cmd)
 {
-	switch (cmd)
+	if (cmd >= 0 && cmd < glcPresets.size())
 	{
-	case PERSPECTIVE:
-		stVertices = perspectiveSTVertices;
-		glutPostRedisplay(); // Tell GLUT to redraw the screen
-		break;
-	case ORTHO:
-		stVertices = orthographicSTVertices;
+		selectCamera(cmd);
 		glutPostRedisplay(); // Tell GLUT to redraw the screen
-		break;
-	case PUSHBROOM:
-		stVertices = pushbroomSTVertices;
-		glutPostRedisplay(); // Tell GLUT to redraw the screen
-		break;
+		return;
+	}
+
+	switch (cmd)
+	{
 	case MENU_EXIT:
 		glutLeaveMainLoop();
 		break;
@@ -792,6 +1034,12 @@ void cleanup()
 		vbuf = 0;
 	}
 	vcount = 0;
+	scene.clear();
+	if (bvh)
+	{
+		delete bvh;
+		bvh = NULL;
+	}
 	if (mesh)
 	{
 		delete mesh;
@@ -803,9 +1051,5 @@ void cleanup()
 		glDeleteBuffers(1, &ibuf);
 		ibuf = 0;
 	}
-	if (texture)
-	{
-		glDeleteTextures(1, &texture);
-		texture = 0;
-	}
+	target.release();
 }
@@ -5,16 +5,8 @@
 using namespace std;
 using namespace glm;
 
-// Helper functions
-int indexOfNumberLetter(string& str, int offset);
-int lastIndexOfNumberLetter(string& str);
-vector<string> split(const string &s, char delim);
-
 // Constructor - load mesh from file
 Mesh::Mesh(string filename) {
-	minBB = vec3(numeric_limits<float>::max());
-	maxBB = vec3(numeric_limits<float>::lowest());
-
 	vao = 0;
 	vbuf = 0;
 	vcount = 0;
@@ -33,65 +25,8 @@ void Mesh::load(string filename) {
 	// Release resources
 	release();
 
-	ifstream file(filename);
-	if (!file.is_open()) {
-		stringstream ss;
-		ss << "Mesh::load() - Could not open file " << filename;
-		throw runtime_error(ss.str());
-	}
-
-	// // Store vertex and normal data while reading
-	// vector<vec3> raw_vertices;
-	// vector<vec3> raw_normals;
-	// vector<unsigned int> v_elements;
-	// vector<unsigned int> n_elements;
-
-	string line;
-	while (getline(file, line)) {
-		if (line.substr(0, 2) == "v ") {
-			// Read position data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			vector<string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			vec3 vert(stof(values[0]), stof(values[1]), stof(values[2]));
-			raw_vertices.push_back(vert);
-
-			// Update bounding box
-			minBB = glm::min(minBB, vert);
-			maxBB = glm::max(maxBB, vert);
-		} else if (line.substr(0, 3) == "vn ") {
-			// Read normal data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			vector<string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			raw_normals.push_back(vec3(stof(values[0]), stof(values[1]), stof(values[2])));
-
-		} else if (line.substr(0, 2) == "f ") {
-			// Read face data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			vector<string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			for (int i = 0; i < values.size() - 2; i++) {
-				// Split up vertex indices
-				vector<string> v1 = split(values[0], '/');		// Triangle fan for ngons
-				vector<string> v2 = split(values[i+1], '/');
-				vector<string> v3 = split(values[i+2], '/');
-
-				// Store position indices
-				v_elements.push_back(stoul(v1[0]) - 1);
-				v_elements.push_back(stoul(v2[0]) - 1);
-				v_elements.push_back(stoul(v3[0]) - 1);
-
-				// Check for normals
-				if (v1.size() >= 3 && v1[2].length() > 0) {
-					n_elements.push_back(stoul(v1[2]) - 1);
-					n_elements.push_back(stoul(v2[2]) - 1);
-					n_elements.push_back(stoul(v3[2]) - 1);
-				}
-			}
-		}
-	}
-	file.close();
+	// Read geometry
+	MeshData::load(filename);
 
 	// Create vertex array
 	vector<Vtx> vertices(v_elements.size());
@@ -137,34 +72,7 @@ void Mesh::load(string filename) {
 }
 // Release resources
 void Mesh::release() {
-	minBB = vec3(numeric_limits<float>::max());
-	maxBB = vec3(numeric_limits<float>::lowest());
-
 	if (vao) { glDeleteVertexArrays(1, &vao); vao = 0; }
 	if (vbuf) { glDeleteBuffers(1, &vbuf); vbuf = 0; }
 	vcount = 0;
 }
-
-int indexOfNumberLetter(string& str, int offset) {
-	for (int i = offset; i < str.length(); ++i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return str.length();
-}
-int lastIndexOfNumberLetter(string& str) {
-	for (int i = str.length() - 1; i >= 0; --i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return 0;
-}
-vector<string> split(const string &s, char delim) {
-	vector<string> elems;
-
-	stringstream ss(s);
-    string item;
-    while (getline(ss, item, delim)) {
-        elems.push_back(item);
-    }
-
-    return elems;
-}
\ No newline at end of file
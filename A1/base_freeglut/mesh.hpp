@@ -6,16 +6,14 @@
 #include <utility>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
+#include "meshdata.hpp"
 
-class Mesh {
+// OBJ geometry uploaded to OpenGL for drawing
+class Mesh : public MeshData {
 public:
 	Mesh(std::string filename);
 	~Mesh() { release(); }
 
-	// Return the bounding box of this object
-	std::pair<glm::vec3, glm::vec3> boundingBox() const
-	{ return std::make_pair(minBB, maxBB); }
-
 	void load(std::string filename);
 	void draw();
 
@@ -25,20 +23,9 @@ public:
 		glm::vec3 norm;		// Normal
 	};
 
-	// Store vertex and normal data while reading
-	std::vector<glm::vec3> raw_vertices;
-	std::vector<glm::vec3> raw_normals;
-	std::vector<unsigned int> v_elements;
-	std::vector<unsigned int> n_elements;
-
-
 protected:
 	void release();		// Release OpenGL resources
 
-	// Bounding box
-	glm::vec3 minBB;
-	glm::vec3 maxBB;
-
 	// OpenGL resources
 	GLuint vao;		// Vertex array object
 	GLuint vbuf;	// Vertex buffer
@@ -0,0 +1,134 @@
+#include "meshdata.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <limits>
+#include <cmath>
+#include <stdexcept>
+using namespace std;
+using namespace glm;
+
+// Helper functions
+int indexOfNumberLetter(string& str, int offset);
+int lastIndexOfNumberLetter(string& str);
+vector<string> split(const string &s, char delim);
+
+MeshData::MeshData() {
+	clear();
+}
+
+// Constructor - load mesh from file
+MeshData::MeshData(string filename) {
+	load(filename);
+}
+
+// Load a wavefront OBJ file
+void MeshData::load(string filename) {
+	clear();
+
+	ifstream file(filename);
+	if (!file.is_open()) {
+		stringstream ss;
+		ss << "MeshData::load() - Could not open file " << filename;
+		throw runtime_error(ss.str());
+	}
+
+	string line;
+	while (getline(file, line)) {
+		if (line.substr(0, 2) == "v ") {
+			// Read position data
+			int index1 = indexOfNumberLetter(line, 2);
+			int index2 = lastIndexOfNumberLetter(line);
+			vector<string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
+			vec3 vert(stof(values[0]), stof(values[1]), stof(values[2]));
+			raw_vertices.push_back(vert);
+
+			// Update bounding box
+			minBB = glm::min(minBB, vert);
+			maxBB = glm::max(maxBB, vert);
+		} else if (line.substr(0, 3) == "vn ") {
+			// Read normal data
+			int index1 = indexOfNumberLetter(line, 2);
+			int index2 = lastIndexOfNumberLetter(line);
+			vector<string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
+			raw_normals.push_back(vec3(stof(values[0]), stof(values[1]), stof(values[2])));
+
+		} else if (line.substr(0, 2) == "f ") {
+			// Read face data
+			int index1 = indexOfNumberLetter(line, 2);
+			int index2 = lastIndexOfNumberLetter(line);
+			vector<string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
+			for (int i = 0; i < values.size() - 2; i++) {
+				// Split up vertex indices
+				vector<string> v1 = split(values[0], '/');		// Triangle fan for ngons
+				vector<string> v2 = split(values[i+1], '/');
+				vector<string> v3 = split(values[i+2], '/');
+
+				// Store position indices
+				v_elements.push_back(stoul(v1[0]) - 1);
+				v_elements.push_back(stoul(v2[0]) - 1);
+				v_elements.push_back(stoul(v3[0]) - 1);
+
+				// Check for normals
+				if (v1.size() >= 3 && v1[2].length() > 0) {
+					n_elements.push_back(stoul(v1[2]) - 1);
+					n_elements.push_back(stoul(v2[2]) - 1);
+					n_elements.push_back(stoul(v3[2]) - 1);
+				}
+			}
+		}
+	}
+	file.close();
+}
+
+// Forget all geometry
+void MeshData::clear() {
+	raw_vertices.clear();
+	raw_normals.clear();
+	v_elements.clear();
+	n_elements.clear();
+	minBB = vec3(numeric_limits<float>::max());
+	maxBB = vec3(numeric_limits<float>::lowest());
+}
+
+void waveVertices(const vector<vec3>& rest, const vec3& bbMin, const vec3& bbMax, float time, vector<vec3>& vertices) {
+	vec3 size = bbMax - bbMin;
+	int along = size.y > size[0] ? 1 : 0;
+	if (size.z > size[along]) along = 2;
+	int across = (along + 1) % 3;
+	if (size[(along + 2) % 3] < size[across]) across = (along + 2) % 3;
+
+	// One and a half waves over the mesh, half a period per second, as high as a tenth of its length
+	const float twoPi = 6.2831853f;
+	float amplitude = 0.1f * size[along];
+	float waveNumber = 1.5f * twoPi / glm::max(size[along], numeric_limits<float>::min());
+	vertices.resize(rest.size());
+	for (size_t i = 0; i < rest.size(); i++) {
+		vertices[i] = rest[i];
+		vertices[i][across] += amplitude * sin(waveNumber * (rest[i][along] - bbMin[along]) - 0.5f * twoPi * time);
+	}
+}
+
+int indexOfNumberLetter(string& str, int offset) {
+	for (int i = offset; i < str.length(); ++i) {
+		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
+	}
+	return str.length();
+}
+int lastIndexOfNumberLetter(string& str) {
+	for (int i = str.length() - 1; i >= 0; --i) {
+		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
+	}
+	return 0;
+}
+vector<string> split(const string &s, char delim) {
+	vector<string> elems;
+
+	stringstream ss(s);
+    string item;
+    while (getline(ss, item, delim)) {
+        elems.push_back(item);
+    }
+
+    return elems;
+}
\ No newline at end of file
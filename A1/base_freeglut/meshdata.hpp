@@ -0,0 +1,40 @@
+#ifndef MESHDATA_HPP
+#define MESHDATA_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <glm/glm.hpp>
+
+// Geometry of a wavefront OBJ file, kept on the CPU (no OpenGL required)
+class MeshData {
+public:
+	MeshData();
+	MeshData(std::string filename);
+
+	// Return the bounding box of this object
+	std::pair<glm::vec3, glm::vec3> boundingBox() const
+	{ return std::make_pair(minBB, maxBB); }
+
+	void load(std::string filename);
+
+	// Store vertex and normal data while reading
+	std::vector<glm::vec3> raw_vertices;
+	std::vector<glm::vec3> raw_normals;
+	std::vector<unsigned int> v_elements;
+	std::vector<unsigned int> n_elements;
+
+protected:
+	void clear();
+
+	// Bounding box
+	glm::vec3 minBB;
+	glm::vec3 maxBB;
+};
+
+// Displace the rest positions by a wave travelling along the longest side of the box bbMin..bbMax,
+// across its thinnest one, time seconds in; animates a mesh for refitting its BVH
+void waveVertices(const std::vector<glm::vec3>& rest, const glm::vec3& bbMin, const glm::vec3& bbMax,
+	float time, std::vector<glm::vec3>& vertices);
+
+#endif
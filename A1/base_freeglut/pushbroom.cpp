@@ -0,0 +1,132 @@
+#include "pushbroom.hpp"
+#include <cmath>
+#include <algorithm>
+using namespace std;
+using namespace glm;
+
+// Helper functions
+// Whether b is a multiple of a, which makes rays o + k * a, d + k * b a planar pencil
+static bool parallelSteps(const vec3& a, const vec3& b) {
+	return length(cross(a, b)) <= 1e-4f * length(a) * length(b);
+}
+
+bool SliceRenderer::columnPencils(const GeneralLinearCamera& cam) {
+	return parallelSteps(cam.oy, cam.dy);
+}
+
+bool SliceRenderer::supports(const GeneralLinearCamera& cam) {
+	return columnPencils(cam) || parallelSteps(cam.ox, cam.dx);
+}
+
+bool SliceRenderer::setupSlice(const GeneralLinearCamera& cam, bool byColumn, int index, int length, Slice& slice) {
+	float i = (float)index;
+	slice.origin = byColumn ? cam.o0 + i * cam.ox : cam.o0 + i * cam.oy;
+	slice.step = byColumn ? cam.oy : cam.ox;
+	slice.dir = byColumn ? cam.d0 + i * cam.dx : cam.d0 + i * cam.dy;
+	vec3 dirStep = byColumn ? cam.dy : cam.dx;
+	float stepLen2 = dot(slice.step, slice.step);
+	slice.kappa = dot(dirStep, slice.step) / stepLen2;
+
+	// Rays running along the origins' line do not span a plane
+	vec3 normal = cross(slice.step, slice.dir);
+	float sd = dot(slice.step, slice.dir), dd = dot(slice.dir, slice.dir);
+	float det = stepLen2 * dd - sd * sd;
+	if (det <= 1e-8f * stepLen2 * dd) return false;
+
+	normal = normalize(normal);
+	slice.toAlpha = (dd * slice.step - sd * slice.dir) / det;
+	slice.toBeta = (stepLen2 * slice.dir - sd * slice.step) / det;
+
+	// The covered region lies in front of the origins (beta >= 0) and between the rays half a
+	// pixel outside the first and last one. Rays crossing at beta = -1 / kappa > 0 swap sides
+	// there, so the near triangle and the far wedge are queried separately.
+	PlaneQuery query;
+	query.plane = vec4(normal, -dot(normal, slice.origin));
+	query.bounds[0] = vec4(slice.toBeta, -dot(slice.toBeta, slice.origin));
+	for (int side = 0; side < 2; side++) {
+		float k = side == 0 ? -0.5f : length - 0.5f;
+		vec3 rayOrigin = slice.origin + k * slice.step;
+		vec3 inward = cross(normal, slice.dir + k * slice.kappa * slice.step);
+		if ((dot(inward, slice.step) < 0.0f) == (side == 0)) inward = -inward;
+		query.bounds[1 + side] = vec4(inward, -dot(inward, rayOrigin));
+	}
+	query.boundCount = 3;
+
+	float cross = slice.kappa < 0.0f ? -1.0f / slice.kappa : 0.0f;
+	if (cross <= 0.0f) {
+		slice.queries[0] = query;
+		slice.queryCount = 1;
+		return true;
+	}
+	slice.queries[0] = query;
+	slice.queries[0].bounds[3] = vec4(-slice.toBeta, dot(slice.toBeta, slice.origin) + cross);
+	slice.queries[0].boundCount = 4;
+	slice.queries[1] = query;
+	slice.queries[1].bounds[0] = vec4(slice.toBeta, -dot(slice.toBeta, slice.origin) - cross);
+	slice.queries[1].bounds[1] = -query.bounds[1];
+	slice.queries[1].bounds[2] = -query.bounds[2];
+	slice.queryCount = 2;
+	return true;
+}
+
+// A point (alpha, beta) of the plane lies on ray k at t = beta when alpha = k * (1 + kappa * beta).
+// Along a segment k = alpha / (1 + kappa * beta) is a ratio of linear functions, so the rays
+// crossing it form the interval between the end values, or its complement when the segment
+// passes the common point's line (1 + kappa * beta changes sign) and k wraps through infinity.
+void SliceRenderer::resolve(const Slice& slice, int length) {
+	depths.assign(length, numeric_limits<float>::max());
+	hits.assign(length, Hit());
+	float last = (float)(length - 1);
+
+	for (size_t i = 0; i < segments.size(); i++) {
+		const PlaneSegment& seg = segments[i];
+		vec2 e0(dot(seg.p0 - slice.origin, slice.toAlpha), dot(seg.p0 - slice.origin, slice.toBeta));
+		vec2 e1(dot(seg.p1 - slice.origin, slice.toAlpha), dot(seg.p1 - slice.origin, slice.toBeta));
+
+		// Only the part in front of the origins, t > 0, is seen
+		if (e0.y <= 0.0f && e1.y <= 0.0f) continue;
+		if (e0.y < 0.0f) e0 = mix(e0, e1, -e0.y / (e1.y - e0.y));
+		if (e1.y < 0.0f) e1 = mix(e1, e0, -e1.y / (e0.y - e1.y));
+
+		float b0 = 1.0f + slice.kappa * e0.y, b1 = 1.0f + slice.kappa * e1.y;
+		float k0 = e0.x / b0, k1 = e1.x / b1;
+		if (std::isnan(k0) || std::isnan(k1)) continue;
+		float lo = glm::min(k0, k1), hi = glm::max(k0, k1);
+
+		// Ranges of ray indices to test, clamped to the slice
+		float ranges[2][2];
+		int rangeCount = 0;
+		if (b0 * b1 >= 0.0f) {
+			ranges[rangeCount][0] = lo; ranges[rangeCount++][1] = hi;
+		} else {
+			ranges[rangeCount][0] = 0.0f; ranges[rangeCount++][1] = lo;
+			ranges[rangeCount][0] = hi; ranges[rangeCount++][1] = last;
+		}
+
+		vec2 delta = e1 - e0;
+		for (int r = 0; r < rangeCount; r++) {
+			float first = std::ceil(glm::max(ranges[r][0], 0.0f));
+			float end = std::floor(glm::min(ranges[r][1], last));
+			if (first > end) continue;
+			for (int k = (int)first; k <= (int)end; k++) {
+				// Solve alpha - k * kappa * beta = k along the segment
+				float kk = (float)k * slice.kappa;
+				float denom = delta.x - kk * delta.y;
+				if (denom == 0.0f) continue;
+				float s = ((float)k - e0.x + kk * e0.y) / denom;
+				if (s < 0.0f || s > 1.0f) continue;
+				float t = e0.y + s * delta.y;
+				if (t <= 0.0f || t >= depths[k]) continue;
+				depths[k] = t;
+				hits[k].tri = seg.tri;
+				hits[k].instance = seg.instance;
+			}
+		}
+	}
+
+	// Report distances along the normalized direction, as traversal does
+	for (int k = 0; k < length; k++) {
+		if (hits[k].tri != -1)
+			hits[k].t = depths[k] * glm::length(slice.dir + (float)k * slice.kappa * slice.step);
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef PUSHBROOM_HPP
+#define PUSHBROOM_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "bvh.hpp"
+#include "glc.hpp"
+
+// Renders pushbroom cameras one plane slice at a time. The rays of a pixel column lie in one
+// plane and pass through a common point on the slit (rows: a point at infinity), so the
+// scene is cut by that plane once and every ray of the column is resolved against the
+// resulting 2D segments. A column then costs O(rows + segments) instead of one BVH
+// traversal per pixel.
+class SliceRenderer {
+public:
+	// Whether the camera's columns, or else its rows, are planar pencils of rays
+	static bool supports(const GeneralLinearCamera& cam);
+
+	// Ray cast a rows x cols image into pixels (row-major) through accel, which is a BVH or
+	// a TLAS. Slices whose rays are degenerate fall back to tracing each ray.
+	template <class Shade, class Pixel, class Accel>
+	void render(const Accel& accel, const GeneralLinearCamera& cam, int rows, int cols, Shade shade, Pixel* pixels) {
+		bool byColumn = columnPencils(cam);
+		int sliceCount = byColumn ? cols : rows;
+		int length = byColumn ? rows : cols;
+		int stride = byColumn ? cols : 1;
+
+		for (int s = 0; s < sliceCount; s++) {
+			Pixel* out = pixels + (byColumn ? s : s * cols);
+			Slice slice;
+			if (!setupSlice(cam, byColumn, s, length, slice)) {
+				for (int k = 0; k < length; k++) {
+					Hit hit;
+					accel.intersect(byColumn ? cam.ray((float)s, (float)k) : cam.ray((float)k, (float)s), hit);
+					out[k * stride] = shade(hit);
+				}
+				continue;
+			}
+
+			segments.clear();
+			for (int q = 0; q < slice.queryCount; q++)
+				accel.intersectPlane(slice.queries[q], segments);
+			resolve(slice, length);
+			for (int k = 0; k < length; k++)
+				out[k * stride] = shade(hits[k]);
+		}
+	}
+
+protected:
+	// Rays k = 0 .. length - 1 of a slice start at origin + k * step and head along
+	// dir + k * kappa * step, so they all cross at t = -1 / kappa (never if kappa = 0)
+	struct Slice {
+		glm::vec3 origin, step, dir;
+		float kappa;
+		glm::vec3 toAlpha, toBeta;	// Dual basis: p - origin = alpha * step + beta * dir
+		PlaneQuery queries[2];		// Slice plane cut to the region its rays cover, two parts
+		int queryCount;				// when the rays cross in front of the origins
+	};
+
+	static bool columnPencils(const GeneralLinearCamera& cam);
+	static bool setupSlice(const GeneralLinearCamera& cam, bool byColumn, int index, int length, Slice& slice);
+	void resolve(const Slice& slice, int length);
+
+	std::vector<PlaneSegment> segments;	// Cut of the current slice
+	std::vector<float> depths;			// Closest hit per ray, in units of the unnormalized direction
+	std::vector<Hit> hits;
+};
+
+#endif
@@ -0,0 +1,292 @@
+#include "raster.hpp"
+#include <cmath>
+#include <stdexcept>
+using namespace std;
+using namespace glm;
+
+// Samples closer than this many pixels to a triangle edge are ray cast
+const float RASTER_EDGE_BAND = 1.0f / 64.0f;
+// Interpolated depth keys closer than this, relative to the largest key involved, are ray cast
+const float RASTER_DEPTH_TIE = 1.0f / 4096.0f;
+
+// Helper functions
+// Whether a, b and c span space, relative to their lengths
+static bool spansSpace(const vec3& a, const vec3& b, const vec3& c) {
+	return fabs(dot(a, cross(b, c))) > 1e-6f * length(a) * length(b) * length(c);
+}
+
+// Plane through point with the given normal, facing inside
+static vec4 facingPlane(vec3 normal, const vec3& point, const vec3& inside) {
+	if (dot(normal, inside - point) < 0.0f) normal = -normal;
+	return vec4(normal, -dot(normal, point));
+}
+
+// Side of the plane the box is on: -1 entirely outside, 1 entirely inside, 0 across it
+static int boxSide(const vec3& bbMin, const vec3& bbMax, const vec4& plane) {
+	vec3 normal(plane);
+	float dist = dot(normal, (bbMin + bbMax) * 0.5f) + plane.w;
+	float radius = dot(abs(normal), (bbMax - bbMin) * 0.5f);
+	return dist + radius < 0.0f ? -1 : (dist - radius >= 0.0f ? 1 : 0);
+}
+
+bool Rasterizer::supports(const GeneralLinearCamera& cam) {
+	Projection proj;
+	return setupProjection(cam, 1, 1, proj);
+}
+
+// Perspective rays o0 + x * ox + y * oy + t * (d0 + x * dx + y * dy) all pass through the center
+// at t = tCenter when ox + tCenter * dx = 0 and oy + tCenter * dy = 0
+bool Rasterizer::setupProjection(const GeneralLinearCamera& cam, int rows, int cols, Projection& proj) {
+	mat3 fromScreen;
+	if (cam.dx == vec3(0.0f) && cam.dy == vec3(0.0f)) {
+		proj.ortho = true;
+		proj.center = cam.o0;
+		proj.tCenter = 0.0f;
+		fromScreen = mat3(cam.ox, cam.oy, cam.d0);
+	} else {
+		if (cam.dx == vec3(0.0f)) return false;
+		float tCenter = -dot(cam.ox, cam.dx) / dot(cam.dx, cam.dx);
+		if (tCenter >= 0.0f ||
+			length(cam.ox + tCenter * cam.dx) > 1e-4f * length(cam.ox) ||
+			length(cam.oy + tCenter * cam.dy) > 1e-4f * length(cam.oy))
+			return false;
+		proj.ortho = false;
+		proj.center = cam.o0 + tCenter * cam.d0;
+		proj.tCenter = tCenter;
+		fromScreen = mat3(cam.ox, cam.oy, cam.o0 - proj.center);
+	}
+	if (!spansSpace(fromScreen[0], fromScreen[1], fromScreen[2])) return false;
+	proj.toScreen = inverse(fromScreen);
+	proj.worldToObject = NULL;
+
+	// Planes of the rays through each image border, and the uv plane the rays start on
+	vec2 mid(cols * 0.5f, rows * 0.5f);
+	vec3 inside = cam.o0 + mid.x * cam.ox + mid.y * cam.oy + (cam.d0 + mid.x * cam.dx + mid.y * cam.dy);
+	proj.frustum[0] = facingPlane(cross(cam.ox, cam.oy), cam.o0, inside);
+	for (int side = 0; side < 2; side++) {
+		float x = side == 0 ? -0.5f : cols - 0.5f;
+		float y = side == 0 ? -0.5f : rows - 0.5f;
+		proj.frustum[1 + side] = facingPlane(cross(cam.oy, cam.d0 + x * cam.dx), cam.o0 + x * cam.ox, inside);
+		proj.frustum[3 + side] = facingPlane(cross(cam.ox, cam.d0 + y * cam.dy), cam.o0 + y * cam.oy, inside);
+	}
+	return true;
+}
+
+void Rasterizer::begin(const GeneralLinearCamera& cam, int rows, int cols) {
+	Projection proj;
+	if (!setupProjection(cam, rows, cols, proj))
+		throw runtime_error("Rasterizer needs a perspective or orthographic camera");
+	camera = cam;
+	tCenter = proj.tCenter;
+	ortho = proj.ortho;
+	this->rows = rows;
+	this->cols = cols;
+	depth.assign(rows * cols, numeric_limits<float>::max());
+	triIds.assign(rows * cols, -1);
+	instanceIds.assign(rows * cols, -1);
+	closest.assign(rows * cols, NULL);
+	spaces.clear();
+}
+
+void Rasterizer::rasterize(const BVH& bvh, const GeneralLinearCamera& cam, int rows, int cols) {
+	begin(cam, rows, cols);
+	Projection proj;
+	setupProjection(cam, rows, cols, proj);
+	drawBVH(bvh, proj, -1);
+}
+
+// Depth keys are ray parameters, which an instance transform preserves, so each instance is
+// drawn with the camera moved into its space and all of them share the depth buffer
+void Rasterizer::rasterize(const TLAS& tlas, const GeneralLinearCamera& cam, int rows, int cols) {
+	begin(cam, rows, cols);
+	const vector<Instance>& instances = tlas.getInstances();
+	for (size_t i = 0; i < instances.size(); i++) {
+		Projection proj;
+		if (!setupProjection(cam.transformed(instances[i].worldToObject), rows, cols, proj)) continue;
+		proj.worldToObject = &instances[i].worldToObject;
+		spaces.resize(i + 1, NULL);
+		spaces[i] = proj.worldToObject;
+		drawBVH(*instances[i].blas, proj, i);
+	}
+}
+
+Hit Rasterizer::hit(int x, int y) const {
+	Hit hit;
+	int i = y * cols + x;
+	if (triIds[i] == -1) return hit;
+	hit.tri = triIds[i];
+	hit.instance = instanceIds[i];
+	// Back from the depth key to the distance along the normalized ray
+	float t = ortho ? depth[i] : tCenter * (1.0f + 1.0f / depth[i]);
+	hit.t = t * length(camera.d0 + (float)x * camera.dx + (float)y * camera.dy);
+	return hit;
+}
+
+// Skip subtrees outside the view, draw the triangles of the rest. Each stack entry keeps a
+// mask of the frustum planes its box still crosses; planes a box is inside of are not
+// tested again below it.
+void Rasterizer::drawBVH(const BVH& bvh, const Projection& proj, int instance) {
+	if (!bvh.getNodeCount()) return;
+	const BVH::Node* nodes = bvh.getNodes();
+	const BVH::Tri* tris = bvh.getTris();
+
+	struct Entry {
+		unsigned int node;
+		int planes;
+	} stack[64];
+	int sp = 0;
+	stack[sp].node = 0;
+	stack[sp++].planes = 0x1F;
+	while (sp > 0) {
+		Entry entry = stack[--sp];
+		const BVH::Node& node = nodes[entry.node];
+		bool outside = false;
+		for (int p = 0; p < 5 && !outside; p++) {
+			if (!(entry.planes & (1 << p))) continue;
+			int side = boxSide(node.bbMin, node.bbMax, proj.frustum[p]);
+			outside = side < 0;
+			if (side > 0) entry.planes &= ~(1 << p);
+		}
+		if (outside) continue;
+		if (!node.count) {
+			stack[sp].node = node.leftFirst + 1;
+			stack[sp++].planes = entry.planes;
+			stack[sp].node = node.leftFirst;
+			stack[sp++].planes = entry.planes;
+			continue;
+		}
+		for (unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+			vec3 v[3] = { tris[i].v0, tris[i].v0 + tris[i].e1, tris[i].v0 + tris[i].e2 };
+			drawTriangle(v, proj, entry.planes & 1, tris[i], instance);
+		}
+	}
+}
+
+// Clip the triangle to the front of the uv plane, where rays have t > 0, and project it. The
+// depth key is the ray parameter for orthographic cameras and -1 / h.z otherwise, both affine
+// in pixel coordinates and growing with the distance.
+void Rasterizer::drawTriangle(const vec3* v, const Projection& proj, bool clip, const BVH::Tri& tri, int instance) {
+	const vec4& front = proj.frustum[0];
+	float s[3];
+	int inFront = 3;
+	if (clip) {
+		inFront = 0;
+		for (int k = 0; k < 3; k++) {
+			s[k] = dot(vec3(front), v[k]) + front.w;
+			if (s[k] > 0.0f) inFront++;
+		}
+	}
+	if (inFront == 0) return;
+
+	vec3 poly[4];
+	int n = 0;
+	if (inFront == 3) {
+		poly[0] = v[0]; poly[1] = v[1]; poly[2] = v[2];
+		n = 3;
+	} else {
+		for (int k = 0; k < 3; k++) {
+			int next = (k + 1) % 3;
+			if (s[k] > 0.0f) poly[n++] = v[k];
+			if ((s[k] > 0.0f) != (s[next] > 0.0f))
+				poly[n++] = v[k] + (v[next] - v[k]) * (s[k] / (s[k] - s[next]));
+		}
+	}
+
+	vec3 screen[4];
+	for (int k = 0; k < n; k++) {
+		vec3 h = proj.toScreen * (poly[k] - proj.center);
+		screen[k] = proj.ortho ? h : vec3(h.x / h.z, h.y / h.z, -1.0f / h.z);
+	}
+	scanTriangle(screen, proj, tri, instance);
+	if (n == 4) {
+		vec3 second[3] = { screen[0], screen[2], screen[3] };
+		scanTriangle(second, proj, tri, instance);
+	}
+}
+
+// Test every pixel sample in the bounding box against the three edge functions
+void Rasterizer::scanTriangle(const vec3* screen, const Projection& proj, const BVH::Tri& tri, int instance) {
+	const vec3 &a = screen[0], &b = screen[1], &c = screen[2];
+	float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+	if (area == 0.0f) return;
+	float sign = area > 0.0f ? 1.0f : -1.0f;
+
+	// The bounding box takes in the band too, for samples next to a vertex that rounded past them
+	float xMin = std::ceil(glm::max(glm::min(glm::min(a.x, b.x), c.x) - RASTER_EDGE_BAND, 0.0f));
+	float xMax = std::floor(glm::min(glm::max(glm::max(a.x, b.x), c.x) + RASTER_EDGE_BAND, cols - 1.0f));
+	float yMin = std::ceil(glm::max(glm::min(glm::min(a.y, b.y), c.y) - RASTER_EDGE_BAND, 0.0f));
+	float yMax = std::floor(glm::min(glm::max(glm::max(a.y, b.y), c.y) + RASTER_EDGE_BAND, rows - 1.0f));
+	if (xMin > xMax || yMin > yMax) return;
+
+	// Edge functions are scaled by the edge length, so the band is a distance in pixels
+	float band0 = RASTER_EDGE_BAND * length(vec2(c) - vec2(b));
+	float band1 = RASTER_EDGE_BAND * length(vec2(a) - vec2(c));
+	float band2 = RASTER_EDGE_BAND * length(vec2(b) - vec2(a));
+	float invArea = 1.0f / (area * sign);
+	float keyScale = glm::max(glm::max(fabs(a.z), fabs(b.z)), fabs(c.z));
+	for (int y = (int)yMin; y <= (int)yMax; y++) {
+		float py = (float)y;
+		for (int x = (int)xMin; x <= (int)xMax; x++) {
+			float px = (float)x;
+			float w0 = sign * ((c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x));
+			float w1 = sign * ((a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x));
+			float w2 = sign * ((b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x));
+			if (w0 <= -band0 || w1 <= -band1 || w2 <= -band2) continue;
+
+			float key, dist = -1.0f;
+			if (w0 >= band0 && w1 >= band1 && w2 >= band2) {
+				key = (w0 * a.z + w1 * b.z + w2 * c.z) * invArea;
+			} else {
+				dist = traceSample(x, y, proj.worldToObject, tri);
+				if (dist == numeric_limits<float>::max()) continue;
+				key = depthKey(x, y, dist);
+			}
+
+			int i = y * cols + x;
+			if (closest[i] && fabs(key - depth[i]) <= RASTER_DEPTH_TIE * glm::max(keyScale, fabs(depth[i]))) {
+				// Too close to call, and keys round away the difference of nearby hits: compare
+				// the distances the ray caster finds along both rays
+				const mat4* space = instanceIds[i] == -1 ? NULL : spaces[instanceIds[i]];
+				float other = traceSample(x, y, space, *closest[i]);
+				if (dist < 0.0f) dist = traceSample(x, y, proj.worldToObject, tri);
+				if (dist < other)
+					store(i, depthKey(x, y, dist), tri, instance);
+				else if (other != numeric_limits<float>::max())
+					depth[i] = depthKey(x, y, other);
+				continue;
+			}
+			if (key < depth[i]) store(i, key, tri, instance);
+		}
+	}
+}
+
+void Rasterizer::store(int i, float key, const BVH::Tri& tri, int instance) {
+	depth[i] = key;
+	triIds[i] = tri.id;
+	instanceIds[i] = instance;
+	closest[i] = &tri;
+}
+
+// Intersect the triangle with the ray the ray caster would trace for pixel (x, y), built the
+// same way down to the rounding: scanline() for perspective cameras, a direction normalized
+// once for orthographic ones, moved into instance space like TLAS::intersect. Returns the
+// distance of the hit along that ray, the float maximum on a miss.
+float Rasterizer::traceSample(int x, int y, const mat4* worldToObject, const BVH::Tri& tri) {
+	camera.scanline(y, x, 1, sample);
+	vec3 orig(sample.ox[0], sample.oy[0], sample.oz[0]);
+	vec3 dir = ortho ? normalize(camera.d0) : vec3(sample.dx[0], sample.dy[0], sample.dz[0]);
+	if (worldToObject) {
+		orig = vec3(*worldToObject * vec4(orig, 1.0f));
+		dir = vec3(*worldToObject * vec4(dir, 0.0f));
+	}
+
+	Hit hit;
+	BVH::intersectTri(orig, dir, tri, hit);
+	return hit.t;
+}
+
+// Depth key of the hit at distance dist along the ray through pixel (x, y)
+float Rasterizer::depthKey(int x, int y, float dist) const {
+	float t = dist / length(camera.d0 + (float)x * camera.dx + (float)y * camera.dy);
+	return ortho ? t : -1.0f / (1.0f - t / tCenter);
+}
@@ -0,0 +1,74 @@
+#ifndef RASTER_HPP
+#define RASTER_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "bvh.hpp"
+#include "tlas.hpp"
+#include "glc.hpp"
+
+// Projective GLCs (perspective and orthographic) map the scene to the image plane by a
+// projective transform, so their primary visibility can be rasterized instead of ray cast.
+// Triangles are projected to pixel coordinates and scan converted into a depth buffer and a
+// visibility buffer of triangle and instance ids. Pixels are sampled at the same corners as
+// GeneralLinearCamera::ray and covered only strictly inside a triangle. Samples within a
+// small band of an edge, where rounding could tip either way, are decided by the ray
+// caster's own ray and intersection test, and so are depths too close to call between two
+// triangles, where interpolated keys could order intersecting triangles either way. Both
+// paths therefore produce the same image.
+class Rasterizer {
+public:
+	// Whether the camera's rays meet in a center of projection behind the uv plane, or are parallel
+	static bool supports(const GeneralLinearCamera& cam);
+
+	// Rasterize a rows x cols image of accel's triangles, accel is a BVH or a TLAS. Each pixel's
+	// hit is shaded into pixels (row-major) as renderFrame does.
+	template <class Shade, class Pixel, class Accel>
+	void render(const Accel& accel, const GeneralLinearCamera& cam, int rows, int cols, Shade shade, Pixel* pixels) {
+		rasterize(accel, cam, rows, cols);
+		for (int y = 0; y < rows; y++)
+			for (int x = 0; x < cols; x++)
+				pixels[y * cols + x] = shade(hit(x, y));
+	}
+
+	// Fill the depth and visibility buffers
+	void rasterize(const BVH& bvh, const GeneralLinearCamera& cam, int rows, int cols);
+	void rasterize(const TLAS& tlas, const GeneralLinearCamera& cam, int rows, int cols);
+
+	// Closest hit of the ray through pixel (x, y) of the last rasterized image
+	Hit hit(int x, int y) const;
+
+protected:
+	// Pixel coordinates of a point are (h.x, h.y) / h.z with h = toScreen * (p - center); the
+	// depth key grows with the distance along the ray and is affine in pixel coordinates
+	struct Projection {
+		bool ortho;
+		glm::mat3 toScreen;		// Inverse of [ox oy (o0 - center)], or of [ox oy d0] when orthographic
+		glm::vec3 center;		// Center of projection, o0 when orthographic
+		float tCenter;			// Ray parameter of the center, negative
+		glm::vec4 frustum[5];	// Origin plane, then the sides half a pixel outside the image
+		const glm::mat4* worldToObject;	// Space of the triangles drawn, NULL for the camera's own
+	};
+
+	static bool setupProjection(const GeneralLinearCamera& cam, int rows, int cols, Projection& proj);
+	void begin(const GeneralLinearCamera& cam, int rows, int cols);
+	void drawBVH(const BVH& bvh, const Projection& proj, int instance);
+	void drawTriangle(const glm::vec3* v, const Projection& proj, bool clip, const BVH::Tri& tri, int instance);
+	void scanTriangle(const glm::vec3* screen, const Projection& proj, const BVH::Tri& tri, int instance);
+	float traceSample(int x, int y, const glm::mat4* worldToObject, const BVH::Tri& tri);
+	float depthKey(int x, int y, float dist) const;
+	void store(int i, float key, const BVH::Tri& tri, int instance);
+
+	GeneralLinearCamera camera;		// Camera of the last image, in the accel's space
+	float tCenter;
+	bool ortho;
+	int rows, cols;
+	std::vector<float> depth;		// Depth key of the closest triangle per pixel
+	std::vector<int> triIds;		// Visibility buffer, -1 where nothing was hit
+	std::vector<int> instanceIds;
+	std::vector<const BVH::Tri*> closest;	// Triangle behind each id, to ray cast depth ties
+	std::vector<const glm::mat4*> spaces;	// worldToObject of each instance
+	RayBatch sample;				// Ray of a sample near an edge
+};
+
+#endif
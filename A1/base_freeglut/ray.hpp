@@ -21,11 +21,11 @@ public:
         this->dir = dir;
     }
 
-    vec3 getDir(){
+    vec3 getDir() const {
         return dir;
     }
 
-    vec3 getOrigin(){
+    vec3 getOrigin() const {
         return origin;
     }
 
@@ -37,7 +37,7 @@ public:
         this->origin = origin;
     }
 
-    void printRay(){
+    void printRay() const {
         cout<< " Ray\nOrigin: " << origin.x << ", " << origin.y << ", " << origin.z << endl;
         cout<< " Direction: " << dir.x << ", " << dir.y << ", " << dir.z << endl;
     }
@@ -0,0 +1,58 @@
+#include "raystats.hpp"
+#include <sstream>
+#include <algorithm>
+using namespace std;
+using namespace glm;
+
+void RayCounters::reset() {
+	rays = hits = culledRays = nodeVisits = triTests = 0;
+	generationMs = traversalMs = uploadMs = 0.0;
+}
+
+void RayCounters::add(const RayCounters& other) {
+	rays += other.rays;
+	hits += other.hits;
+	culledRays += other.culledRays;
+	nodeVisits += other.nodeVisits;
+	triTests += other.triTests;
+	generationMs += other.generationMs;
+	traversalMs += other.traversalMs;
+	uploadMs += other.uploadMs;
+}
+
+string RayCounters::toJSON() const {
+	ostringstream out;
+	out << "{\"rays\": " << rays << ", \"hits\": " << hits << ", \"misses\": " << misses()
+		<< ", \"culledRays\": " << culledRays
+		<< ", \"nodeVisits\": " << nodeVisits << ", \"triTests\": " << triTests
+		<< ", \"generationMs\": " << generationMs << ", \"traversalMs\": " << traversalMs
+		<< ", \"uploadMs\": " << uploadMs << "}";
+	return out.str();
+}
+
+RayCounters& threadRayCounters() {
+	static thread_local RayCounters counters;
+	return counters;
+}
+
+void collectThreadRayCounters(RayCounters& frame) {
+	RayCounters& counters = threadRayCounters();
+	frame.add(counters);
+	counters.reset();
+}
+
+void overlayCostHeatmap(const vector<float>& cost, u8vec4* pixels) {
+	float maxCost = 0.0f;
+	for (size_t i = 0; i < cost.size(); i++)
+		maxCost = glm::max(maxCost, cost[i]);
+	if (maxCost == 0.0f) return;
+
+	for (size_t i = 0; i < cost.size(); i++) {
+		// Blue through green to red, blended half over the image
+		float c = cost[i] / maxCost;
+		vec3 heat = c < 0.5f ? mix(vec3(0, 0, 255), vec3(0, 255, 0), c * 2.0f) :
+			mix(vec3(0, 255, 0), vec3(255, 0, 0), c * 2.0f - 1.0f);
+		vec3 color = mix(vec3(pixels[i].r, pixels[i].g, pixels[i].b), heat, 0.5f);
+		pixels[i] = u8vec4(color.r, color.g, color.b, pixels[i].a);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef RAYSTATS_HPP
+#define RAYSTATS_HPP
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Work done to ray cast a frame, or the part of it one thread did
+struct RayCounters {
+	unsigned long long rays;
+	unsigned long long hits;
+	unsigned long long culledRays;	// Missed the root box of the BVH or TLAS
+	unsigned long long nodeVisits;	// BVH and TLAS nodes entered, once per packet for packets
+	unsigned long long triTests;	// Ray-triangle tests, once per ray
+	double generationMs;			// Filling scanlines of rays
+	double traversalMs;				// Tracing them through the scene
+	double uploadMs;				// Handing the image to the texture
+
+	RayCounters() { reset(); }
+	void reset();
+	void add(const RayCounters& other);
+	unsigned long long misses() const { return rays - hits; }
+	// One JSON object, e.g. {"rays": 250000, "hits": 81234, ...}
+	std::string toJSON() const;
+};
+
+// Traversal counts culled rays, node visits and triangle tests into the calling thread's counters
+// only in builds with GLC_STATS defined (make STATS=1); otherwise the counting compiles to nothing
+// and those three counters stay zero.
+#ifdef GLC_STATS
+const bool RAY_STATS_BUILD = true;
+#define COUNT_RAY_STAT(counter, n) (threadRayCounters().counter += (n))
+#else
+const bool RAY_STATS_BUILD = false;
+#define COUNT_RAY_STAT(counter, n) ((void)0)
+#endif
+
+// Counters of the calling thread, kept apart so threads never share a cache line of counts
+RayCounters& threadRayCounters();
+// Add the calling thread's counters to frame and clear them, once per thread and frame
+void collectThreadRayCounters(RayCounters& frame);
+
+// Blend a blue-to-red map of cost (one value per pixel) over pixels, the most expensive pixel red
+void overlayCostHeatmap(const std::vector<float>& cost, glm::u8vec4* pixels);
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef RENDER_HPP
+#define RENDER_HPP
+
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <glm/glm.hpp>
+#include "bvh.hpp"
+#include "glc.hpp"
+#include "raystats.hpp"
+
+// Camera kinds. Each fills scanlines of rays and skips the work its camera does not need.
+enum CameraKind { KIND_PERSPECTIVE, KIND_ORTHO, KIND_PUSHBROOM };
+
+// Direction changes in x and y: perspective and the other non-parallel GLCs
+struct PerspectiveKind {
+	const GeneralLinearCamera& cam;
+	PerspectiveKind(const GeneralLinearCamera& cam) : cam(cam) {}
+	void scanline(int y, int x0, int count, RayBatch& batch) const { cam.scanline(y, x0, count, batch); }
+};
+
+// All rays share one direction, normalized once per frame
+struct OrthoKind {
+	const GeneralLinearCamera& cam;
+	glm::vec3 dir;
+	OrthoKind(const GeneralLinearCamera& cam) : cam(cam), dir(glm::normalize(cam.d0)) {}
+	void scanline(int y, int x0, int count, RayBatch& batch) const { fillScanline(cam, y, x0, count, dir, batch); }
+
+	// Step the origins along the row from pixel x0, as GeneralLinearCamera::scanline does, and
+	// store a fixed direction
+	static void fillScanline(const GeneralLinearCamera& cam, int y, int x0, int count, const glm::vec3& dir,
+		RayBatch& batch) {
+		if ((int)batch.ox.size() < count) batch.resize(count);
+		fillLanes(x0, count, cam.o0 + (float)y * cam.oy, cam.ox, dir,
+			batch.ox.data(), batch.oy.data(), batch.oz.data(), batch.dx.data(), batch.dy.data(), batch.dz.data());
+	}
+	// The arrays are restrict parameters so the loop vectorizes without overlap checks
+	static void fillLanes(int x0, int count, glm::vec3 oRow, glm::vec3 oStep, glm::vec3 dir,
+		float* __restrict rox, float* __restrict roy, float* __restrict roz,
+		float* __restrict rdx, float* __restrict rdy, float* __restrict rdz) {
+		for (int i = 0; i < count; i++) {
+			float fx = (float)(x0 + i);
+			rox[i] = oRow.x + fx * oStep.x;
+			roy[i] = oRow.y + fx * oStep.y;
+			roz[i] = oRow.z + fx * oStep.z;
+			rdx[i] = dir.x;
+			rdy[i] = dir.y;
+			rdz[i] = dir.z;
+		}
+	}
+};
+
+// Direction only changes from row to row, normalized once per scanline
+struct PushbroomKind {
+	const GeneralLinearCamera& cam;
+	PushbroomKind(const GeneralLinearCamera& cam) : cam(cam) {}
+	void scanline(int y, int x0, int count, RayBatch& batch) const {
+		OrthoKind::fillScanline(cam, y, x0, count, glm::normalize(cam.d0 + (float)y * cam.dy), batch);
+	}
+};
+
+// Pick the cheapest kind that reproduces the camera's rays
+inline CameraKind classifyCamera(const GeneralLinearCamera& cam) {
+	if (cam.dx == glm::vec3(0.0f))
+		return cam.dy == glm::vec3(0.0f) ? KIND_ORTHO : KIND_PUSHBROOM;
+	return KIND_PERSPECTIVE;
+}
+
+// Color the mesh's first two triangles red and green, everything else background
+inline glm::u8vec3 shadeTriangle(const Hit& hit, const glm::u8vec3& background) {
+	if (hit.tri == 0)
+		return glm::u8vec3(255, 0, 0);
+	if (hit.tri == 3)
+		return glm::u8vec3(0, 255, 0);
+	return background;
+}
+
+// Instrumentation policies. Every hook of the production policy is empty and compiles away;
+// the others derive from it and override the hooks they use.
+struct NoInstrumentation {
+	void ray(const Ray& ray) {}
+	void hit(const Hit& hit) {}
+	// Around filling the scanlines of a block of rows
+	void beginGeneration() {}
+	void endGeneration() {}
+	// Around tracing the w x h block of pixels at (x, y), one ray or one packet
+	void beginTraversal() {}
+	void endTraversal(int x, int y, int w, int h) {}
+	void report() {}
+};
+
+// Prints every ray and counts rays and hits
+struct DebugInstrumentation : NoInstrumentation {
+	long rays;
+	long hits;
+	DebugInstrumentation() : rays(0), hits(0) {}
+	void ray(const Ray& ray) { ray.printRay(); rays++; }
+	void hit(const Hit& hit) { if (hit.tri != -1) hits++; }
+	void report() { std::cout << "Rays: " << rays << ", hits: " << hits << std::endl; }
+};
+
+// Tests a runtime flag in every hook, as the unspecialized loop did; only used for comparison
+struct FlagInstrumentation : NoInstrumentation {
+	const bool& enabled;
+	DebugInstrumentation debug;
+	FlagInstrumentation(const bool& enabled) : enabled(enabled) {}
+	void ray(const Ray& ray) { if (enabled) debug.ray(ray); }
+	void hit(const Hit& hit) { if (enabled) debug.hit(hit); }
+	void report() { if (enabled) debug.report(); }
+};
+
+// Counts rays and hits and times ray generation and traversal into counters. With cost, also
+// adds the node visits and triangle tests of each pixel to cost (cols per row), splitting a
+// packet's evenly among its pixels; those counts only exist in GLC_STATS builds.
+struct StatsInstrumentation : NoInstrumentation {
+	typedef std::chrono::steady_clock clock;
+	RayCounters& counters;
+	std::vector<float>* cost;
+	int cols;
+	clock::time_point start;
+	unsigned long long work;	// Node visits and triangle tests of the thread when the traversal began
+
+	StatsInstrumentation(RayCounters& counters, std::vector<float>* cost = NULL, int cols = 0) :
+		counters(counters), cost(cost), cols(cols), work(0) {}
+	void ray(const Ray& ray) { counters.rays++; }
+	void hit(const Hit& hit) { if (hit.tri != -1) counters.hits++; }
+	void beginGeneration() { start = clock::now(); }
+	void endGeneration() { counters.generationMs += elapsedMs(); }
+	void beginTraversal() {
+		start = clock::now();
+		if (cost) work = threadWork();
+	}
+	void endTraversal(int x, int y, int w, int h) {
+		counters.traversalMs += elapsedMs();
+		if (!cost) return;
+		float share = (float)(threadWork() - work) / (w * h);
+		for (int r = y; r < y + h; r++)
+			for (int c = x; c < x + w; c++)
+				(*cost)[r * cols + c] += share;
+	}
+
+	double elapsedMs() const { return std::chrono::duration<double, std::milli>(clock::now() - start).count(); }
+	static unsigned long long threadWork() {
+		const RayCounters& thread = threadRayCounters();
+		return thread.nodeVisits + thread.triTests;
+	}
+};
+
+// Ray cast the width x height tile of pixels starting at (x0, y0) into pixels (row-major, cols
+// per row), tracing packetSize x packetSize blocks of pixels as one packet through accel (a BVH
+// or a TLAS). shade maps a hit to a Pixel. batches holds packetSize scanlines of rays.
+template <class Kind, class Instrumentation, class Shade, class Pixel, class Accel>
+void renderTile(const Accel& accel, const Kind& kind, int x0, int y0, int width, int height, int cols,
+	int packetSize, Shade shade, Pixel* pixels, Instrumentation& instr, std::vector<RayBatch>& batches) {
+	for (int by = y0; by < y0 + height; by += packetSize) {
+		int rowCount = glm::min(packetSize, y0 + height - by);
+		instr.beginGeneration();
+		for (int r = 0; r < rowCount; r++)
+			kind.scanline(by + r, x0, width, batches[r]);
+		instr.endGeneration();
+
+		if (packetSize == 1) {
+			const RayBatch& batch = batches[0];
+			for (int x = 0; x < width; x++) {
+				Ray ray = batch.ray(x);
+				instr.ray(ray);
+				Hit hit;
+				instr.beginTraversal();
+				accel.intersect(ray, hit);
+				instr.endTraversal(x0 + x, by, 1, 1);
+				instr.hit(hit);
+				pixels[by * cols + x0 + x] = shade(hit);
+			}
+			continue;
+		}
+
+		for (int bx = 0; bx < width; bx += packetSize) {
+			int colCount = glm::min(packetSize, width - bx);
+			RayPacket packet;
+			for (int r = 0; r < rowCount; r++) {
+				for (int c = 0; c < colCount; c++) {
+					Ray ray = batches[r].ray(bx + c);
+					instr.ray(ray);
+					packet.add(ray);
+				}
+			}
+
+			Hit hits[RayPacket::MAX_RAYS];
+			instr.beginTraversal();
+			accel.intersect(packet, hits);
+			instr.endTraversal(x0 + bx, by, colCount, rowCount);
+
+			int k = 0;
+			for (int r = 0; r < rowCount; r++) {
+				for (int c = 0; c < colCount; c++) {
+					instr.hit(hits[k]);
+					pixels[(by + r) * cols + x0 + bx + c] = shade(hits[k++]);
+				}
+			}
+		}
+	}
+}
+
+// Select the specialized loop for the camera, once per tile
+template <class Instrumentation, class Shade, class Pixel, class Accel>
+void renderTile(const Accel& accel, const GeneralLinearCamera& cam, CameraKind kind, int x0, int y0, int width,
+	int height, int cols, int packetSize, Shade shade, Pixel* pixels, Instrumentation& instr,
+	std::vector<RayBatch>& batches) {
+	switch (kind) {
+	case KIND_ORTHO:
+		renderTile(accel, OrthoKind(cam), x0, y0, width, height, cols, packetSize, shade, pixels, instr, batches);
+		break;
+	case KIND_PUSHBROOM:
+		renderTile(accel, PushbroomKind(cam), x0, y0, width, height, cols, packetSize, shade, pixels, instr, batches);
+		break;
+	default:
+		renderTile(accel, PerspectiveKind(cam), x0, y0, width, height, cols, packetSize, shade, pixels, instr, batches);
+		break;
+	}
+}
+
+// Ray cast a rows x cols image into pixels (row-major) as a single tile
+template <class Kind, class Instrumentation, class Shade, class Pixel, class Accel>
+void renderFrame(const Accel& accel, const GeneralLinearCamera& cam, int rows, int cols, int packetSize,
+	Shade shade, Pixel* pixels, Instrumentation& instr) {
+	Kind kind(cam);
+	std::vector<RayBatch> batches(packetSize);
+	renderTile(accel, kind, 0, 0, cols, rows, cols, packetSize, shade, pixels, instr, batches);
+	instr.report();
+}
+
+// Select the specialized loop for the camera once per frame
+template <class Instrumentation, class Shade, class Pixel, class Accel>
+void renderFrame(const Accel& accel, const GeneralLinearCamera& cam, CameraKind kind, int rows, int cols,
+	int packetSize, Shade shade, Pixel* pixels, Instrumentation& instr) {
+	switch (kind) {
+	case KIND_ORTHO:
+		renderFrame<OrthoKind>(accel, cam, rows, cols, packetSize, shade, pixels, instr);
+		break;
+	case KIND_PUSHBROOM:
+		renderFrame<PushbroomKind>(accel, cam, rows, cols, packetSize, shade, pixels, instr);
+		break;
+	default:
+		renderFrame<PerspectiveKind>(accel, cam, rows, cols, packetSize, shade, pixels, instr);
+		break;
+	}
+}
+
+// Coarse-to-fine rendering spread over several frames. The first pass traces every
+// 8th pixel in each direction and fills 8x8 blocks; each later pass halves the spacing
+// and only traces the pixels the coarser passes skipped, until every pixel has its own ray.
+class ProgressiveRenderer {
+public:
+	static const int COARSE_STEP = 8;
+
+	ProgressiveRenderer() { restart(); }
+
+	// Start over from the coarse pass, e.g. after the camera moved
+	void restart() { step = COARSE_STEP; row = 0; }
+	// Treat the image as complete, e.g. when it was restored from a cache
+	void finish() { step = 0; }
+	bool converged() const { return step == 0; }
+
+	// Refine the rows x cols image until budgetMs has passed. The coarse pass is always
+	// finished so a complete (blocky) image is shown. Returns true once converged.
+	template <class Shade, class Pixel, class Accel>
+	bool refine(const Accel& accel, const GeneralLinearCamera& cam, int rows, int cols, Shade shade,
+		Pixel* pixels, double budgetMs) {
+		typedef std::chrono::steady_clock clock;
+		clock::time_point start = clock::now();
+
+		while (!converged()) {
+			// Pixels on the coarser grid were traced by an earlier pass
+			bool skipCoarser = step < COARSE_STEP && row % (2 * step) == 0;
+			for (int x = skipCoarser ? step : 0; x < cols; x += skipCoarser ? 2 * step : step) {
+				Hit hit;
+				accel.intersect(cam.ray((float)x, (float)row), hit);
+				Pixel color = shade(hit);
+				for (int y = row; y < glm::min(row + step, rows); y++)
+					for (int bx = x; bx < glm::min(x + step, cols); bx++)
+						pixels[y * cols + bx] = color;
+			}
+
+			row += step;
+			if (row >= rows) {
+				bool coarseDone = step == COARSE_STEP;
+				step /= 2;
+				row = 0;
+				if (coarseDone) continue;
+			}
+			if (step < COARSE_STEP &&
+				std::chrono::duration<double, std::milli>(clock::now() - start).count() >= budgetMs)
+				break;
+		}
+		return converged();
+	}
+
+protected:
+	int step;	// Pixel spacing of the current pass, 0 once converged
+	int row;	// Next row of the current pass
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include "rendertarget.hpp"
+#include <cmath>
+using namespace std;
+using namespace glm;
+
+const float RenderTarget::MIN_SCALE = 0.125f;
+const float ScaleController::STEP = 1.0f / 32.0f;
+const double ScaleController::TOLERANCE = 0.15;
+
+RenderTarget::RenderTarget() :
+	clearColor(255), windowWidth(0), windowHeight(0), width(0), height(0), scale(1.0f) {}
+
+void RenderTarget::init(int windowWidth, int windowHeight, float scale, const u8vec4& clearColor) {
+	this->windowWidth = windowWidth;
+	this->windowHeight = windowHeight;
+	this->scale = clamp(scale, MIN_SCALE, 1.0f);
+	this->clearColor = clearColor;
+	reallocate();
+}
+
+bool RenderTarget::resize(int windowWidth, int windowHeight) {
+	this->windowWidth = windowWidth;
+	this->windowHeight = windowHeight;
+	return reallocate();
+}
+
+bool RenderTarget::setScale(float scale) {
+	this->scale = clamp(scale, MIN_SCALE, 1.0f);
+	return reallocate();
+}
+
+bool RenderTarget::reallocate() {
+	int w = glm::max(1, (int)lround(windowWidth * scale));
+	int h = glm::max(1, (int)lround(windowHeight * scale));
+	if (w == width && h == height && getTexture())
+		return false;
+
+	width = w;
+	height = h;
+	cpuPixels.assign(width * height, clearColor);
+	stream.init(width, height, clearColor);
+	return true;
+}
+
+ScaleController::ScaleController(double targetMs) : targetMs(targetMs), avgMs(0.0) {}
+
+float ScaleController::update(float scale, double frameMs) {
+	// Average the cost of a full-resolution frame, so samples taken at different scales agree
+	double fullMs = frameMs / (scale * scale);
+	avgMs = avgMs == 0.0 ? fullMs : 0.7 * avgMs + 0.3 * fullMs;
+
+	double expectedMs = avgMs * scale * scale;
+	if (fabs(expectedMs - targetMs) <= TOLERANCE * targetMs)
+		return scale;
+
+	// Grow slowly and shrink fast, so a too slow frame is corrected at once
+	float ideal = (float)sqrt(targetMs / avgMs);
+	float next = clamp(ideal, scale * 0.5f, scale * 1.25f);
+	next = round(next / STEP) * STEP;
+	return clamp(next, RenderTarget::MIN_SCALE, 1.0f);
+}
@@ -0,0 +1,67 @@
+#ifndef RENDERTARGET_HPP
+#define RENDERTARGET_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "texstream.hpp"
+
+// Image the GLC camera renders into. Its internal resolution is the window size times
+// a render scale, so it can be lower than the window and is upscaled on the textured quad.
+class RenderTarget {
+public:
+	static const float MIN_SCALE;
+
+	RenderTarget();
+
+	// Create the texture for a window of windowWidth x windowHeight, needs a GL context
+	void init(int windowWidth, int windowHeight, float scale, const glm::u8vec4& clearColor);
+	void release() { stream.release(); }
+
+	// Reallocate for a new window size or render scale; returns true if the internal resolution changed
+	bool resize(int windowWidth, int windowHeight);
+	bool setScale(float scale);
+	float getScale() const { return scale; }
+
+	// Internal resolution
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	// CPU copy of the image (bottom row first), for passes that build on earlier frames
+	glm::u8vec4* pixels() { return cpuPixels.data(); }
+	// Buffer to render the next frame into, hand it to the texture with upload()
+	glm::u8vec4* map() { return stream.map(); }
+	void upload() { stream.upload(); }
+	GLuint getTexture() const { return stream.getTexture(); }
+
+protected:
+	bool reallocate();
+
+	TextureStream stream;
+	std::vector<glm::u8vec4> cpuPixels;
+	glm::u8vec4 clearColor;
+	int windowWidth, windowHeight;
+	int width, height;
+	float scale;
+};
+
+// Picks the render scale that keeps full frames close to a target time. Ray casting
+// cost grows with the pixel count, i.e. with the square of the scale.
+class ScaleController {
+public:
+	ScaleController(double targetMs);
+
+	// Time of a frame rendered at scale; returns the scale to use from now on
+	float update(float scale, double frameMs);
+
+	void setTarget(double targetMs) { this->targetMs = targetMs; avgMs = 0.0; }
+	double getTarget() const { return targetMs; }
+
+protected:
+	static const float STEP;		// Scales are multiples of this, so small changes do not reallocate
+	static const double TOLERANCE;	// Relative error around the target that is left alone
+
+	double targetMs;
+	double avgMs;	// Smoothed frame time, normalized to scale 1; 0 until the first frame
+};
+
+#endif
@@ -0,0 +1,333 @@
+#include "reproject.hpp"
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdint>
+using namespace std;
+using namespace glm;
+
+// Triangles a walk may cross before the pixel is traced instead
+const int REPROJECT_WALK_STEPS = 8;
+
+// Points landed on a neighbouring pixel are tested as occluders of a pixel's own surface when
+// they are this much closer than its own point
+const float REPROJECT_OCCLUDER_DEPTH = 0.98f;
+
+// Side of the square image tiles over which the motion of landed points is gathered
+const int REPROJECT_TILE = 16;
+
+// Helper functions
+// Pixel coordinates and ray parameter of the ray through p, negative if p is behind the origins,
+// false if no single pixel's ray line passes through p. Ray origins lie in the plane through o0
+// spanned by ox and oy, and dx and dy lie in that plane too, so every unnormalized direction has
+// the same component speed along its normal. The ray parameter of a point follows from its
+// distance to the plane, and the pixel from a 2x2 system.
+static bool projectPoint(const GeneralLinearCamera& cam, const vec3& normal, float speed, const vec3& p,
+	vec2& pixel, float& t) {
+	vec3 rel = p - cam.o0;
+	t = dot(normal, rel) / speed;
+
+	vec3 a = cam.ox + t * cam.dx;
+	vec3 b = cam.oy + t * cam.dy;
+	vec3 r = rel - t * cam.d0;
+	float aa = dot(a, a), ab = dot(a, b), bb = dot(b, b);
+	float det = aa * bb - ab * ab;
+	if (det <= 0.0f) return false;
+	float ar = dot(a, r), br = dot(b, r);
+	pixel = vec2((ar * bb - br * ab) / det, (br * aa - ar * ab) / det);
+	return true;
+}
+
+Reprojector::Reprojector(int refreshInterval) :
+	mesh(NULL), refreshInterval(glm::max(1, refreshInterval)), sinceRefresh(0), valid(false), rows(0), cols(0) {
+	resetStats();
+}
+
+void Reprojector::setMesh(const MeshData& mesh) {
+	this->mesh = &mesh;
+	valid = false;
+
+	// Pair up the two sides of every edge by its vertex indices
+	const vector<unsigned int>& el = mesh.v_elements;
+	adjacency.assign(el.size(), -1);
+	unordered_map<uint64_t, int> open;
+	open.reserve(el.size());
+	for (int tri = 0; tri + 2 < (int)el.size(); tri += 3) {
+		for (int k = 0; k < 3; k++) {
+			unsigned int a = el[tri + k], b = el[tri + (k + 1) % 3];
+			uint64_t key = (uint64_t)std::min(a, b) << 32 | std::max(a, b);
+			unordered_map<uint64_t, int>::iterator other = open.find(key);
+			if (other == open.end()) {
+				open[key] = tri + k;
+				continue;
+			}
+			adjacency[tri + k] = other->second - other->second % 3;
+			adjacency[other->second] = tri;
+			open.erase(other);
+		}
+	}
+}
+
+void Reprojector::resetStats() {
+	frames = 0;
+	fullFrames = 0;
+	pixelCount = 0;
+	tracedPixels = 0;
+}
+
+void Reprojector::trace(const TLAS& scene, const GeneralLinearCamera& cam, CameraKind kind, int rows, int cols,
+	int packetSize) {
+	frames++;
+	pixelCount += (long long)rows * cols;
+
+	int traced = -1;
+	bool refresh = sinceRefresh + 1 >= refreshInterval;
+	if (mesh && valid && !refresh && rows == this->rows && cols == this->cols)
+		traced = reproject(scene, cam, packetSize);
+
+	if (traced < 0) {
+		// Whole image in packets, then the points hit for the next frame
+		this->rows = rows;
+		this->cols = cols;
+		hits.resize(rows * cols);
+		NoInstrumentation instr;
+		auto keep = [](const Hit& hit) { return hit; };
+		renderFrame(scene, cam, kind, rows, cols, packetSize, keep, hits.data(), instr);
+		points.resize(rows * cols);
+		for (int y = 0; y < rows; y++) {
+			for (int x = 0; x < cols; x++) {
+				int i = y * cols + x;
+				if (hits[i].tri < 0) continue;
+				Ray ray = cam.ray((float)x, (float)y);
+				points[i] = ray.getOrigin() + hits[i].t * ray.getDir();
+			}
+		}
+		fullFrames++;
+		tracedPixels += (long long)rows * cols;
+		sinceRefresh = 0;
+	} else {
+		tracedPixels += traced;
+		sinceRefresh++;
+		// Once most pixels need their own ray, packets over the whole image are faster
+		if (traced * 2 > rows * cols)
+			sinceRefresh = refreshInterval;
+	}
+
+	// Rays of the next frame starting behind this frame's origin plane pass through space no ray saw
+	vec3 normal = cross(cam.ox, cam.oy);
+	if (dot(normal, cam.d0) < 0.0f)
+		normal = -normal;
+	seen = vec4(normal, -dot(normal, cam.o0));
+	valid = true;
+}
+
+// Fill hits from the previous frame's, returns the number of pixels traced through the scene or
+// -1 when the camera's rays cannot be inverted
+int Reprojector::reproject(const TLAS& scene, const GeneralLinearCamera& cam, int packetSize) {
+	vec3 normal = cross(cam.ox, cam.oy);
+	float speed = dot(normal, cam.d0);
+	if (fabs(speed) < 1e-6f * length(normal) * length(cam.d0))
+		return -1;
+
+	int n = rows * cols;
+	swap(hits, previous);
+	hits.assign(n, Hit());
+	depth.assign(n, FLT_MAX);
+	landed.assign(n, -1);
+
+	// Land each point on its nearest pixel sample, the closest one along the ray wins, and
+	// gather the range of motion across the image in the tiles points left and reached
+	int tileCols = (cols + REPROJECT_TILE - 1) / REPROJECT_TILE;
+	int tileRows = (rows + REPROJECT_TILE - 1) / REPROJECT_TILE;
+	motion.assign(tileRows * tileCols, TileMotion());
+	for (int i = 0; i < n; i++) {
+		if (previous[i].tri < 0) continue;
+		int sx = i % cols, sy = i / cols;
+		TileMotion& left = motion[sy / REPROJECT_TILE * tileCols + sx / REPROJECT_TILE];
+		vec2 pixel;
+		float t;
+		if (!projectPoint(cam, normal, speed, points[i], pixel, t)) {
+			left.far = FLT_MAX;
+			continue;
+		}
+		vec2 moved = pixel - vec2(sx, sy);
+		left.add(moved);
+
+		int x = (int)std::floor(pixel.x + 0.5f);
+		int y = (int)std::floor(pixel.y + 0.5f);
+		if (x < 0 || x >= cols || y < 0 || y >= rows) continue;
+		motion[y / REPROJECT_TILE * tileCols + x / REPROJECT_TILE].add(moved);
+
+		// A point that passed behind the origins was cut away and uncovers whatever lies behind
+		// it, so the pixels around it are traced as around a hole
+		int j = y * cols + x;
+		if (t <= 0.0f) {
+			if (landed[j] == -1) landed[j] = -2;
+			continue;
+		}
+		if (t < depth[j]) {
+			depth[j] = t;
+			landed[j] = i;
+		}
+	}
+
+	// Landed points spread apart, and open holes where surfaces are disoccluded, by no more than
+	// the difference of the motions around them; surfaces from outside the image enter by no
+	// more than the motion itself. Pixels farther than that from every landed point and from
+	// the border keep missing. Counts of landed points in boxes come from a summed-area table.
+	landedSums.assign((rows + 1) * (cols + 1), 0);
+	for (int y = 0; y < rows; y++)
+		for (int x = 0; x < cols; x++)
+			landedSums[(y + 1) * (cols + 1) + x + 1] = landedSums[y * (cols + 1) + x + 1] +
+				landedSums[(y + 1) * (cols + 1) + x] - landedSums[y * (cols + 1) + x] + (landed[y * cols + x] != -1);
+	gaps.assign(tileRows * tileCols, 0);
+	borders.assign(tileRows * tileCols, 0);
+	for (int ty = 0; ty < tileRows; ty++) {
+		for (int tx = 0; tx < tileCols; tx++) {
+			TileMotion around;
+			for (int y = glm::max(0, ty - 1); y <= glm::min(tileRows - 1, ty + 1); y++)
+				for (int x = glm::max(0, tx - 1); x <= glm::min(tileCols - 1, tx + 1); x++)
+					around.add(motion[y * tileCols + x]);
+			// Gaps wider than the neighbouring tiles, or points no pixel's ray reaches, could
+			// uncover anything
+			float gap = around.lo.x > around.hi.x ? 0.0f : length(around.hi - around.lo);
+			bool bounded = gap + 1.0f < REPROJECT_TILE && around.far < FLT_MAX;
+			gaps[ty * tileCols + tx] = bounded ? (int)std::ceil(gap) + 1 : -1;
+			borders[ty * tileCols + tx] = bounded ? (int)std::ceil(around.far) + 1 : 0;
+		}
+	}
+
+	// Test the candidates around each pixel against its ray. Pixels where none is hit, and the
+	// unseen parts of rays, are traced through the scene as one packet per block of pixels.
+	int traced = 0;
+	for (int by = 0; by < rows; by += packetSize) {
+		for (int bx = 0; bx < cols; bx += packetSize) {
+			RayPacket packet;
+			int slot[RayPacket::MAX_RAYS];		// Pixel of each ray in the packet
+			Hit found[RayPacket::MAX_RAYS];		// Closest hit of each ray, up to where it must look
+			for (int y = by; y < glm::min(rows, by + packetSize); y++) {
+				for (int x = bx; x < glm::min(cols, bx + packetSize); x++) {
+					int j = y * cols + x;
+					int tile = y / REPROJECT_TILE * tileCols + x / REPROJECT_TILE;
+					int r = gaps[tile], border = borders[tile];
+					if (r >= 0 && x >= border && x < cols - border && y >= border && y < rows - border &&
+						landedIn(glm::max(0, x - r), glm::max(0, y - r), glm::min(cols - 1, x + r),
+							glm::min(rows - 1, y + r)) == 0)
+						continue;
+
+					Ray ray = cam.ray((float)x, (float)y);
+					Hit& hit = hits[j];
+					testCandidate(scene, ray, j, hit);
+					// Neighbours only matter where they may hide the pixel's own surface
+					float occluder = hit.tri >= 0 ? depth[j] * REPROJECT_OCCLUDER_DEPTH : FLT_MAX;
+					if (x > 0 && depth[j - 1] < occluder) testCandidate(scene, ray, j - 1, hit);
+					if (x + 1 < cols && depth[j + 1] < occluder) testCandidate(scene, ray, j + 1, hit);
+					if (y > 0 && depth[j - cols] < occluder) testCandidate(scene, ray, j - cols, hit);
+					if (y + 1 < rows && depth[j + cols] < occluder) testCandidate(scene, ray, j + cols, hit);
+
+					// The part of the ray behind the previous origin plane was never seen, so a
+					// surface there may hide the one found; trace just that part
+					Hit limit;
+					if (hit.tri >= 0) {
+						float side = dot(vec3(seen), ray.getOrigin()) + seen.w;
+						float rate = dot(vec3(seen), ray.getDir());
+						if (side >= 0.0f) {
+							points[j] = ray.getOrigin() + hit.t * ray.getDir();
+							continue;
+						}
+						if (rate > 0.0f)
+							limit.t = glm::min(hit.t, -side / rate);
+						else
+							hit = Hit();
+					}
+					if (hit.tri < 0) traced++;
+					slot[packet.count] = j;
+					found[packet.count] = limit;
+					packet.add(ray);
+				}
+			}
+			if (!packet.count) continue;
+
+			scene.intersect(packet, found);
+			for (int k = 0; k < packet.count; k++) {
+				Hit& hit = hits[slot[k]];
+				if (found[k].tri >= 0)
+					hit = found[k];
+				// The previous points have all landed, so each can be replaced by this frame's
+				if (hit.tri >= 0)
+					points[slot[k]] = packet.origins[k] + hit.t * packet.dirs[k];
+			}
+		}
+	}
+	return traced;
+}
+
+// Number of points landed on pixels x0 .. x1 of rows y0 .. y1
+int Reprojector::landedIn(int x0, int y0, int x1, int y1) const {
+	int stride = cols + 1;
+	return landedSums[(y1 + 1) * stride + x1 + 1] - landedSums[y0 * stride + x1 + 1] -
+		landedSums[(y1 + 1) * stride + x0] + landedSums[y0 * stride + x0];
+}
+
+// Walk from the triangle landed on pixel to the one the ray passes through, keeping its hit if it
+// is closer than hit
+void Reprojector::testCandidate(const TLAS& scene, const Ray& ray, int pixel, Hit& hit) const {
+	int i = landed[pixel];
+	if (i < 0) return;
+	const Hit& candidate = previous[i];
+
+	vec3 orig = ray.getOrigin(), dir = ray.getDir();
+	if (candidate.instance >= 0) {
+		const Instance& inst = scene.getInstances()[candidate.instance];
+		orig = vec3(inst.worldToObject * vec4(orig, 1.0f));
+		dir = vec3(inst.worldToObject * vec4(dir, 0.0f));
+	}
+	BVH::Tri tri;
+	if (!walk(orig, dir, candidate.tri, tri) || (tri.id == hit.tri && candidate.instance == hit.instance)) return;
+
+	Hit local = hit;
+	BVH::intersectTri(orig, dir, tri, local);
+	if (local.t < hit.t) {
+		hit = local;
+		hit.instance = candidate.instance;
+	}
+}
+
+// Step across the edge the ray passes beyond until it passes inside a triangle, by the
+// barycentric coordinates of the ray's point in each triangle's plane. Stores that triangle in
+// t, or returns false when the walk leaves the mesh, takes too long or turns over a silhouette,
+// where the ray could pass through a triangle on the far side.
+bool Reprojector::walk(const vec3& orig, const vec3& dir, int tri, BVH::Tri& t) const {
+	float facing = 0.0f;
+	for (int step = 0; step < REPROJECT_WALK_STEPS; step++) {
+		t = triangle(tri);
+		vec3 pvec = cross(dir, t.e2);
+		float det = dot(t.e1, pvec);
+		if (fabs(det) < 1e-12f || det * facing < 0.0f) return false;
+		facing = det;
+		vec3 tvec = orig - t.v0;
+		float beta = dot(tvec, pvec) / det;
+		float gamma = dot(dir, cross(tvec, t.e1)) / det;
+		float alpha = 1.0f - beta - gamma;
+		if (alpha >= 0.0f && beta >= 0.0f && gamma >= 0.0f) return true;
+
+		// Leave across the edge opposite the most negative coordinate
+		int edge = alpha < glm::min(beta, gamma) ? 1 : (beta < gamma ? 2 : 0);
+		tri = adjacency[tri + edge];
+		if (tri < 0) return false;
+	}
+	return false;
+}
+
+// Same vertices and edges as the BVH's copy, so the test matches traversal exactly
+BVH::Tri Reprojector::triangle(int tri) const {
+	const vector<vec3>& v = mesh->raw_vertices;
+	const vector<unsigned int>& el = mesh->v_elements;
+	BVH::Tri t;
+	t.v0 = v[el[tri]];
+	t.e1 = v[el[tri + 1]] - t.v0;
+	t.e2 = v[el[tri + 2]] - t.v0;
+	t.id = tri;
+	return t;
+}
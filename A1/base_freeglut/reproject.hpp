@@ -0,0 +1,99 @@
+#ifndef REPROJECT_HPP
+#define REPROJECT_HPP
+
+#include <vector>
+#include <cfloat>
+#include <glm/glm.hpp>
+#include "bvh.hpp"
+#include "tlas.hpp"
+#include "glc.hpp"
+#include "meshdata.hpp"
+#include "render.hpp"
+
+// Consecutive frames of an orbiting camera see nearly the same surfaces. Every frame keeps the
+// triangle and the point hit through each pixel; the next frame projects those points into the
+// new camera, onto the nearest pixel sample, the closest point winning. A pixel then starts from
+// the triangle that landed on it, and from closer ones landed next to it, and walks the mesh
+// across shared edges toward the triangle its own ray passes through, which also finds
+// triangles smaller than a pixel that no point landed on. Pixels are traced through the scene
+// where no walk ends in a hit, near the border and wherever surfaces may have been disoccluded;
+// pixels far from every landed point keep missing. A surface that moves in front of a reused
+// triangle without having been visible is missed, so every refreshInterval-th frame traces the
+// whole image to bound the error.
+class Reprojector {
+public:
+	// refreshInterval = 1 traces every frame in full
+	Reprojector(int refreshInterval = 16);
+
+	// Find the triangles adjacent to each triangle of the mesh whose copies make up the scene
+	void setMesh(const MeshData& mesh);
+	// Drop the previous frame, e.g. after the scene changed; the next frame is traced in full
+	void reset() { valid = false; }
+
+	// Render a rows x cols image of scene, whose instances are copies of the mesh, into pixels
+	// (row-major) as renderFrame does, reusing the previous frame's hits where they still hold
+	template <class Shade, class Pixel>
+	void render(const TLAS& scene, const GeneralLinearCamera& cam, CameraKind kind,
+		int rows, int cols, int packetSize, Shade shade, Pixel* pixels) {
+		trace(scene, cam, kind, rows, cols, packetSize);
+		for (int i = 0; i < rows * cols; i++)
+			pixels[i] = shade(hits[i]);
+	}
+
+	// Frames rendered and pixels traced through the scene since the last resetStats
+	int getFrames() const { return frames; }
+	int getFullFrames() const { return fullFrames; }
+	long long getPixels() const { return pixelCount; }
+	long long getTracedPixels() const { return tracedPixels; }
+	void resetStats();
+
+protected:
+	// Range of the motion of points across the image, in pixels
+	struct TileMotion {
+		glm::vec2 lo, hi;	// Bounds of the motion vectors, lo > hi while empty
+		float far;			// Largest distance moved, FLT_MAX if a point passed behind the origins
+		TileMotion() : lo(FLT_MAX), hi(-FLT_MAX), far(0.0f) {}
+		void add(const glm::vec2& moved) {
+			lo = glm::min(lo, moved);
+			hi = glm::max(hi, moved);
+			far = glm::max(far, glm::length(moved));
+		}
+		void add(const TileMotion& other) {
+			lo = glm::min(lo, other.lo);
+			hi = glm::max(hi, other.hi);
+			far = glm::max(far, other.far);
+		}
+	};
+
+	void trace(const TLAS& scene, const GeneralLinearCamera& cam, CameraKind kind, int rows, int cols, int packetSize);
+	int reproject(const TLAS& scene, const GeneralLinearCamera& cam, int packetSize);
+	int landedIn(int x0, int y0, int x1, int y1) const;
+	void testCandidate(const TLAS& scene, const Ray& ray, int pixel, Hit& hit) const;
+	bool walk(const glm::vec3& orig, const glm::vec3& dir, int tri, BVH::Tri& t) const;
+	BVH::Tri triangle(int tri) const;
+
+	const MeshData* mesh;
+	// Triangle across edges v0v1, v1v2 and v2v0 of each triangle, by element index as in Hit::tri,
+	// -1 on open edges
+	std::vector<int> adjacency;
+	int refreshInterval;
+	int sinceRefresh;			// Frames reprojected since the last full one
+	bool valid;					// Whether the history holds the previous frame
+	int rows, cols;
+	std::vector<Hit> hits;			// Hits of the frame being rendered
+	std::vector<Hit> previous;		// Hits of the previous frame while reprojecting
+	std::vector<glm::vec3> points;	// Point hit through each pixel of the previous frame, in scene space
+	std::vector<float> depth;		// Ray parameter of the point landed on each pixel
+	std::vector<int> landed;		// Previous pixel whose point landed on each pixel, -1 for none, -2
+									// where only points now behind the origins did
+	std::vector<int> landedSums;	// Summed-area table of landed points
+	std::vector<TileMotion> motion;	// Motion of the points that left or reached each tile
+	std::vector<int> gaps;			// Distance from landed points beyond which a tile's pixels miss, -1 if none
+	std::vector<int> borders;		// Distance from the image border within which a tile's pixels are traced
+	glm::vec4 seen;					// Side of the previous origin plane its rays went to, positive
+
+	int frames, fullFrames;
+	long long pixelCount, tracedPixels;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "texstream.hpp"
+#include <vector>
+#include <stdexcept>
+using namespace std;
+using namespace glm;
+
+TextureStream::TextureStream() :
+	texture(0), next(0), width(0), height(0), mapped(false) {
+	for (int i = 0; i < BUFFER_COUNT; i++) {
+		pbos[i] = 0;
+		fences[i] = 0;
+	}
+}
+
+void TextureStream::init(int width, int height, const u8vec4& clearColor) {
+	release();
+	this->width = width;
+	this->height = height;
+
+	// RGBA rows are always 4-byte aligned, so uploads stay on the driver's fast path
+	vector<u8vec4> clear(width * height, clearColor);
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, clear.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	// Filtered when a reduced render resolution is stretched over the window
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenBuffers(BUFFER_COUNT, pbos);
+	for (int i = 0; i < BUFFER_COUNT; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, width * height * sizeof(u8vec4), NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	next = 0;
+}
+
+void TextureStream::release() {
+	if (mapped) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[next]);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		mapped = false;
+	}
+	for (int i = 0; i < BUFFER_COUNT; i++) {
+		if (fences[i]) { glDeleteSync(fences[i]); fences[i] = 0; }
+	}
+	if (pbos[0]) { glDeleteBuffers(BUFFER_COUNT, pbos); pbos[0] = pbos[1] = 0; }
+	if (texture) { glDeleteTextures(1, &texture); texture = 0; }
+}
+
+u8vec4* TextureStream::map() {
+	if (mapped)
+		throw runtime_error("TextureStream::map() - buffer already mapped");
+
+	// The copy issued the last time this buffer was uploaded must be done before
+	// it is overwritten; with two buffers that was a whole frame ago, so this rarely waits
+	if (fences[next]) {
+		while (glClientWaitSync(fences[next], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fences[next]);
+		fences[next] = 0;
+	}
+
+	// The fence already guarantees the GPU is done, so skip the driver's own synchronization
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[next]);
+	void* ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, width * height * sizeof(u8vec4),
+		GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!ptr)
+		throw runtime_error("TextureStream::map() - could not map pixel buffer");
+	mapped = true;
+	return (u8vec4*)ptr;
+}
+
+void TextureStream::upload() {
+	if (!mapped)
+		throw runtime_error("TextureStream::upload() - no buffer mapped");
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[next]);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	mapped = false;
+
+	// Sourced from the bound buffer, the copy runs asynchronously and returns at once
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	fences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	next = (next + 1) % BUFFER_COUNT;
+}
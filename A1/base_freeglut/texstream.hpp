@@ -0,0 +1,47 @@
+#ifndef TEXSTREAM_HPP
+#define TEXSTREAM_HPP
+
+#include <glm/glm.hpp>
+#include "gl_core_3_3.h"
+
+// RGBA8 texture fed from the CPU through two pixel buffer objects. Frame N+1 is
+// written into one mapped buffer while the GPU still copies frame N out of the other
+// into the texture; a fence per buffer tells when its copy has finished.
+class TextureStream {
+public:
+	TextureStream();
+	~TextureStream() { release(); }
+
+	// (Re)create the texture and buffers for width x height pixels
+	void init(int width, int height, const glm::u8vec4& clearColor);
+	void release();
+
+	// Map the next buffer for writing, waiting only if the GPU is still reading it.
+	// Rows are width pixels, bottom row first.
+	glm::u8vec4* map();
+	// Unmap the buffer returned by map() and start copying it into the texture
+	void upload();
+
+	GLuint getTexture() const { return texture; }
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	static const int BUFFER_COUNT = 2;
+
+protected:
+	GLuint texture;
+	GLuint pbos[BUFFER_COUNT];
+	GLsync fences[BUFFER_COUNT];	// Set once the texture copy out of the buffer was issued
+	int next;						// Buffer handed out by the next map()
+	int width, height;
+	bool mapped;
+
+private:
+	// Disallow copy and move
+	TextureStream(const TextureStream& other);
+	TextureStream(TextureStream&& other);
+	TextureStream& operator=(const TextureStream& other);
+	TextureStream& operator=(TextureStream&& other);
+};
+
+#endif
@@ -0,0 +1,299 @@
+#include "tlas.hpp"
+#include "raystats.hpp"
+#include <algorithm>
+using namespace std;
+using namespace glm;
+
+// Traversal stacks hold 64 entries, deeper trees are rebuilt balanced
+const int TLAS_MAX_DEPTH = 60;
+
+// Helper functions
+static float boxArea(const vec3& bbMin, const vec3& bbMax) {
+	vec3 e = bbMax - bbMin;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// Whether the ray enters the box before tMax
+static bool hitsBox(const vec3& bbMin, const vec3& bbMax, const vec3& orig, const vec3& invDir, float tMax) {
+	float tNear, tFar;
+	return slabInterval(bbMin, bbMax, orig, invDir, tNear, tFar) && tNear < tMax && tFar > 0.0f;
+}
+
+// Rays of the packet that miss the box, for statistics only
+static int packetMisses(const vec3& bbMin, const vec3& bbMax, const RayPacket& packet, const Hit* hits) {
+	int misses = 0;
+	for (int r = 0; r < packet.count; r++)
+		if (!hitsBox(bbMin, bbMax, packet.origins[r], packet.invDirs[r], hits[r].t)) misses++;
+	return misses;
+}
+
+int TLAS::addInstance(const BVH* blas, const mat4& objectToWorld) {
+	Instance inst;
+	inst.blas = blas;
+	inst.objectToWorld = objectToWorld;
+	inst.worldToObject = inverse(objectToWorld);
+	updateBounds(inst);
+	instances.push_back(inst);
+	int instIdx = instances.size() - 1;
+
+	Node leaf;
+	leaf.bbMin = inst.bbMin;
+	leaf.bbMax = inst.bbMax;
+	leaf.left = leaf.right = -1;
+	leaf.parent = -1;
+	leaf.instance = instIdx;
+	nodes.push_back(leaf);
+	int leafIdx = nodes.size() - 1;
+	leafOf.push_back(leafIdx);
+
+	if (root == -1) {
+		root = leafIdx;
+		return instIdx;
+	}
+
+	// Descend towards the child whose bounds grow least when the new box is added
+	int sibling = root;
+	int depth = 1;
+	while (nodes[sibling].left != -1) {
+		const Node& node = nodes[sibling];
+		const Node& l = nodes[node.left];
+		const Node& r = nodes[node.right];
+		float growL = boxArea(min(l.bbMin, inst.bbMin), max(l.bbMax, inst.bbMax)) - boxArea(l.bbMin, l.bbMax);
+		float growR = boxArea(min(r.bbMin, inst.bbMin), max(r.bbMax, inst.bbMax)) - boxArea(r.bbMin, r.bbMax);
+		sibling = growL <= growR ? node.left : node.right;
+		depth++;
+	}
+
+	// Pair the new leaf with the sibling under a fresh interior node
+	Node pair;
+	pair.left = sibling;
+	pair.right = leafIdx;
+	pair.parent = nodes[sibling].parent;
+	pair.instance = -1;
+	nodes.push_back(pair);
+	int pairIdx = nodes.size() - 1;
+
+	if (pair.parent == -1)
+		root = pairIdx;
+	else if (nodes[pair.parent].left == sibling)
+		nodes[pair.parent].left = pairIdx;
+	else
+		nodes[pair.parent].right = pairIdx;
+	nodes[sibling].parent = pairIdx;
+	nodes[leafIdx].parent = pairIdx;
+
+	refit(pairIdx);
+	if (depth >= TLAS_MAX_DEPTH)
+		rebuild();
+	return instIdx;
+}
+
+void TLAS::setTransform(int instance, const mat4& objectToWorld) {
+	Instance& inst = instances[instance];
+	inst.objectToWorld = objectToWorld;
+	inst.worldToObject = inverse(objectToWorld);
+	updateBounds(inst);
+
+	Node& leaf = nodes[leafOf[instance]];
+	leaf.bbMin = inst.bbMin;
+	leaf.bbMax = inst.bbMax;
+	if (leaf.parent != -1)
+		refit(leaf.parent);
+}
+
+void TLAS::refitInstances(const BVH* blas) {
+	for (size_t i = 0; i < instances.size(); i++)
+		if (instances[i].blas == blas)
+			setTransform(i, instances[i].objectToWorld);
+}
+
+void TLAS::rebuild() {
+	nodes.clear();
+	root = -1;
+	if (instances.empty()) return;
+
+	vector<int> order(instances.size());
+	for (int i = 0; i < order.size(); i++) order[i] = i;
+	nodes.reserve(2 * instances.size() - 1);
+	root = build(order, 0, order.size(), -1);
+}
+
+void TLAS::clear() {
+	instances.clear();
+	nodes.clear();
+	leafOf.clear();
+	root = -1;
+}
+
+// World bounds are the transformed corners of the bottom-level root box
+void TLAS::updateBounds(Instance& inst) {
+	const BVH::Node& blasRoot = inst.blas->getNodes()[0];
+	inst.bbMin = vec3(numeric_limits<float>::max());
+	inst.bbMax = vec3(numeric_limits<float>::lowest());
+	for (int c = 0; c < 8; c++) {
+		vec3 corner((c & 1) ? blasRoot.bbMax.x : blasRoot.bbMin.x,
+			(c & 2) ? blasRoot.bbMax.y : blasRoot.bbMin.y,
+			(c & 4) ? blasRoot.bbMax.z : blasRoot.bbMin.z);
+		vec3 p = vec3(inst.objectToWorld * vec4(corner, 1.0f));
+		inst.bbMin = min(inst.bbMin, p);
+		inst.bbMax = max(inst.bbMax, p);
+	}
+}
+
+// Recompute the bounds of nodeIdx and every node above it
+void TLAS::refit(int nodeIdx) {
+	while (nodeIdx != -1) {
+		Node& node = nodes[nodeIdx];
+		node.bbMin = min(nodes[node.left].bbMin, nodes[node.right].bbMin);
+		node.bbMax = max(nodes[node.left].bbMax, nodes[node.right].bbMax);
+		nodeIdx = node.parent;
+	}
+}
+
+// Median split of the instance centroids along the widest axis; instance counts are small
+int TLAS::build(vector<int>& order, int first, int count, int parent) {
+	Node node;
+	node.parent = parent;
+	node.bbMin = vec3(numeric_limits<float>::max());
+	node.bbMax = vec3(numeric_limits<float>::lowest());
+	vec3 cMin(numeric_limits<float>::max()), cMax(numeric_limits<float>::lowest());
+	for (int i = first; i < first + count; i++) {
+		const Instance& inst = instances[order[i]];
+		node.bbMin = min(node.bbMin, inst.bbMin);
+		node.bbMax = max(node.bbMax, inst.bbMax);
+		cMin = min(cMin, (inst.bbMin + inst.bbMax) * 0.5f);
+		cMax = max(cMax, (inst.bbMin + inst.bbMax) * 0.5f);
+	}
+	nodes.push_back(node);
+	int nodeIdx = nodes.size() - 1;
+
+	if (count == 1) {
+		nodes[nodeIdx].left = nodes[nodeIdx].right = -1;
+		nodes[nodeIdx].instance = order[first];
+		leafOf[order[first]] = nodeIdx;
+		return nodeIdx;
+	}
+
+	vec3 extent = cMax - cMin;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	int half = count / 2;
+	nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+		[&](int a, int b) {
+			return instances[a].bbMin[axis] + instances[a].bbMax[axis] < instances[b].bbMin[axis] + instances[b].bbMax[axis];
+		});
+
+	int left = build(order, first, half, nodeIdx);
+	int right = build(order, first + half, count - half, nodeIdx);
+	nodes[nodeIdx].left = left;
+	nodes[nodeIdx].right = right;
+	nodes[nodeIdx].instance = -1;
+	return nodeIdx;
+}
+
+// The direction is transformed but not renormalized, so distances stay in world units
+bool TLAS::intersectInstance(const Instance& inst, const Ray& ray, Hit& hit) const {
+	Ray local(vec3(inst.worldToObject * vec4(ray.getOrigin(), 1.0f)),
+		vec3(inst.worldToObject * vec4(ray.getDir(), 0.0f)));
+	Hit localHit = hit;
+	inst.blas->intersect(local, localHit, false);
+	if (localHit.t >= hit.t) return false;
+	hit = localHit;
+	hit.instance = &inst - instances.data();
+	return true;
+}
+
+bool TLAS::intersect(const Ray& ray, Hit& hit) const {
+	if (root == -1) return false;
+
+	vec3 orig = ray.getOrigin();
+	vec3 invDir = 1.0f / ray.getDir();
+	bool found = false;
+
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = root;
+	while (sp > 0) {
+		const Node& node = nodes[stack[--sp]];
+		COUNT_RAY_STAT(nodeVisits, 1);
+		if (!hitsBox(node.bbMin, node.bbMax, orig, invDir, hit.t)) {
+			COUNT_RAY_STAT(culledRays, &node == &nodes[root]);
+			continue;
+		}
+		if (node.instance != -1) {
+			found |= intersectInstance(instances[node.instance], ray, hit);
+			continue;
+		}
+		stack[sp++] = node.right;
+		stack[sp++] = node.left;
+	}
+	return found;
+}
+
+// Top level per ray, then each instance leaf traces the rays that reach it as one packet
+// through the shared bottom-level BVH
+void TLAS::intersect(const RayPacket& packet, Hit* hits) const {
+	if (root == -1 || packet.count == 0) return;
+	COUNT_RAY_STAT(culledRays, packetMisses(nodes[root].bbMin, nodes[root].bbMax, packet, hits));
+
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = root;
+	while (sp > 0) {
+		const Node& node = nodes[stack[--sp]];
+		COUNT_RAY_STAT(nodeVisits, 1);
+		bool any = false;
+		for (int r = 0; r < packet.count && !any; r++)
+			any = hitsBox(node.bbMin, node.bbMax, packet.origins[r], packet.invDirs[r], hits[r].t);
+		if (!any) continue;
+
+		if (node.instance == -1) {
+			stack[sp++] = node.right;
+			stack[sp++] = node.left;
+			continue;
+		}
+
+		const Instance& inst = instances[node.instance];
+		RayPacket local;
+		Hit localHits[RayPacket::MAX_RAYS];
+		for (int r = 0; r < packet.count; r++) {
+			local.add(Ray(vec3(inst.worldToObject * vec4(packet.origins[r], 1.0f)),
+				vec3(inst.worldToObject * vec4(packet.dirs[r], 0.0f))));
+			localHits[r] = hits[r];
+		}
+		inst.blas->intersect(local, localHits, false);
+		for (int r = 0; r < packet.count; r++) {
+			if (localHits[r].t < hits[r].t) {
+				hits[r] = localHits[r];
+				hits[r].instance = node.instance;
+			}
+		}
+	}
+}
+
+// The query is moved into each instance's space, where n . p + w = 0 becomes
+// transpose(objectToWorld) * (n, w), and the cut points are moved back out
+void TLAS::intersectPlane(const PlaneQuery& query, vector<PlaneSegment>& segments) const {
+	if (root == -1) return;
+
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = root;
+	while (sp > 0) {
+		const Node& node = nodes[stack[--sp]];
+		if (!boxInQuery(node.bbMin, node.bbMax, query)) continue;
+		if (node.instance == -1) {
+			stack[sp++] = node.right;
+			stack[sp++] = node.left;
+			continue;
+		}
+
+		const Instance& inst = instances[node.instance];
+		size_t first = segments.size();
+		inst.blas->intersectPlane(query.transformed(inst.objectToWorld), segments);
+		for (size_t i = first; i < segments.size(); i++) {
+			segments[i].p0 = vec3(inst.objectToWorld * vec4(segments[i].p0, 1.0f));
+			segments[i].p1 = vec3(inst.objectToWorld * vec4(segments[i].p1, 1.0f));
+			segments[i].instance = node.instance;
+		}
+	}
+}
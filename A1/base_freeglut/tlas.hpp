@@ -0,0 +1,65 @@
+#ifndef TLAS_HPP
+#define TLAS_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "ray.hpp"
+#include "bvh.hpp"
+
+// Copy of a mesh placed in the scene by a transform
+struct Instance {
+	const BVH* blas;			// Bottom-level BVH in object space, shared by every copy of the mesh
+	glm::mat4 objectToWorld;
+	glm::mat4 worldToObject;
+	glm::vec3 bbMin, bbMax;		// World-space bounds
+};
+
+// Two-level acceleration structure: a top-level BVH over instance bounds whose leaves
+// point into shared bottom-level BVHs. Rays are moved into instance space at the leaves,
+// so memory grows with the unique meshes and not with the number of copies.
+class TLAS {
+public:
+	TLAS() : root(-1) {}
+
+	// Place a copy of blas in the scene and return its index. The new leaf goes next to the
+	// subtree whose bounds grow least, so only the nodes above it are refit.
+	int addInstance(const BVH* blas, const glm::mat4& objectToWorld);
+	// Move an instance, refitting the nodes above it
+	void setTransform(int instance, const glm::mat4& objectToWorld);
+	// Refit the copies of blas after its own bounds changed, as BVH::refit changes them
+	void refitInstances(const BVH* blas);
+	// Rebuild the top level from scratch, e.g. after many insertions degraded it
+	void rebuild();
+	void clear();
+
+	// Closest hit over all instances, hit.instance tells which copy was hit
+	bool intersect(const Ray& ray, Hit& hit) const;
+	void intersect(const RayPacket& packet, Hit* hits) const;
+	// Segments where the query plane cuts the instances, in world space and tagged with their instance
+	void intersectPlane(const PlaneQuery& query, std::vector<PlaneSegment>& segments) const;
+
+	const std::vector<Instance>& getInstances() const { return instances; }
+
+	// Top-level node, leaves hold a single instance
+	struct Node {
+		glm::vec3 bbMin;
+		int left;		// Children, -1 for a leaf
+		glm::vec3 bbMax;
+		int right;
+		int parent;		// -1 for the root
+		int instance;	// -1 for an interior node
+	};
+
+protected:
+	void updateBounds(Instance& inst);
+	void refit(int nodeIdx);
+	int build(std::vector<int>& order, int first, int count, int parent);
+	bool intersectInstance(const Instance& inst, const Ray& ray, Hit& hit) const;
+
+	std::vector<Instance> instances;
+	std::vector<Node> nodes;
+	std::vector<int> leafOf;	// Leaf node of every instance
+	int root;
+};
+
+#endif
@@ -6,11 +6,16 @@
 #include "gl_core_3_3.h"
 #include <GL/freeglut.h>
 #include <cmath>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 // #define STB_IMAGE_WRITE_IMPLEMENTATION
 // #include "stb_image_write.h"
 #include "util.hpp"
+#include "summedarea.hpp"
 // #include "mesh.hpp"
 using namespace std;
 using namespace glm;
@@ -27,6 +32,7 @@ GLsizei vcount;			// Number of vertices
 // Mesh* mesh;				// Mesh loaded from .obj file
 GLint uRenderDiscLoc;
 GLint uSigma;
+GLint uPointScale;		// Shader location of the splat size in pixels at clip w = 1
 GLint alpha;
 vec2 imgRange;
 
@@ -38,9 +44,17 @@ vec2 camOrigin;			// Original camera coordinates upon clicking
 vec2 mouseOrigin;		// Original mouse coordinates upon clicking
 
 // ADDED BY MASHIAT
-const int gridSize = 64;
-vector<GLfloat> points;
-vector<GLfloat> colors;
+int gridSize;			// Points along the longer side of the image, up to one per pixel
+vec2 pointGrid;			// Points along x and y of the current grid
+bool benchmarkPending;	// --bench given, benchmark and exit once the first frame is shown
+
+// Point sent to the GPU, color in 8 bits per channel
+struct Splat {
+	vec3 pos;
+	u8vec4 color;
+};
+vector<Splat> points;
+SummedAreaTable imageSums[2];	// Integral images of imageA.png and imageB.png, summed when first shown
 int pointCount;
 int imageWidth, imageHeight;
 int channels;
@@ -54,6 +68,11 @@ const int MENU_EXIT = 1;			// Exit application
 const int VIEWMODE_SQUARE = 0;	
 const int VIEWMODE_DISC = 1;			
 const int VIEWMODE_GAUSS = 2;
+const char* VIEWMODE_NAMES[] = { "square", "disc", "gaussian" };
+// Splat diameter over the grid spacing: squares tile the plane, discs are drawn around their
+// square and Gaussians reach past their neighbours' centers
+const float SPLAT_SCALE[] = { 1.0f, 1.42f, 2.0f };
+const double BENCHMARK_MS = 500.0;	// Drawing time per mode in benchmarkSplats
 
 // Initialization functions
 void initState();
@@ -61,7 +80,10 @@ void initGLUT(int* argc, char** argv);
 void initOpenGL();
 void initTriangle();
 void initPoints();
-unsigned char* initImage();
+void cameraTransforms(mat4& proj, mat4& xform);
+void drawPoints(unsigned int mode);
+void benchmarkSplats();
+const SummedAreaTable& initImage();
 
 // Callback functions
 void display();
@@ -72,6 +94,7 @@ void keyPressed(unsigned char key, int x, int y);
 void mouseBtn(int button, int state, int x, int y);
 void mouseMove(int x, int y);
 void idle();
+void benchmarkAndExit(int value);
 void menu(int cmd);
 void cleanup();
 
@@ -86,6 +109,17 @@ int main(int argc, char** argv) {
 		initGLUT(&argc, argv);
 		initOpenGL();
 		// initTriangle();
+
+		// Options left after GLUT took its own
+		for (int i = 1; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--grid" && i + 1 < argc)
+				gridSize = atoi(argv[++i]);
+			else if (arg == "--bench")
+				benchmarkPending = true;
+			else
+				throw runtime_error("Unknown option: " + arg + " (use --grid N, --bench)");
+		}
 		initPoints();
 	} catch (const exception& e) {
 		// Handle any errors
@@ -113,6 +147,9 @@ void initState() {
 	vcount = 0;
 	uRenderDiscLoc = 0;
 	uSigma = 0;
+	uPointScale = 0;
+	gridSize = 64;
+	benchmarkPending = false;
 	alpha = 0.1;
 	imgRange = vec2(32.0f, 32.0f);
 
@@ -177,6 +214,9 @@ void initOpenGL() {
 	uRenderDiscLoc = glGetUniformLocation(shader, "uRenderDisc");
 
 	uSigma = glGetUniformLocation(shader, "sigma");
+	uPointScale = glGetUniformLocation(shader, "pointScale");
+	// Splat sizes follow the grid spacing and the camera distance, set per point by the shader
+	glEnable(GL_PROGRAM_POINT_SIZE);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
@@ -216,133 +256,83 @@ void initTriangle() {
 vec2 determineGridSize()
 {
 	std::cout << "image width and height: " << imageWidth << ", " << imageHeight << std::endl;
+	// At most one point per pixel, and two along each side to span the grid
+	gridSize = glm::clamp(gridSize, 2, glm::max(2, glm::max(imageWidth, imageHeight)));
 	if(imageWidth == imageHeight) return vec2(gridSize, gridSize);
-	if(imageWidth > imageHeight) return vec2(gridSize, ceil(1.0 * imageHeight * gridSize / imageWidth));
-	return vec2(ceil(1.0 * imageWidth * gridSize / imageHeight), gridSize);
+	if(imageWidth > imageHeight) return vec2(gridSize, glm::max(2.0, ceil(1.0 * imageHeight * gridSize / imageWidth)));
+	return vec2(glm::max(2.0, ceil(1.0 * imageWidth * gridSize / imageHeight)), gridSize);
 }
 
 void initPoints()
 {
-	unsigned char* imageData = initImage();
+	const SummedAreaTable& sums = initImage();
 	points.clear();
-	colors.clear();
-	// Save the image as JPG
-	// stbi_write_jpg("output_image.jpg", imageWidth, imageHeight, channels, imageData, 100); // Quality set to 100
 	vec2 grid = determineGridSize();
-	
-	int imageWidthPerPoint = imageWidth / grid.y;
-	int imageHeightPerPoint = imageHeight / grid.x;
 
-	std::cout << "per point width and height: " << imageWidthPerPoint << ", " << imageHeightPerPoint << std::endl; 
+	// Cells split the whole image, so their sizes differ by at most a pixel and no border is cropped
+	std::cout << "per point width and height: " << 1.0 * imageWidth / grid.x << ", " << 1.0 * imageHeight / grid.y << std::endl;
 
 	if(debug == false){
 		std::cout << "Grid size: " << grid.x << ", " << grid.y << std::endl;
 	}
 
-	if(channels < 3 && channels > 4){
-		std::cout << "Channels: " << channels << std::endl;
-		std::cout << "Code does not work for channels less than three";
-		exit(1);
-	}
-	std::cout << "Number of channels: " << channels << std::endl;
-
-	for(int i = 0 ; (i < imageWidth) && ( (i/imageWidthPerPoint) < grid.x); i = i + imageWidthPerPoint){
-		for(int j = 0 ; (j < imageHeight) && ((j/imageHeightPerPoint) < grid.y); j = j + imageHeightPerPoint){
- 			
-			float avgColor[4] = {0, 0, 0, 0};
-			int count = 0;
-			// std::cout << std::endl;
-			for(int l = j; l < j + imageHeightPerPoint && l < imageHeight; l = l + 1 ){
-				for(int k = i ; k < i + imageWidthPerPoint && k < imageWidth; k = k + 1 ){
-					// Calculate the index for the current pixel
-					int actualRow = imageHeight - 1 - l;  // Invert Y-axis
-					int index = (actualRow * imageWidth + k) * channels;
-
-					// int actualCol = imageWidth - 1 - k;
-					// int index = ( actualCol * imageHeight + l) * channels;
-					// std::cout << index << std::endl;
-					// Accumulate the pixel's color channels
-					avgColor[0] += imageData[index];       // Red
-					avgColor[1] += imageData[index + 1];   // Green
-					avgColor[2] += imageData[index + 2];   // Blue
-					if(channels == 4){
-						avgColor[3] += imageData[index + 3];
-					}
-
-					++count;
-				
-				}	
-				
-			}
-
-			// Calculate the average color
-			if (count > 0) {
-				
-				colors.push_back(avgColor[0] * 1.0 / count);
-				colors.push_back(avgColor[1] * 1.0 / count);
-				colors.push_back(avgColor[2] * 1.0 / count);
-				if(channels == 3){
-					colors.push_back(255);
-				}
-				else{
-					colors.push_back(avgColor[3] * 1.0 / count);
-
-				}
-
-				
-        	}
-		}
-	}
 	if(grid.x > grid.y) imgRange.y = int( grid.y * imgRange.x / grid.x );
 	else if(grid.y > grid.x) imgRange.x = int( grid.x * imgRange.y / grid.y );
-	// Generate the p oints for a 64x64 grid
-	int colorIndex = 0;
-	for (int i = 0; i < grid.x; ++i) {
-		for (int j = 0; j < grid.y; ++j) {
+	// Generate the points, each colored by the average of its cell of the image, which the
+	// summed-area table gives in four lookups however large the cell. Points are stored row by
+	// row like the table, so neighbouring lookups share cache lines, and rows of the grid are
+	// filled on every hardware thread.
+	auto start = chrono::steady_clock::now();
+	pointGrid = grid;
+	int columns = grid.x, rows = grid.y;
+	points.resize((size_t)columns * rows);
+	int threads = glm::min(rows, glm::max(1, (int)thread::hardware_concurrency()));
+	parallelFor(threads, [&](int t) {
+		for (int j = rows * t / threads; j < rows * (t + 1) / threads; ++j) {
 			// Normalize the grid coordinates to be between -1.0 and 1.0
-			GLfloat x = (2.0f * imgRange.x * i) / (grid.x - 1) - imgRange.x;  // x goes from -1.0 to 1.0
 			GLfloat y = (2.0f * imgRange.y * j) / (grid.y - 1) - imgRange.y;  // y goes from -1.0 to 1.0
-			points.push_back(x);
-			points.push_back(y);
-			points.push_back(pointsZ);  // z is 0 for a flat grid
-
-			// color
-			
-			points.push_back(colors[colorIndex++] / 255.0);  // R
-			points.push_back(colors[colorIndex++] / 255.0);  // G
-			points.push_back(colors[colorIndex++] / 255.0);  // B
-			points.push_back(colors[colorIndex++] / 255.0);
-			// points.push_back(imageData[colorIndex++] / 255.0);  // R
-			// points.push_back(imageData[colorIndex++] / 255.0);  // G
-			// points.push_back(imageData[colorIndex++] / 255.0);  // B
+			int y0 = (int)((int64_t)j * imageHeight / rows), y1 = (int)((int64_t)(j + 1) * imageHeight / rows);
+			Splat* row = &points[(size_t)j * columns];
+			for (int i = 0; i < columns; ++i) {
+				GLfloat x = (2.0f * imgRange.x * i) / (grid.x - 1) - imgRange.x;  // x goes from -1.0 to 1.0
+				row[i].pos = vec3(x, y, pointsZ);  // z is 0 for a flat grid
+
+				// color, rows counted from the bottom of the image like j
+				int x0 = (int)((int64_t)i * imageWidth / columns), x1 = (int)((int64_t)(i + 1) * imageWidth / columns);
+				vec4 color = sums.average(x0, y0, x1, y1);
+				row[i].color = u8vec4(color + 0.5f);
+			}
 		}
-	}
-
-	pointCount = grid.x * grid.y;
-	stbi_image_free(imageData);
+	});
+	pointCount = points.size();
+	double buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
 
 	// Enable blending for transparency
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	glGenBuffers(1, &vbuf);
-	glGenVertexArrays(1, &vao);
+	// The buffer and vertex array are made once and refilled for every grid
+	if (!vbuf) glGenBuffers(1, &vbuf);
+	if (!vao) glGenVertexArrays(1, &vao);
 
 	// Bind the VAO (Vertex Array Object)
 	glBindVertexArray(vao);
 
 	// Bind the VBO (Vertex Buffer Object) and upload the point data
+	start = chrono::steady_clock::now();
 	glBindBuffer(GL_ARRAY_BUFFER, vbuf);
-	glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(GLfloat), points.data(), GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(Splat), points.data(), GL_DYNAMIC_DRAW);
 
 	// Define the vertex attribute (position) layout
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (void*)0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Splat), (void*)0);
 	glEnableVertexAttribArray(0);
-	// Enable the color attribute (location = 1)
-	glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (void*)(3 * sizeof(GLfloat)));  // Color attribute
+	// Enable the color attribute (location = 1), bytes normalized to [0, 1]
+	glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Splat), (void*)sizeof(vec3));  // Color attribute
 	glEnableVertexAttribArray(1);
-	// glPointSize(1.0f * width / gridSize);
-	glPointSize(20.0f);
+	glFinish();
+	double uploadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	std::cout << "Colored " << pointCount << " points in " << buildMs << " ms on " << threads
+		<< " threads, uploaded " << points.size() * sizeof(Splat) / 1048576.0 << " MB in " << uploadMs << " ms" << std::endl;
 
 	// Unbind the VAO
 	glBindVertexArray(0);
@@ -351,30 +341,27 @@ void initPoints()
 
 
 
-unsigned char* initImage()
+const SummedAreaTable& initImage()
 {
-	unsigned char* imageData;
-	if(imagemode == 0) imageData = stbi_load("imageA.png", &imageWidth, &imageHeight, &channels, 0);
-	else imageData = stbi_load("imageB.png", &imageWidth, &imageHeight, &channels, 0);
-
-	if (!imageData) {
-		std::cerr << "Failed to load image!" << std::endl;
-		return 0;
+	// Each image is loaded and summed once; showing it again only regrids it
+	SummedAreaTable& sums = imageSums[imagemode];
+	if (sums.empty())
+	{
+		const char* filename = imagemode == 0 ? "imageA.png" : "imageB.png";
+		unsigned char* imageData = stbi_load(filename, &imageWidth, &imageHeight, &channels, 0);
+		if (!imageData)
+			throw runtime_error(string("Failed to load image: ") + filename);
+
+		auto start = chrono::steady_clock::now();
+		sums.build(imageData, imageWidth, imageHeight, channels);
+		stbi_image_free(imageData);
+		std::cout << "Summed " << filename << " (" << imageWidth << "x" << imageHeight << ", " << channels
+			<< " channels) in " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+			<< " ms" << std::endl;
 	}
-   
-
-	return imageData;
-	// get image width and height, divide by pointGrid size to find out how many pixels of the image should form a point color
-	// int width, height;
-	// unsigned char* imageData = SOIL_load_image("download_64x64.jpg", &imageWidth, &imageHeight, 0, SOIL_LOAD_RGB);
-
-	// if (imageData) {
-	// 	// Use the image data
-	// 	SOIL_free_image_data(imageData);
-	// } else {
-	// 	std::cerr << "Image loading failed!" << std::endl;
-	// }
-	// return imageData;
+	imageWidth = sums.getWidth();
+	imageHeight = sums.getHeight();
+	return sums;
 }
 
 void squash(vec2 P)
@@ -402,76 +389,107 @@ void squash(vec2 P)
 	// }
 
 
-	for( int i = 0 ; i < points.size() ; i += 7 ){
-		// alpha / glm::pow( glm::distance( clickedCoord, vec2(points[i], points[i+1]) ), 2);
-		vec2 tPoint = vec2(points[i], points[i+1]);
-		// std::cout << points[i] << ", " << points[i+1] << std::endl;
-		vec2 result = tPoint - clickedCoord;
-		// std::cout << result.x << ", " << result.y << std::endl;
-		float distance = 0.1 / ( result.x * result.x + result.y * result.y );
-		// std::cout << distance << std::endl;
-		result = tPoint + distance * glm::normalize(result);
-		// std::cout << "Result: " << result.x << ", " << result.y << std::endl;
-		points[i] = result.x;
-		points[i+1] = result.y;
-		// break;
-
-	}
+	// Points are pushed independently, in bands on every hardware thread
+	size_t n = points.size();
+	int threads = glm::max(1, (int)thread::hardware_concurrency());
+	parallelFor(threads, [&](int t) {
+		for( size_t i = n * t / threads ; i < n * (t + 1) / threads ; ++i ){
+			// alpha / glm::pow( glm::distance( clickedCoord, vec2(points[i].pos) ), 2);
+			vec2 tPoint = vec2(points[i].pos);
+			vec2 result = tPoint - clickedCoord;
+			float distance = 0.1 / ( result.x * result.x + result.y * result.y );
+			result = tPoint + distance * glm::normalize(result);
+			points[i].pos.x = result.x;
+			points[i].pos.y = result.y;
+		}
+	});
 
 	// // Bind the VBO (Vertex Buffer Object) and upload the point data
 	glBindBuffer(GL_ARRAY_BUFFER, vbuf);
-	glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(GLfloat), points.data(), GL_STATIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, points.size() * sizeof(Splat), points.data());
 
 	// glutPostRedisplay();
 
 	
 }
 
-void display() {
-	try {
-		// Clear the back buffer
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// Projection and model-to-clip transform of the camera
+void cameraTransforms(mat4& proj, mat4& xform) {
+	float aspect = (float)width / (float)height;
+	// Create perspective projection matrix
+	proj = perspective(fovAngle, aspect, 0.1f, 100.0f);
+	// Create view transformation matrix
+	mat4 view = translate(mat4(1.0f), vec3(0.0, 0.0, -camCoords.z)); 
+	mat4 rot = rotate(mat4(1.0f), radians(camCoords.y), vec3(1.0, 0.0, 0.0));
+	rot = rotate(rot, radians(camCoords.x), vec3(0.0, 1.0, 0.0));
+	xform = proj * view * rot;
+}
 
-		// Get ready to draw
-		glUseProgram(shader);
+// Draw the points as splats of the view mode, with the shader program in use
+void drawPoints(unsigned int mode) {
+	mat4 proj, xform;
+	cameraTransforms(proj, xform);
+	glBindVertexArray(vao);
 
-		mat4 xform;
-		float aspect = (float)width / (float)height;
-		// Create perspective projection matrix
-		mat4 proj = perspective(fovAngle, aspect, 0.1f, 100.0f);
-		// Create view transformation matrix
-		mat4 view = translate(mat4(1.0f), vec3(0.0, 0.0, -camCoords.z)); 
-		mat4 rot = rotate(mat4(1.0f), radians(camCoords.y), vec3(1.0, 0.0, 0.0));
-		rot = rotate(rot, radians(camCoords.x), vec3(0.0, 1.0, 0.0));
-		xform = proj * view * rot;
-		
-		glBindVertexArray(vao);
+	// Send the transformation matrix to the shader
+	glUniformMatrix4fv(uniXform, 1, GL_FALSE, glm::value_ptr(xform));
+	glUniform1f(uSigma, 0.8f);
+	// A splat is its grid spacing times its scale across, which the projection turns into pixels
+	float spacing = 2.0f * imgRange.x / (pointGrid.x - 1);
+	glUniform1f(uPointScale, SPLAT_SCALE[mode] * spacing * proj[1][1] * height * 0.5f);
 
-		// Send the transformation matrix to the shader
-		glUniformMatrix4fv(uniXform, 1, GL_FALSE, glm::value_ptr(xform));
-		glUniform1f(uSigma, 0.8f);
+	switch (mode) {
+	case VIEWMODE_SQUARE:
+		glUniform1i(uRenderDiscLoc, 0);  // Enable disc rendering
+		break;
+	case VIEWMODE_GAUSS:
+		glUniform1i(uRenderDiscLoc, 2);
+		break;
 
+	case VIEWMODE_DISC: {
+		glUniform1i(uRenderDiscLoc, 1);  // Enable disc rendering
+		break; }
+	}
 
+	// Draw points
+	glDrawArrays(GL_POINTS, 0, pointCount);  
 
-		switch (viewmode) {
-		case VIEWMODE_SQUARE:
-			glUniform1i(uRenderDiscLoc, 0);  // Enable disc rendering
-			break;
-		case VIEWMODE_GAUSS:
-			glUniform1i(uRenderDiscLoc, 2);
-			break;
+	// Unbind the VAO
+	glBindVertexArray(0);
+}
 
-		case VIEWMODE_DISC: {
-			glUniform1i(uRenderDiscLoc, 1);  // Enable disc rendering
-			break; }
+void benchmarkSplats() {
+	// Draw the grid in every mode for BENCHMARK_MS each, waiting for the GPU after every frame
+	std::cout << "Benchmark: " << pointCount << " splats in a " << width << "x" << height << " window" << std::endl;
+	glUseProgram(shader);
+	for (unsigned int mode = 0; mode < 3; mode++) {
+		int frames = 0;
+		double ms = 0.0;
+		glFinish();
+		auto start = chrono::steady_clock::now();
+		while (ms < BENCHMARK_MS || frames < 3) {
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			drawPoints(mode);
+			glFinish();
+			frames++;
+			ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
 		}
+		std::cout << VIEWMODE_NAMES[mode] << ": " << ms / frames << " ms per frame, "
+			<< (double)pointCount * frames / ms / 1000.0 << " million splats/s" << std::endl;
+	}
+	glUseProgram(0);
+	assert(glGetError() == GL_NO_ERROR);
+}
 
-		
-		// Draw points
-		glDrawArrays(GL_POINTS, 0, pointCount);  
+void display() {
+	try {
+		// Clear the back buffer
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// Unbind the VAO
-		glBindVertexArray(0);
+		// Get ready to draw
+		glUseProgram(shader);
+
+		drawPoints(viewmode);
 
 		assert(glGetError() == GL_NO_ERROR);
 
@@ -483,6 +501,12 @@ void display() {
 
 		glutPostRedisplay();
 
+		// Only now is the window mapped at its size with the points uploaded
+		if (benchmarkPending) {
+			benchmarkPending = false;
+			glutTimerFunc(0, benchmarkAndExit, 0);
+		}
+
 
 	} catch (const exception& e) {
 		cerr << "Fatal error: " << e.what() << endl;
@@ -517,8 +541,26 @@ void keyPressed(unsigned char key, int x, int y)
 		break;
 	case 'm':
 		viewmode = (viewmode + 1) % 3;
+		std::cout << "Splats: " << VIEWMODE_NAMES[viewmode] << std::endl;
+		glutPostRedisplay();
+		break;
+	case '+':
+	case '=':
+	case '-':
+		// Double or halve the grid, regridding from the image's summed-area table
+		gridSize = key == '-' ? gridSize / 2 : gridSize * 2;
+		initPoints();
+		glutPostRedisplay();
+		break;
+	case 'f':
+		// One point per pixel, clamped to the image by determineGridSize
+		gridSize = INT_MAX;
+		initPoints();
 		glutPostRedisplay();
 		break;
+	case 'b':
+		benchmarkSplats();
+		break;
 	}
 }
 
@@ -601,6 +643,12 @@ void idle() {
 	
 }
 
+// Timer set by the first display with --bench; cleanup runs as the window closes
+void benchmarkAndExit(int value) {
+	benchmarkSplats();
+	glutLeaveMainLoop();
+}
+
 void menu(int cmd) {
 	switch (cmd) {
 	case MENU_VIEWMODE:
@@ -6,10 +6,13 @@ layout(location = 1) in vec4 norm;		// Model-space normal
 smooth out vec4 fragNorm;	// Model-space interpolated normal
 
 uniform mat4 xform;			// Model-to-clip space transform
+uniform float pointScale;	// Point size in pixels at clip w = 1
 
 void main() {
 	// Transform vertex position
 	gl_Position = xform * vec4(pos, 1.0);
+	// Splats keep their size in the scene, shrinking with distance
+	gl_PointSize = pointScale / gl_Position.w;
 
 	// Interpolate normals
 	fragNorm = norm;
@@ -0,0 +1,77 @@
+#include "summedarea.hpp"
+#include "util.hpp"
+#include <algorithm>
+using namespace std;
+using namespace glm;
+
+void SummedAreaTable::build(const unsigned char* data, int width, int height, int channels, int threads) {
+	this->width = width;
+	this->height = height;
+	size_t stride = width + 1;
+	sums.assign(stride * (height + 1), Sums());
+	if (threads <= 0)
+		threads = std::max(1, (int)thread::hardware_concurrency());
+
+	// Every thread first sums along its band of rows, then down its band of columns
+	int rowThreads = std::max(1, std::min(threads, height));
+	parallelFor(rowThreads, [&](int t) {
+		int first = height * t / rowThreads, last = height * (t + 1) / rowThreads;
+		for (int y = first; y < last; y++) {
+			// Table row y + 1 holds image row y from the bottom
+			const unsigned char* pixel = data + (size_t)(height - 1 - y) * width * channels;
+			Sums* row = &sums[(y + 1) * stride];
+			Sums run = Sums();
+			for (int x = 0; x < width; x++, pixel += channels) {
+				if (channels >= 3) {
+					run.c[0] += pixel[0];
+					run.c[1] += pixel[1];
+					run.c[2] += pixel[2];
+					run.c[3] += channels == 4 ? pixel[3] : 255;
+				} else {
+					run.c[0] += pixel[0];
+					run.c[1] += pixel[0];
+					run.c[2] += pixel[0];
+					run.c[3] += channels == 2 ? pixel[1] : 255;
+				}
+				row[x + 1] = run;
+			}
+		}
+	});
+
+	int columnThreads = std::max(1, std::min(threads, width));
+	parallelFor(columnThreads, [&](int t) {
+		size_t first = 1 + (size_t)width * t / columnThreads, last = 1 + (size_t)width * (t + 1) / columnThreads;
+		for (int y = 2; y <= height; y++) {
+			const Sums* below = &sums[(y - 1) * stride];
+			Sums* row = &sums[y * stride];
+			for (size_t x = first; x < last; x++)
+				for (int c = 0; c < 4; c++)
+					row[x].c[c] += below[x].c[c];
+		}
+	});
+}
+
+void SummedAreaTable::clear() {
+	width = height = 0;
+	sums.clear();
+	sums.shrink_to_fit();
+}
+
+vec4 SummedAreaTable::average(int x0, int y0, int x1, int y1) const {
+	x0 = glm::clamp(x0, 0, width);
+	x1 = glm::clamp(x1, 0, width);
+	y0 = glm::clamp(y0, 0, height);
+	y1 = glm::clamp(y1, 0, height);
+	if (x1 <= x0 || y1 <= y0) return vec4(0.0f);
+
+	size_t stride = width + 1;
+	const Sums& a = sums[y0 * stride + x0];
+	const Sums& b = sums[y0 * stride + x1];
+	const Sums& c = sums[y1 * stride + x0];
+	const Sums& d = sums[y1 * stride + x1];
+	double count = (double)(x1 - x0) * (y1 - y0);
+	vec4 avg;
+	for (int k = 0; k < 4; k++)
+		avg[k] = (float)((d.c[k] - b.c[k] - c.c[k] + a.c[k]) / count);
+	return avg;
+}
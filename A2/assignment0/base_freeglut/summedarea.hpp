@@ -0,0 +1,37 @@
+#ifndef SUMMEDAREA_HPP
+#define SUMMEDAREA_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Integral image of an 8-bit image: entry (x, y) holds the RGBA sums of every pixel left of
+// column x and below row y, so the average of any rectangle takes four lookups whatever its size
+class SummedAreaTable {
+public:
+	SummedAreaTable() : width(0), height(0) {}
+
+	// Sum data, rows top to bottom as stb_image loads them, on threads (0 for every hardware
+	// thread). One or two channels are gray and alpha, images without alpha are opaque.
+	void build(const unsigned char* data, int width, int height, int channels, int threads = 0);
+	void clear();
+
+	// Average RGBA in [0, 255] over columns x0 .. x1 - 1 and rows y0 .. y1 - 1, rows counted from
+	// the bottom of the image
+	glm::vec4 average(int x0, int y0, int x1, int y1) const;
+
+	bool empty() const { return sums.empty(); }
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+protected:
+	// Channel sums of one entry; 64 bits hold any image stb_image can load
+	struct Sums {
+		uint64_t c[4];
+	};
+
+	int width, height;
+	std::vector<Sums> sums;		// (width + 1) x (height + 1), row 0 and column 0 all zero
+};
+
+#endif
@@ -3,9 +3,21 @@
 
 #include <string>
 #include <vector>
+#include <thread>
 #include "gl_core_3_3.h"
 
 GLuint compileShader(GLenum type, std::string filename, std::string prepend = "");
 GLuint linkProgram(std::vector<GLuint> shaders);
 
+// Run f(0) .. f(count - 1) on count threads
+template <class F>
+void parallelFor(int count, F f) {
+	std::vector<std::thread> tasks;
+	for (int i = 1; i < count; i++)
+		tasks.push_back(std::thread(f, i));
+	f(0);
+	for (size_t i = 0; i < tasks.size(); i++)
+		tasks[i].join();
+}
+
 #endif
\ No newline at end of file